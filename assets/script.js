@@ -57,6 +57,7 @@ async function onQueryClick() {
     const query     = document.getElementById("queryInput").value;
     const startTime = document.getElementById("startTime").value;
     const endTime   = document.getElementById("endTime").value;
+    const group     = document.getElementById("groupInput").value;
 
     // const query     = "ASK What happened with request f457dd4c-207b-4db3-8c52-afbfd97e636f?";
     
@@ -92,7 +93,7 @@ async function onQueryClick() {
                 drawLogs(newQuery, logs, results);
 
                 question += '\n' + message;
-                question += '\n' + "SEARCH_RESULT" + logs;
+                question += '\n' + "SEARCH_RESULT" + logs.map(line => line.text + '\n').join("");
             } else {
                 break;
             }
@@ -125,30 +126,79 @@ async function onQueryClick() {
         */
     }
 
-    const parameters = `query=${query}&start=${startTime}&end=${endTime}&page=${page}`;
-    const response   = await fetch(`api/query?${parameters}`);
+    // The server answers with an estimated histogram within about 50 ms and
+    // then refines it with exact ones.
+    // With a group the server also counts the most common values of that
+    // field, or the most common terms for *, in the matching lines.
+    let parameters = `query=${query}&start=${startTime}&end=${endTime}&page=${page}&approximate=50`;
+    if (group.length > 0) {
+	parameters += `&group=${encodeURIComponent(group)}`;
+    }
+    const response = await fetch(`api/query?${parameters}`);
 
-    for await (const chunk of response.body) {
-	const reader = { input: chunk, offset: 0 };
+    const status       = document.getElementById("status");
+    status.textContent = "";
+    document.getElementById("coverage").textContent = "";
+    document.getElementById("top").replaceChildren();
+
+    for await (const frames of readFrames(response.body)) {
+	const reader = { input: frames, offset: 0 };
 
 	while (reader.offset < reader.input.length) {
 	    const tag = read_int(reader);
 
-	    if (tag === 1) {
-		const logs_size = read_int(reader);
-		const logs      = read_string(reader, logs_size);
-		noResults       = logs.length == 0;
+	    if (tag === 7) {
+		const lines = read_page(reader);
 		
 		const results            = document.getElementById("mainResults");
 		results.style.visibility = "visible";
 		results.replaceChildren();
 
-		drawLogs(query, logs, results);
+		drawLogs(query, lines, results);
 
 	    } else if (tag === 2) {
 		const bins      = read_int(reader);
-		const histogram = read_ints(reader, bins);
+		const histogram    = read_ints(reader, bins);
+		status.textContent = "";
 		drawGraph(histogram);
+
+	    } else if (tag === 3) {
+		const size    = read_int(reader);
+		const partial = read_ints(reader, size / 4);
+		drawPartial(partial, status);
+
+	    } else if (tag === 4) {
+		const size        = read_int(reader);
+		const approximate = read_ints(reader, size / 4);
+		drawApproximate(approximate, status);
+
+	    } else if (tag === 5) {
+		const size  = read_int(reader);
+		const end   = reader.offset + size;
+		const count = read_int(reader);
+		const total = read_int(reader);
+		read_int(reader);
+
+		const values = [];
+		for (let i = 0; i < count; i++) {
+		    const [valueCount, error, valueSize] = read_ints(reader, 3);
+		    const value = read_string(reader, valueSize);
+		    reader.offset += (4 - valueSize % 4) % 4;
+		    values.push({ value, count: valueCount, error });
+		}
+		reader.offset = end;
+		drawTop(values, total);
+
+	    } else if (tag === 6) {
+		const size     = read_int(reader);
+		const coverage = read_ints(reader, size / 4);
+		drawCoverage(coverage);
+
+	    } else {
+		// Frames after the histogram carry their size, so unknown ones can
+		// be skipped.
+		const size     = read_int(reader);
+		reader.offset += size;
 	    }
 	}
     }
@@ -178,24 +228,57 @@ async function ask(question) {
 async function getLogs(query, startTime, endTime) {
     const parameters = `query=${query}&start=${startTime}&end=${endTime}&page=${page}`;
     const response   = await fetch(`api/query?${parameters}`);
-    const body       = response.body.getReader();
 
-    while (true) {
-	const { done, value: chunk } = await body.read();
-	if (done) {
-	    break;
+    for await (const frames of readFrames(response.body)) {
+	const reader = { input: frames, offset: 0 };
+	while (reader.offset < reader.input.length) {
+	    const tag = read_int(reader);
+	    if (tag === 7) {
+		return read_page(reader);
+	    }
+	    const size     = read_int(reader);
+	    reader.offset += tag === 2 ? 4 * size : size;
 	}
-	
-        const reader = { input: chunk, offset: 0 };
-        const tag    = read_int(reader);
-        if (tag === 1) {
-	    const logs_size = read_int(reader);
-	    const logs      = read_string(reader, logs_size);
-	    return logs;
-        }
     }
     
-    return "";
+    return [];
+}
+
+// Reads can end anywhere in a frame, compressed ones especially, so bytes are
+// kept until a frame's 8 byte header and its whole payload are in, and only
+// whole frames are handed on. A histogram's size counts bins, every other
+// frame's counts bytes.
+async function* readFrames(body) {
+    let buffer = new Uint8Array(1 << 16);
+    let used   = 0;
+
+    for await (const chunk of body) {
+	if (used + chunk.length > buffer.length) {
+	    const grown = new Uint8Array(Math.max(2 * buffer.length, used + chunk.length));
+	    grown.set(buffer.subarray(0, used));
+	    buffer = grown;
+	}
+	buffer.set(chunk, used);
+	used += chunk.length;
+
+	const view = new DataView(buffer.buffer);
+	let   end  = 0;
+	while (used - end >= 8) {
+	    const tag  = view.getInt32(end, true);
+	    const size = view.getInt32(end + 4, true);
+	    const next = end + 8 + (tag === 2 ? 4 * size : size);
+	    if (next > used) {
+		break;
+	    }
+	    end = next;
+	}
+
+	if (end > 0) {
+	    yield buffer.slice(0, end);
+	    buffer.copyWithin(0, end, used);
+	    used -= end;
+	}
+    }
 }
 
 function read_int(reader) {
@@ -228,6 +311,82 @@ function read_string(reader, size) {
     return result;
 }
 
+const levelNames = ["", "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"];
+
+// Pages come in columns: times in seconds after the start, offsets and
+// lengths into the text, and a level for every line. Lines from different
+// indexes are not in order, so they are sorted by time here.
+function read_page(reader) {
+    const size = read_int(reader);
+    const end  = reader.offset + size;
+
+    const [count, textSize, startLow, startHigh] = read_ints(reader, 4);
+    const start   = startHigh * 2 ** 32 + (startLow >>> 0);
+    const times   = read_ints(reader, count);
+    const offsets = read_ints(reader, count);
+    const lengths = read_ints(reader, count);
+    const levels  = reader.input.subarray(reader.offset, reader.offset + count);
+    reader.offset += count + (4 - count % 4) % 4;
+    const text     = reader.input.subarray(reader.offset, reader.offset + textSize);
+    reader.offset  = end;
+
+    const decoder = new TextDecoder();
+    const lines   = [];
+    for (let i = 0; i < count; i++) {
+	lines.push({
+	    time:  start + times[i],
+	    level: levelNames[levels[i]] ?? "",
+	    text:  decoder.decode(text.subarray(offsets[i], offsets[i] + lengths[i])),
+	});
+    }
+    lines.sort((a, b) => a.time - b.time);
+    return lines;
+}
+
+function drawPartial(partial, status) {
+    const [reason, milliseconds, indexesSearched, indexCount, linesScanned] = partial;
+    const why = reason === 1 ? "ran past its deadline" : reason === 3 ? "lost a shard" : "was cancelled";
+    status.textContent =
+	`Partial results: the query ${why} after ${milliseconds} ms, ` +
+	`having searched ${indexesSearched} of ${indexCount} files and scanned ${linesScanned} lines.`;
+}
+
+// Sent while the server is still indexing, so the results are missing
+// whatever it has not gotten to yet.
+function drawCoverage(coverage) {
+    const [filesIndexed, fileCount, kilobytesIndexed, kilobytesTotal] = coverage;
+    const percent = kilobytesTotal > 0 ? Math.floor(100 * kilobytesIndexed / kilobytesTotal) : 100;
+    document.getElementById("coverage").textContent =
+	`Still indexing: these results cover ${filesIndexed} of ${fileCount} files (${percent}% of the logs).`;
+}
+
+function drawApproximate(approximate, status) {
+    const [bins, samples, postings] = approximate;
+    const estimate = approximate.subarray(3, 3 + bins);
+    const error    = approximate.subarray(3 + bins, 3 + 2 * bins);
+    drawGraph(estimate);
+
+    const widest = error.reduce((a, b) => Math.max(a, b), 0);
+    status.textContent =
+	`Estimated from ${samples} of ${postings} matching lines, ` +
+	`every bar within \u00b1${widest} at 95% confidence. Refining...`;
+}
+
+// Counts are upper bounds, and an error means the value may have been counted
+// up to that many times less.
+function drawTop(values, total) {
+    const top = document.getElementById("top");
+    top.replaceChildren();
+    for (const { value, count, error } of values) {
+	const item       = document.createElement("li");
+	const percent    = total > 0 ? (100 * count / total).toFixed(1) : "0.0";
+	item.textContent = error > 0
+	    ? `${value}: ${count - error} to ${count} (${percent}%)`
+	    : `${value}: ${count} (${percent}%)`;
+	top.appendChild(item);
+    }
+}
+
 function drawGraph(values) {
     const graphWidth        = 600;
     const graphHeight       = 400;
@@ -333,7 +492,7 @@ function drawGraph(values) {
     }
 }
 
-function drawLogs(query, logs, results) {
+function drawLogs(query, lines, results) {
     const header = document.createElement("div");
     header.setAttribute("id", "header");
     results.appendChild(header);
@@ -360,20 +519,25 @@ function drawLogs(query, logs, results) {
     nextPage.addEventListener("click", () => { page = page + 1; onQueryClick(); });
     pageButtons.appendChild(nextPage);
 
-    for (let line of logs.split("\n")) {
-	if (line.length > 0) {
-	    for (const word of query.split(' ')) {
-		if (word !== "OR") {
-		    line = line.replaceAll(word, `<span class=\"found\">${word}</span>`);
-		}
+    for (const { level, text } of lines) {
+	let line = text;
+	// The indexer may fold case, so matches are highlighted however they
+	// are spelled.
+	for (const word of query.split(' ')) {
+	    if (word.length > 0 && word !== "OR") {
+		const pattern = new RegExp(word.replace(/[.*+?^${}()|[\]\\]/g, "\\$&"), "gi");
+		line = line.replace(pattern, (found) => `<span class=\"found\">${found}</span>`);
 	    }
-	    const result     = document.createElement("p");
-	    result.innerHTML = line;
-	    results.appendChild(result);
 	}
+	const result     = document.createElement("p");
+	result.innerHTML = line;
+	if (level.length > 0) {
+	    result.classList.add(`level${level}`);
+	}
+	results.appendChild(result);
     }
 
-    if (logs.length == 0) {
+    if (lines.length == 0) {
 	const result     = document.createElement("p");
 	result.innerHTML = "No matches found.";
 	results.appendChild(result);	
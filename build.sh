@@ -7,6 +7,13 @@ else
     exit 1
 fi
 
+# TRACE=1 bash build.sh compiles in the timing zones from code/trace.hpp.
+FLAGS="-g -std=c++20 -pthread"
+if [[ -n "$TRACE" ]]; then
+    FLAGS="$FLAGS -DTRACE"
+fi
+
 mkdir -p build
-"$CC" -g -std=c++20 code/main.cpp -o build/indexer
-"$CC" -g -std=c++20 code/test.cpp -o build/test
+"$CC" $FLAGS code/main.cpp -o build/indexer
+"$CC" $FLAGS code/test.cpp -o build/test
+"$CC" $FLAGS code/bench.cpp -o build/bench
@@ -1,16 +1,40 @@
+// Arenas reserve a large range of address space up front and commit it in
+// ARENA_COMMIT_SIZE steps as allocations reach it. A chained arena grabs a new
+// reservation when it runs out instead of failing, which means consecutive
+// allocations are no longer guaranteed to be contiguous, so only chain arenas
+// nobody uses end<T>() or append-style allocations on.
+
+#define ARENA_COMMIT_SIZE (1ll << 20)
+
 struct Arena {
-  U8* memory;
-  I64 used;
-  I64 size;
+  U8*    memory;
+  I64    used;
+  I64    committed;
+  I64    size;
+  I64    base;
+  I64    peak;
+  bool   chained;
+  Arena* previous;
 };
 
-static Arena make_arena(I64 size) {
-  U8* memory = (U8*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+static I64 arena_committed;
+static I64 arena_committed_peak;
+
+static void account(I64 delta) {
+  I64 committed = __atomic_add_fetch(&arena_committed, delta, __ATOMIC_RELAXED);
+  I64 peak      = __atomic_load_n(&arena_committed_peak, __ATOMIC_RELAXED);
+  while (committed > peak && !__atomic_compare_exchange_n(&arena_committed_peak, &peak, committed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static Arena make_arena(I64 size, bool chained = false) {
+  U8* memory = (U8*) mmap(NULL, size, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
   assert(memory != MAP_FAILED);
 
-  Arena arena  = {};
-  arena.memory = memory;
-  arena.size   = size;
+  Arena arena   = {};
+  arena.memory  = memory;
+  arena.size    = size;
+  arena.chained = chained;
   return arena;
 }
 
@@ -18,6 +42,45 @@ static I64 align(I64 address, I64 alignment) {
   return (address + alignment - 1) & ~(alignment - 1);
 }
 
+static void commit(Arena* arena, I64 end) {
+  if (end > arena->committed) {
+    I64 committed = min(align(end, ARENA_COMMIT_SIZE), arena->size);
+    assert(mprotect(&arena->memory[arena->committed], committed - arena->committed, PROT_READ | PROT_WRITE) == 0);
+    account(committed - arena->committed);
+    arena->committed = committed;
+  }
+}
+
+// Gives every committed page past the first ARENA_COMMIT_SIZE bytes that are
+// not in use back to the operating system.
+static void decommit(Arena* arena) {
+  I64 keep = align(arena->used, ARENA_COMMIT_SIZE);
+  if (keep < ARENA_COMMIT_SIZE) {
+    keep = ARENA_COMMIT_SIZE;
+  }
+  if (keep < arena->committed) {
+    U8* start = &arena->memory[keep];
+    I64 size  = arena->committed - keep;
+    assert(madvise(start, size, MADV_DONTNEED) == 0);
+    assert(mprotect(start, size, PROT_NONE) == 0);
+    account(-size);
+    arena->committed = keep;
+  }
+}
+
+static void chain(Arena* arena, I64 size) {
+  I64   reserve = arena->size > size + (I64) sizeof(Arena) ? arena->size : align(size + sizeof(Arena), ARENA_COMMIT_SIZE);
+  Arena next    = make_arena(reserve, true);
+  next.base     = arena->base + arena->size;
+  next.peak     = arena->peak;
+
+  commit(&next, sizeof(Arena));
+  next.previous  = (Arena*) next.memory;
+  *next.previous = *arena;
+  next.used      = sizeof(Arena);
+  *arena         = next;
+}
+
 template <typename T>
 static T* end(Arena* arena) {
   arena->used = align(arena->used, alignof(T));
@@ -25,11 +88,24 @@ static T* end(Arena* arena) {
 }
 
 static String allocate_bytes(Arena* arena, I64 size, I64 alignment) {
-  arena->used = align(arena->used, alignment);
-  U8* result  = (U8*) &arena->memory[arena->used];
+  I64 start = align(arena->used, alignment);
+  if (start + size > arena->size) {
+    if (!arena->chained) {
+      println(ERROR "Arena ran out of its ", arena->size, " reserved bytes.");
+      flush();
+      abort();
+    }
+    chain(arena, size + alignment);
+    start = align(arena->used, alignment);
+  }
+  commit(arena, start + size);
+
+  U8* result = &arena->memory[start];
   memset(result, 0, size);
-  arena->used += size;
-  assert(arena->used <= arena->size);
+  arena->used = start + size;
+  if (arena->base + arena->used > arena->peak) {
+    arena->peak = arena->base + arena->used;
+  }
   return String(result, size);
 }
 
@@ -43,16 +119,39 @@ static T* allocate_array(Arena* arena, I64 count) {
   return (T*) allocate_bytes(arena, sizeof(T) * count, alignof(T)).data;
 }
 
+static void pop(Arena* arena) {
+  Arena previous = *arena->previous;
+  previous.peak  = arena->peak;
+  account(-arena->committed);
+  assert(munmap(arena->memory, arena->size) == 0);
+  *arena = previous;
+}
+
 static void destroy(Arena* arena) {
+  while (arena->previous != nullptr) {
+    pop(arena);
+  }
+  account(-arena->committed);
   assert(munmap(arena->memory, arena->size) == 0);
 }
 
 static I64 save(Arena* arena) {
-  return arena->used;
+  return arena->base + arena->used;
 }
 
 static void restore(Arena* arena, I64 saved) {
-  arena->used = saved;
+  while (arena->previous != nullptr && saved <= arena->base) {
+    pop(arena);
+  }
+  arena->used = saved - arena->base;
+}
+
+static I64 committed_bytes(Arena* arena) {
+  I64 committed = arena->committed;
+  for (Arena* block = arena->previous; block != nullptr; block = block->previous) {
+    committed += block->committed;
+  }
+  return committed;
 }
 
 static String concatonate_paths(Arena* arena, String a, String b) {
@@ -63,3 +162,20 @@ static String concatonate_paths(Arena* arena, String a, String b) {
   result.data[result.size - 1] = 0;
   return result;
 }
+
+// directory/<file name of source_path><extension>, for files derived from a log.
+static String derived_path(Arena* arena, String directory, String source_path, String extension) {
+  if (source_path.size > 0 && source_path[source_path.size - 1] == 0) {
+    source_path.size--;
+  }
+  I64 slash = source_path.size - 1;
+  while (slash >= 0 && source_path[slash] != '/') {
+    slash--;
+  }
+  String name = suffix(source_path, slash + 1);
+
+  String file_name = allocate_bytes(arena, name.size + extension.size, 1);
+  memcpy(file_name.data, name.data, name.size);
+  memcpy(&file_name[name.size], extension.data, extension.size);
+  return concatonate_paths(arena, directory, file_name);
+}
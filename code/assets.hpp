@@ -0,0 +1,176 @@
+// The web UI's files are read once into complete responses, one as is and one
+// gzipped, so serving one is a single write from memory. The files are checked
+// at most once every ASSET_CHECK_INTERVAL and all of them are reloaded if any
+// changed, so edits show up without a restart. Responses carry a hash of the
+// contents as their ETag, with -gz after it for the gzipped one since the two
+// are different representations, and clients that revalidate with either get a
+// 304 for it.
+
+#define ASSET_CHECK_INTERVAL 1000000000ll
+
+struct Asset {
+  String      request;
+  const char* path;
+  String      content_type;
+  bool        loaded            = false;
+  I64         size              = 0;
+  I64         modified          = 0;
+  I64         inode             = 0;
+  String      etag              = {};
+  String      gzip_etag         = {};
+  String      response          = {};
+  String      gzip_response     = {};
+  String      not_modified      = {};
+  String      gzip_not_modified = {};
+};
+
+struct Assets {
+  Arena arena;
+  Asset assets[5];
+  I64   checked = 0;
+};
+
+static Assets assets = {
+  {},
+  {
+    { "GET / ",            "assets/index.html",  "text/html; charset=utf-8" },
+    { "GET /styles.css ",  "assets/styles.css",  "text/css" },
+    { "GET /script.js ",   "assets/script.js",   "text/javascript" },
+    { "GET /api_key.js ",  "assets/api_key.js",  "text/javascript" },
+    { "GET /favicon.ico ", "assets/favicon.ico", "image/ico" },
+  },
+};
+
+static String build_response(Arena* arena, Asset* asset, String encoding, String etag, String body) {
+  I64    saved    = save(arena);
+  String response = allocate_bytes(arena, 0, 1);
+  append(arena, "HTTP/1.1 200 OK\r\nContent-Length: ", body.size, "\r\nContent-Type: ", asset->content_type, "\r\n");
+  if (encoding.size > 0) {
+    append(arena, "Content-Encoding: ", encoding, "\r\n");
+  }
+  append(arena, "Cache-Control: no-cache\r\nVary: Accept-Encoding\r\nETag: ", etag, "\r\n\r\n", body);
+  response.size = save(arena) - saved;
+  return response;
+}
+
+static String build_not_modified(Arena* arena, String etag) {
+  I64    saved    = save(arena);
+  String response = allocate_bytes(arena, 0, 1);
+  append(arena, "HTTP/1.1 304 Not Modified\r\nCache-Control: no-cache\r\nVary: Accept-Encoding\r\nETag: ", etag, "\r\n\r\n");
+  response.size = save(arena) - saved;
+  return response;
+}
+
+// Missing files are not an error, they are just not served.
+static void load_asset(Arena* arena, Asset* asset) {
+  asset->loaded = false;
+
+  I32 fd = open(asset->path, O_RDONLY);
+  if (fd == -1) {
+    println(WARN "Failed to open \"", asset->path, "\": ", get_error(), '.');
+    return;
+  }
+
+  struct stat info = {};
+  if (fstat(fd, &info) == -1) {
+    println(WARN "Failed to stat \"", asset->path, "\": ", get_error(), '.');
+    assert(close(fd) == 0);
+    return;
+  }
+
+  String body   = allocate_bytes(arena, info.st_size, 1);
+  I64    filled = 0;
+  while (filled < body.size) {
+    I64 result = read(fd, &body[filled], body.size - filled);
+    if (result <= 0) {
+      println(WARN "Failed to read \"", asset->path, "\": ", result == 0 ? String("file shrank") : get_error(), '.');
+      assert(close(fd) == 0);
+      return;
+    }
+    filled += result;
+  }
+  assert(close(fd) == 0);
+
+  asset->size     = info.st_size;
+  asset->modified = info.st_mtime;
+  asset->inode    = info.st_ino;
+
+  char etag[24]      = {};
+  char gzip_etag[28] = {};
+  U64  hash          = hash_word(body);
+  snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long) hash);
+  snprintf(gzip_etag, sizeof(gzip_etag), "\"%016llx-gz\"", (unsigned long long) hash);
+  asset->etag      = allocate_bytes(arena, strlen(etag), 1);
+  asset->gzip_etag = allocate_bytes(arena, strlen(gzip_etag), 1);
+  memcpy(asset->etag.data, etag, asset->etag.size);
+  memcpy(asset->gzip_etag.data, gzip_etag, asset->gzip_etag.size);
+
+  asset->response      = build_response(arena, asset, "", asset->etag, body);
+  asset->not_modified  = build_not_modified(arena, asset->etag);
+  asset->gzip_response = {};
+  String compressed    = gzip_compress(arena, body);
+  if (compressed.size < body.size) {
+    asset->gzip_response     = build_response(arena, asset, "gzip", asset->gzip_etag, compressed);
+    asset->gzip_not_modified = build_not_modified(arena, asset->gzip_etag);
+  }
+
+  asset->loaded = true;
+}
+
+static void load_assets() {
+  if (assets.arena.memory == nullptr) {
+    assets.arena = make_arena(1ll << 32);
+  }
+  restore(&assets.arena, 0);
+  for (I64 i = 0; i < (I64) length(assets.assets); i++) {
+    load_asset(&assets.arena, &assets.assets[i]);
+  }
+  decommit(&assets.arena);
+  assets.checked = now_nanoseconds();
+}
+
+static bool assets_changed() {
+  for (I64 i = 0; i < (I64) length(assets.assets); i++) {
+    Asset*      asset  = &assets.assets[i];
+    struct stat info   = {};
+    bool        exists = stat(asset->path, &info) == 0;
+    if (exists != asset->loaded) {
+      return true;
+    }
+    if (exists && (info.st_size != asset->size || info.st_mtime != asset->modified || (I64) info.st_ino != asset->inode)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns false unless the request is for an asset that could be loaded.
+static bool serve_asset(I32 connection_fd, String request) {
+  if (now_nanoseconds() - assets.checked >= ASSET_CHECK_INTERVAL) {
+    if (assets_changed()) {
+      println(INFO "Assets changed, reloading them.");
+      load_assets();
+    }
+    assets.checked = now_nanoseconds();
+  }
+
+  for (I64 i = 0; i < (I64) length(assets.assets); i++) {
+    Asset* asset = &assets.assets[i];
+    if (!asset->loaded || !starts_with(request, asset->request)) {
+      continue;
+    }
+
+    String cached = header_value(request, "If-None-Match");
+    if (contains(cached, asset->etag)) {
+      write_response(connection_fd, asset->not_modified);
+    } else if (asset->gzip_response.size > 0 && contains(cached, asset->gzip_etag)) {
+      write_response(connection_fd, asset->gzip_not_modified);
+    } else if (asset->gzip_response.size > 0 && accepts_encoding(header_value(request, "Accept-Encoding"), "gzip")) {
+      write_response(connection_fd, asset->gzip_response);
+    } else {
+      write_response(connection_fd, asset->response);
+    }
+    return true;
+  }
+  return false;
+}
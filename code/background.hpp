@@ -0,0 +1,232 @@
+// Files are indexed on a pool of threads, newest first, while the main thread
+// already answers queries over whatever is indexed so far. Every finished
+// index is pushed onto the list under the lock, and requests only take it to
+// snapshot the list, so a query sees a file either completely or not at all
+// and indexing never waits for one. Once every file is in, the last thread to
+// finish compacts the list.
+
+struct LogFile {
+  String path;
+  I64    size;
+  I64    modified;
+};
+
+struct Indexing {
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  Options*        options;
+  Index*          indexes;
+  LogFile*        files;
+  I32             file_count;
+  I32             next_file;
+  I32             files_indexed;
+  I64             bytes_total;
+  I64             bytes_indexed;
+  I32             threads_left;
+  bool            done;
+};
+
+static Indexing indexing;
+
+// The indexes a request works on, each of them held until it is done, and how
+// far indexing had come when it started. Compaction relinks the list, so the
+// indexes are copied out of it.
+struct Snapshot {
+  Index** indexes;
+  I32     index_count;
+  I32     files_indexed;
+  I32     file_count;
+  I64     bytes_indexed;
+  I64     bytes_total;
+  bool    done;
+};
+
+static Snapshot take_snapshot(Arena* arena) {
+  Snapshot snapshot = {};
+  pthread_mutex_lock(&indexing.lock);
+  for (Index* index = indexing.indexes; index != nullptr; index = index->next) {
+    snapshot.index_count++;
+  }
+  snapshot.indexes = allocate_array<Index*>(arena, snapshot.index_count);
+  I32 i            = 0;
+  for (Index* index = indexing.indexes; index != nullptr; index = index->next) {
+    acquire_index(index);
+    snapshot.indexes[i] = index;
+    i++;
+  }
+  snapshot.files_indexed = indexing.files_indexed;
+  snapshot.file_count    = indexing.file_count;
+  snapshot.bytes_indexed = indexing.bytes_indexed;
+  snapshot.bytes_total   = indexing.bytes_total;
+  snapshot.done          = indexing.done;
+  pthread_mutex_unlock(&indexing.lock);
+  return snapshot;
+}
+
+static void release_snapshot(Snapshot* snapshot) {
+  for (I32 i = 0; i < snapshot->index_count; i++) {
+    release_index(snapshot->indexes[i]);
+  }
+}
+
+// Threads index into arenas of their own, laid out like main's: index and
+// node, which are chained, then scratch. Words go to the dictionary.
+struct IndexThread {
+  pthread_t thread;
+  Arena     arenas[3];
+};
+
+static I32 compare_log_files(const void* a, const void* b) {
+  LogFile* left  = (LogFile*) a;
+  LogFile* right = (LogFile*) b;
+  if (left->modified != right->modified) {
+    return left->modified > right->modified ? -1 : 1;
+  }
+  return compare(left->path, right->path);
+}
+
+// A log can be rotated away between listing the directory and looking at it,
+// and is then left out like any other log that cannot be indexed.
+static void add_log_file(Arena* arena, String path, I64* capacity) {
+  struct stat info = {};
+  if (stat((char*) path.data, &info) == -1) {
+    println(WARN "Skipped \"", path, "\", failed to stat it: ", get_error(), '.');
+    return;
+  }
+
+  if (indexing.file_count == *capacity) {
+    *capacity       = *capacity == 0 ? 64 : 2 * *capacity;
+    LogFile* grown  = allocate_array<LogFile>(arena, *capacity);
+    if (indexing.file_count > 0) {
+      memcpy(grown, indexing.files, sizeof(LogFile) * indexing.file_count);
+    }
+    indexing.files = grown;
+  }
+
+  LogFile* file  = &indexing.files[indexing.file_count];
+  file->path     = path;
+  file->size     = info.st_size;
+  file->modified = info.st_mtime;
+  indexing.file_count++;
+  indexing.bytes_total += info.st_size;
+}
+
+// A shard only indexes the files of a directory whose names hash to it.
+static void list_log_files(Arena* arena, Options* options, char* logs_path) {
+  indexing.options = options;
+
+  struct stat info = {};
+  if (stat(logs_path, &info)) {
+    println(ERROR "Failed to stat \"", logs_path, "\": ", get_error(), '.');
+    exit(EXIT_FAILURE);
+  }
+
+  I64 capacity = 0;
+  if (S_ISREG(info.st_mode)) {
+    add_log_file(arena, logs_path, &capacity);
+  }
+
+  if (S_ISDIR(info.st_mode)) {
+    DIR* dir = opendir(logs_path);
+    assert(dir != NULL);
+
+    while (true) {
+      dirent* entry = readdir(dir);
+      if (entry == NULL) {
+	break;
+      }
+
+      String log_path = entry->d_name;
+      if (log_path == "." || log_path == "..") {
+	continue;
+      }
+      if (options->shard_count > 0 && hash_word(log_path) % options->shard_count != (U64) options->shard) {
+	continue;
+      }
+      add_log_file(arena, concatonate_paths(arena, logs_path, log_path), &capacity);
+    }
+
+    assert(closedir(dir) == 0);
+  }
+
+  qsort(indexing.files, indexing.file_count, sizeof(LogFile), compare_log_files);
+}
+
+static void index_files(Arena* index_arena, Arena* node_arena, Arena* scratch_arena) {
+  while (true) {
+    pthread_mutex_lock(&indexing.lock);
+    I32 next = indexing.next_file;
+    if (next < indexing.file_count) {
+      indexing.next_file++;
+    }
+    pthread_mutex_unlock(&indexing.lock);
+    if (next == indexing.file_count) {
+      break;
+    }
+
+    LogFile* file = &indexing.files[next];
+    println(INFO "Indexing \"", file->path, "\".");
+    flush();
+
+    Index* index = index_file(index_arena, node_arena, scratch_arena, indexing.options, file->path);
+
+    // Skipped files still count towards the coverage, no query will ever see
+    // more of them.
+    pthread_mutex_lock(&indexing.lock);
+    if (index != nullptr) {
+      index->next      = indexing.indexes;
+      indexing.indexes = index;
+    }
+    indexing.files_indexed++;
+    indexing.bytes_indexed += file->size;
+    pthread_mutex_unlock(&indexing.lock);
+  }
+
+  pthread_mutex_lock(&indexing.lock);
+  indexing.threads_left--;
+  bool last = indexing.threads_left == 0;
+  pthread_mutex_unlock(&indexing.lock);
+
+  if (last) {
+    compact_indexes(index_arena, scratch_arena, indexing.options, &indexing.indexes, &indexing.lock);
+    pthread_mutex_lock(&indexing.lock);
+    indexing.done = true;
+    pthread_mutex_unlock(&indexing.lock);
+    println(INFO "Indexed all ", (I64) indexing.file_count, " files.");
+    flush();
+  }
+}
+
+static void* run_index_thread(void* argument) {
+  IndexThread* thread = (IndexThread*) argument;
+  index_files(&thread->arenas[0], &thread->arenas[1], &thread->arenas[2]);
+  decommit(&thread->arenas[2]);
+  return nullptr;
+}
+
+// Without threads the files are indexed right here, before the caller goes
+// on to listen.
+static void start_indexing(Arena* arena, Arena* arenas, I64 thread_count) {
+  if (indexing.file_count == 0) {
+    indexing.done = true;
+    return;
+  }
+
+  if (thread_count == 0) {
+    indexing.threads_left = 1;
+    index_files(&arenas[0], &arenas[1], &arenas[4]);
+    return;
+  }
+
+  thread_count          = min(thread_count, (I64) indexing.file_count);
+  indexing.threads_left = thread_count;
+  IndexThread* threads  = allocate_array<IndexThread>(arena, thread_count);
+  for (I64 i = 0; i < thread_count; i++) {
+    for (I64 j = 0; j < 2; j++) {
+      threads[i].arenas[j] = make_arena(1ll << 36, true);
+    }
+    threads[i].arenas[2] = make_arena(1ll << 36);
+    assert(pthread_create(&threads[i].thread, NULL, run_index_thread, &threads[i]) == 0);
+    assert(pthread_detach(threads[i].thread) == 0);
+  }
+  println(INFO "Indexing ", (I64) indexing.file_count, " files on ", thread_count, " threads.");
+}
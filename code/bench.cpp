@@ -0,0 +1,439 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "prelude.hpp"
+#include "print.hpp"
+#include "arena.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+#include "mapping.hpp"
+#include "trace.hpp"
+#include "lz4.hpp"
+#include "deflate.hpp"
+#include "chunks.hpp"
+#include "blocks.hpp"
+#include "bloom.hpp"
+#include "dictionary.hpp"
+#include "tokenizer.hpp"
+#include "template.hpp"
+#include "segment.hpp"
+#include "index.hpp"
+#include "top.hpp"
+#include "query.hpp"
+
+// Generates a deterministic synthetic log, indexes it and runs lookups and
+// queries against it. Results are written as a single JSON object so runs can
+// be compared by scripts.
+
+struct BenchOptions {
+  I64    size;
+  I64    vocabulary;
+  F64    zipf;
+  I64    uuids;
+  bool   edgar;
+  U64    seed;
+  I64    queries;
+  String directory;
+  String output;
+};
+
+static F64 next_unit(Random* random) {
+  return (next(random) >> 11) * (1.0 / (1ull << 53));
+}
+
+// cdf[i] is the probability of drawing a rank of at most i.
+static F64* make_zipf(Arena* arena, I64 count, F64 exponent) {
+  F64* cdf   = allocate_array<F64>(arena, count);
+  F64  total = 0;
+  for (I64 i = 0; i < count; i++) {
+    total  += 1.0 / pow(i + 1, exponent);
+    cdf[i]  = total;
+  }
+  for (I64 i = 0; i < count; i++) {
+    cdf[i] /= total;
+  }
+  return cdf;
+}
+
+static I64 sample_zipf(Random* random, F64* cdf, I64 count) {
+  F64 u    = next_unit(random);
+  I64 low  = 0;
+  I64 high = count - 1;
+  while (low < high) {
+    I64 middle = (low + high) / 2;
+    if (cdf[middle] < u) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Every rank maps to a distinct pronounceable word.
+static String make_word(U8 storage[32], I64 rank) {
+  static const char* syllables[] = {
+    "ka", "lo", "mi", "nu", "pe", "ra", "si", "to", "vu", "ze",
+    "ba", "de", "fi", "go", "hu", "ja", "ke", "li", "mo", "ny",
+  };
+
+  I64 size = 0;
+  do {
+    const char* syllable = syllables[rank % length(syllables)];
+    storage[size]        = syllable[0];
+    storage[size + 1]    = syllable[1];
+    size                += 2;
+    rank                /= length(syllables);
+  } while (rank > 0);
+  return String(storage, size);
+}
+
+static String make_uuid(U8 storage[36], U64 seed, I64 id) {
+  Random random = { seed ^ (id * 0xD1B54A32D192ED03ull) };
+  U64    high   = next(&random);
+  U64    low    = next(&random);
+
+  I64 size = 0;
+  for (I64 i = 0; i < 32; i++) {
+    if (i == 8 || i == 12 || i == 16 || i == 20) {
+      storage[size] = '-';
+      size++;
+    }
+    U64 word      = i < 16 ? high : low;
+    U8  digit     = (word >> (4 * (15 - i % 16))) & 0xF;
+    storage[size] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    size++;
+  }
+  return String(storage, size);
+}
+
+struct Generated {
+  String path;
+  I64    lines;
+  time_t first_time;
+  time_t last_time;
+};
+
+static Generated generate_logs(Arena* arena, BenchOptions* options, F64* cdf) {
+  Generated generated = {};
+  generated.path      = concatonate_paths(arena, options->directory, options->edgar ? "edgar.log" : "slog.log");
+
+  I32 fd = open((char*) generated.path.data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    println(ERROR "Failed to open \"", generated.path, "\": ", get_error(), '.');
+    exit(EXIT_FAILURE);
+  }
+
+  I64    saved    = save(arena);
+  String buffer   = allocate_bytes(arena, 1 << 20, 1);
+  I64    buffered = 0;
+  I64    written  = 0;
+
+  struct tm start = {};
+  start.tm_year   = 2024 - 1900;
+  start.tm_mon    = 9;
+  start.tm_mday   = 21;
+  start.tm_isdst  = -1;
+
+  Random random        = { options->seed };
+  time_t now           = mktime(&start);
+  generated.first_time = now;
+
+  const char* format = options->edgar ? "%Y-%m-%dT%H:%M:%S" : "%Y/%m/%d %H:%M:%S";
+  while (written + buffered < options->size) {
+    if (buffered > buffer.size - 4096) {
+      assert(write_all(fd, prefix(buffer, buffered)));
+      written  += buffered;
+      buffered  = 0;
+    }
+
+    struct tm local = {};
+    localtime_r(&now, &local);
+    buffered += strftime((char*) &buffer[buffered], 64, format, &local);
+
+    F64         level_draw = next_unit(&random);
+    const char* level      = level_draw < 0.8 ? " INFO" : level_draw < 0.92 ? " WARN" : " ERROR";
+    memcpy(&buffer[buffered], level, strlen(level));
+    buffered += strlen(level);
+
+    I64 words = 3 + next_below(&random, 8);
+    for (I64 i = 0; i < words; i++) {
+      U8     storage[32] = {};
+      String word        = make_word(storage, sample_zipf(&random, cdf, options->vocabulary));
+      buffer[buffered]   = ' ';
+      memcpy(&buffer[buffered + 1], word.data, word.size);
+      buffered += word.size + 1;
+    }
+
+    U8     storage[36] = {};
+    String uuid        = make_uuid(storage, options->seed, next_below(&random, options->uuids));
+    String key         = " requestId=";
+    memcpy(&buffer[buffered], key.data, key.size);
+    memcpy(&buffer[buffered + key.size], uuid.data, uuid.size);
+    buffered         += key.size + uuid.size;
+    buffer[buffered]  = '\n';
+    buffered++;
+
+    generated.lines++;
+    if (next_unit(&random) < 0.01) {
+      now++;
+    }
+  }
+
+  assert(write_all(fd, prefix(buffer, buffered)));
+  assert(close(fd) == 0);
+  restore(arena, saved);
+
+  generated.last_time = now;
+  return generated;
+}
+
+static String format_query_time(Arena* arena, time_t time) {
+  struct tm local = {};
+  localtime_r(&time, &local);
+  String result = allocate_bytes(arena, 32, 1);
+  result.size   = strftime((char*) result.data, result.size, "%Y-%m-%dT%H:%M", &local);
+  return result;
+}
+
+static I64 time_query(
+  Arena*      query_arena,
+  Arena*      scratch_arena,
+  const char* time_format,
+  I32         output_fd,
+  Index*      index,
+  Parameters  parameters
+) {
+  I64 saved = save(query_arena);
+  I64 start = now_nanoseconds();
+
+  I64    phases[PHASE_COUNT] = {};
+  I32    histogram[100]      = {};
+  Query* query               = parse_query(query_arena, parameters.query, parameters.exact);
+  Page   page                = make_page(query_arena, PAGE_SIZE);
+
+  Cancel cancel        = {};
+  cancel.connection_fd = -1;
+  cancel.start         = start;
+  cancel.deadline      = INT64_MAX;
+  run_query(query_arena, scratch_arena, (char*) time_format, output_fd, index, parameters, query, length(histogram), histogram, &page, nullptr, phases, &cancel);
+
+  I64 elapsed = now_nanoseconds() - start;
+  restore(query_arena, saved);
+  return elapsed;
+}
+
+static I64 percentile(Histogram* histogram, F32 fraction) {
+  I64 target = (I64) (fraction * histogram->count);
+  I64 seen   = 0;
+  for (I64 i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > target) {
+      return bucket_limit(i);
+    }
+  }
+  return 0;
+}
+
+static void append_percentiles(Arena* arena, String name, Histogram* histogram) {
+  append(arena, ",\n  \"", name, "_p50_ns\": ", percentile(histogram, 0.5));
+  append(arena, ",\n  \"", name, "_p90_ns\": ", percentile(histogram, 0.9));
+  append(arena, ",\n  \"", name, "_p99_ns\": ", percentile(histogram, 0.99));
+  append(arena, ",\n  \"", name, "_mean_ns\": ", histogram->count == 0 ? 0 : histogram->sum / histogram->count);
+}
+
+I32 main(I32 argc, char** argv) {
+  atexit(flush);
+
+  Arena arenas[5] = {};
+  for (I64 i = 0; i < 3; i++) {
+    arenas[i] = make_arena(1ll << 36, true);
+  }
+  arenas[3] = make_arena(1ll << 36);
+  arenas[4] = make_arena(1ll << 36);
+
+  Arena* index_arena   = &arenas[0];
+  Arena* node_arena    = &arenas[1];
+  Arena* word_arena    = &arenas[2];
+  Arena* query_arena   = &arenas[3];
+  Arena* scratch_arena = &arenas[4];
+  make_dictionary(word_arena);
+
+  BenchOptions options = {};
+  options.size         = 64ll << 20;
+  options.vocabulary   = 50000;
+  options.zipf         = 1.1;
+  options.uuids        = 100000;
+  options.seed         = 1;
+  options.queries      = 200;
+  options.directory    = "build";
+  options.output       = "build/bench.json";
+
+  for (I32 i = 1; i < argc; i++) {
+    String option = argv[i];
+    I64    equals = find(option, '=');
+    String key    = prefix(option, equals);
+    String value  = suffix(option, equals + 1);
+    if (key == "--size") {
+      options.size = parse_size(value);
+    } else if (key == "--vocabulary") {
+      options.vocabulary = parse_size(value);
+    } else if (key == "--zipf") {
+      options.zipf = strtod((char*) value.data, NULL);
+    } else if (key == "--uuids") {
+      options.uuids = parse_size(value);
+    } else if (key == "--format") {
+      options.edgar = value == "edgar";
+    } else if (key == "--seed") {
+      options.seed = parse_size(value);
+    } else if (key == "--queries") {
+      options.queries = parse_size(value);
+    } else if (key == "--directory") {
+      options.directory = value;
+    } else if (key == "--output") {
+      options.output = value;
+    } else {
+      println(ERROR "Unknown option \"", option, "\".");
+      println(
+	"Usage: bench [--size=BYTES] [--vocabulary=N] [--zipf=S] [--uuids=N] [--format=slog|edgar] ",
+	"[--seed=N] [--queries=N] [--directory=DIR] [--output=PATH]"
+      );
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (options.vocabulary <= 0 || options.uuids <= 0 || options.size <= 0) {
+    println(ERROR "Size, vocabulary and uuids must be positive.");
+    exit(EXIT_FAILURE);
+  }
+
+  if (mkdir((char*) options.directory.data, 0755) == -1 && errno != EEXIST) {
+    println(ERROR "Failed to create \"", options.directory, "\": ", get_error(), '.');
+    exit(EXIT_FAILURE);
+  }
+
+  F64* cdf = make_zipf(index_arena, options.vocabulary, options.zipf);
+
+  println(INFO "Generating ", options.size, " bytes of synthetic logs.");
+  flush();
+  I64       generate_start = now_nanoseconds();
+  Generated generated      = generate_logs(index_arena, &options, cdf);
+  I64       generate_time  = now_nanoseconds() - generate_start;
+
+  println(INFO "Indexing \"", generated.path, "\".");
+  flush();
+  Options index_options = {};
+  I64     memory_start  = arena_committed;
+  Index*  index         = index_file(index_arena, node_arena, scratch_arena, &index_options, generated.path);
+  if (index == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  decommit(scratch_arena);
+  I64     memory        = arena_committed - memory_start;
+  F64     gigabytes     = options.size / 1e9;
+
+  Random    random       = { options.seed ^ 0xBE4C4ull };
+  Histogram lookups      = {};
+  I64       lookup_count = options.queries * 100;
+  for (I64 i = 0; i < lookup_count; i++) {
+    U8     storage[32] = {};
+    String word        = make_word(storage, sample_zipf(&random, cdf, options.vocabulary));
+    I64    start       = now_nanoseconds();
+    lookup_postings(index, find_term(word));
+    record(&lookups, now_nanoseconds() - start);
+  }
+
+  I32 output_fd = open("/dev/null", O_WRONLY);
+  assert(output_fd != -1);
+
+  const char* time_format = options.edgar ? "%Y-%m-%dT%H:%M:%S" : "%Y/%m/%d %H:%M:%S";
+  Parameters  parameters  = {};
+  parameters.start        = format_query_time(index_arena, generated.first_time);
+  parameters.end          = format_query_time(index_arena, generated.last_time + 60);
+
+  // AND and OR queries pick their terms uniformly over the vocabulary, the
+  // histogram query always asks for the most frequent term.
+  Histogram and_queries = {};
+  Histogram or_queries  = {};
+  for (I64 i = 0; i < options.queries; i++) {
+    for (I64 kind = 0; kind < 2; kind++) {
+      I64 saved = save(query_arena);
+
+      U8     first_storage[32]  = {};
+      U8     second_storage[32] = {};
+      String first              = make_word(first_storage, next_below(&random, options.vocabulary));
+      String second             = make_word(second_storage, next_below(&random, options.vocabulary));
+      String separator          = kind == 0 ? " " : " OR ";
+
+      parameters.query = allocate_bytes(query_arena, first.size + separator.size + second.size, 1);
+      memcpy(parameters.query.data, first.data, first.size);
+      memcpy(&parameters.query[first.size], separator.data, separator.size);
+      memcpy(&parameters.query[first.size + separator.size], second.data, second.size);
+
+      I64 elapsed = time_query(query_arena, scratch_arena, time_format, output_fd, index, parameters);
+      record(kind == 0 ? &and_queries : &or_queries, elapsed);
+      restore(query_arena, saved);
+    }
+  }
+
+  Histogram histogram_queries = {};
+  U8        top_storage[32]   = {};
+  parameters.query            = make_word(top_storage, 0);
+  for (I64 i = 0; i < 5; i++) {
+    record(&histogram_queries, time_query(query_arena, scratch_arena, time_format, output_fd, index, parameters));
+  }
+  assert(close(output_fd) == 0);
+
+  I64  saved       = save(query_arena);
+  char number[64] = {};
+  append(query_arena, "{\n  \"format\": \"", options.edgar ? "edgar" : "slog", "\"");
+  append(query_arena, ",\n  \"bytes\": ", options.size);
+  append(query_arena, ",\n  \"lines\": ", generated.lines);
+  append(query_arena, ",\n  \"vocabulary\": ", options.vocabulary);
+  snprintf(number, sizeof(number), "%.3f", options.zipf);
+  append(query_arena, ",\n  \"zipf\": ", number);
+  append(query_arena, ",\n  \"uuids\": ", options.uuids);
+  append(query_arena, ",\n  \"seed\": ", (I64) options.seed);
+  append(query_arena, ",\n  \"generate_ns\": ", generate_time);
+  append(query_arena, ",\n  \"index_ns\": ", index->stats.build_nanoseconds);
+  snprintf(number, sizeof(number), "%.6f", gigabytes / (index->stats.build_nanoseconds / 1e9));
+  append(query_arena, ",\n  \"index_gb_per_second\": ", number);
+  snprintf(number, sizeof(number), "%.0f", memory / gigabytes);
+  append(query_arena, ",\n  \"memory_bytes_per_gb\": ", number);
+  append(query_arena, ",\n  \"terms\": ", index->stats.terms);
+  append(query_arena, ",\n  \"postings\": ", index->stats.postings);
+  append_percentiles(query_arena, "lookup", &lookups);
+  append_percentiles(query_arena, "and_query", &and_queries);
+  append_percentiles(query_arena, "or_query", &or_queries);
+  append_percentiles(query_arena, "histogram_query", &histogram_queries);
+  append(query_arena, "\n}\n");
+  String report(&query_arena->memory[saved], save(query_arena) - saved);
+
+  I32 report_fd = open((char*) options.output.data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (report_fd == -1 || !write_all(report_fd, report)) {
+    println(ERROR "Failed to write \"", options.output, "\": ", get_error(), '.');
+    exit(EXIT_FAILURE);
+  }
+  assert(close(report_fd) == 0);
+
+  print(report);
+}
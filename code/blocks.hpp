@@ -0,0 +1,245 @@
+// Block-compressed log storage. A log is rewritten into independently LZ4
+// compressed blocks that always end on a line boundary, followed by a block
+// directory. Postings then hold locations, the block index in the upper 32 bits
+// and the offset inside the decompressed block in the lower 32 bits, so only the
+// blocks holding result lines ever get decompressed.
+//
+// Block files are reused across restarts, so every change to their layout
+// bumps BLOCK_VERSION. Files from before the header had a version have
+// another magic.
+
+#define BLOCK_MAGIC      0x56424c49
+#define BLOCK_VERSION    1
+#define LOG_BLOCK_SIZE   (64 * 1024)
+#define BLOCK_CACHE_SIZE 32
+
+struct BlockFileHeader {
+  U32 magic;
+  U32 version;
+  I64 block_count;
+  I64 directory_offset;
+  I64 uncompressed_size;
+  I64 max_block_size;
+  I64 source_modified;
+};
+
+struct BlockEntry {
+  I64 offset;
+  U32 compressed_size;
+  U32 uncompressed_size;
+};
+
+struct BlockStore {
+  Mapping*         mapping;
+  BlockFileHeader* header;
+  BlockEntry*      directory;
+};
+
+struct CachedBlock {
+  BlockStore* store;
+  I64         block;
+  String      text;
+  I64         capacity;
+  U64         last_used;
+};
+
+// The thread serving requests has block_cache, and exports, which run on
+// threads of their own, bring their own caches.
+struct BlockCache {
+  Arena*      arena;
+  CachedBlock blocks[BLOCK_CACHE_SIZE];
+  U64         clock;
+  I64         hits;
+  I64         misses;
+};
+
+static BlockCache block_cache;
+
+static I64 make_location(I64 block, I64 offset) {
+  return (block << 32) | offset;
+}
+
+static I64 location_block(I64 location) {
+  return location >> 32;
+}
+
+static I64 location_offset(I64 location) {
+  return location & 0xFFFFFFFF;
+}
+
+// Blocks are at least LOG_BLOCK_SIZE bytes, extended to the end of the line.
+static I64 block_end(String text, I64 start) {
+  I64 newline = find(text, '\n', min(start + LOG_BLOCK_SIZE, text.size) - 1);
+  return min(newline + 1, text.size);
+}
+
+// The directory's offset only goes into the header once everything else is
+// written, so a block file of this version that adds up and matches the log's
+// size and modification time is complete and can be used as is.
+static bool is_compressed(struct stat* source, String destination_path) {
+  I32 fd = open((char*) destination_path.data, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat     info   = {};
+  BlockFileHeader header = {};
+  bool            valid  = fstat(fd, &info) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header);
+  assert(close(fd) == 0);
+
+  I64 expected = header.directory_offset + sizeof(BlockEntry) * header.block_count;
+  return valid && header.magic == BLOCK_MAGIC && header.version == BLOCK_VERSION && expected == info.st_size
+    && header.uncompressed_size == source->st_size && header.source_modified == source->st_mtime;
+}
+
+static bool compress_file(Arena* scratch_arena, String source_path, String destination_path) {
+  I64 saved = save(scratch_arena);
+
+  struct stat info = {};
+  if (stat((char*) source_path.data, &info) == -1) {
+    println(ERROR "Failed to stat \"", source_path, "\": ", get_error(), '.');
+    return false;
+  }
+  if (is_compressed(&info, destination_path)) {
+    println(INFO "Reusing \"", destination_path, "\", it is up to date with \"", source_path, "\".");
+    return true;
+  }
+
+  String text = {};
+  if (info.st_size > 0 && !read_file((char*) source_path.data, &text)) {
+    return false;
+  }
+  TRACE_ZONE_BYTES(ZONE_COMPRESS, text.size);
+
+  I64 block_count    = 0;
+  I64 max_block_size = 0;
+  for (I64 start = 0; start < text.size; block_count++) {
+    I64 end        = block_end(text, start);
+    max_block_size = end - start > max_block_size ? end - start : max_block_size;
+    start          = end;
+  }
+
+  BlockEntry* directory  = allocate_array<BlockEntry>(scratch_arena, block_count);
+  String      compressed = allocate_bytes(scratch_arena, lz4_bound(max_block_size), 1);
+
+  I32 fd = open((char*) destination_path.data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    println(ERROR "Failed to open \"", destination_path, "\": ", get_error(), '.');
+    if (text.size > 0) {
+      close_file(text);
+    }
+    restore(scratch_arena, saved);
+    return false;
+  }
+
+  BlockFileHeader header   = {};
+  header.magic             = BLOCK_MAGIC;
+  header.version           = BLOCK_VERSION;
+  header.block_count       = block_count;
+  header.uncompressed_size = text.size;
+  header.max_block_size    = max_block_size;
+  header.source_modified   = info.st_mtime;
+
+  bool ok     = write_all(fd, String((U8*) &header, sizeof(header)));
+  I64  offset = sizeof(header);
+  I64  start  = 0;
+  for (I64 block = 0; ok && block < block_count; block++) {
+    I64    end             = block_end(text, start);
+    I64    compressed_size = lz4_compress(slice(text, start, end), compressed.data);
+
+    directory[block].offset            = offset;
+    directory[block].compressed_size   = compressed_size;
+    directory[block].uncompressed_size = end - start;
+
+    ok      = write_all(fd, prefix(compressed, compressed_size));
+    offset += compressed_size;
+    start   = end;
+  }
+
+  header.directory_offset = offset;
+  ok = ok && write_all(fd, String((U8*) directory, sizeof(BlockEntry) * block_count));
+  ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+  if (!ok) {
+    println(ERROR "Failed to write \"", destination_path, "\": ", get_error(), '.');
+  } else {
+    println(
+      INFO "Compressed ", text.size, " bytes into ", offset, " bytes in ",
+      block_count, " blocks for \"", destination_path, "\"."
+    );
+  }
+
+  assert(close(fd) == 0);
+  if (text.size > 0) {
+    close_file(text);
+  }
+  restore(scratch_arena, saved);
+  return ok;
+}
+
+static BlockStore* open_store(Arena* arena, Mapping* mapping) {
+  String text = mapping->text;
+  if (text.size < (I64) sizeof(BlockFileHeader)) {
+    println(ERROR "\"", mapping->path, "\" is too small to be a block file.");
+    return nullptr;
+  }
+
+  BlockFileHeader* header   = (BlockFileHeader*) text.data;
+  I64              expected = header->directory_offset + sizeof(BlockEntry) * header->block_count;
+  if (header->magic != BLOCK_MAGIC || header->version != BLOCK_VERSION || expected != text.size) {
+    println(ERROR "\"", mapping->path, "\" is not a valid block file.");
+    return nullptr;
+  }
+
+  BlockStore* store = allocate<BlockStore>(arena);
+  store->mapping    = mapping;
+  store->header     = header;
+  store->directory  = (BlockEntry*) &text[header->directory_offset];
+  return store;
+}
+
+static bool decompress_block(BlockStore* store, I64 block, String output, String* result) {
+  BlockEntry entry      = store->directory[block];
+  TRACE_ZONE_BYTES(ZONE_DECOMPRESS, entry.uncompressed_size);
+
+  String     compressed = slice(store->mapping->text, entry.offset, entry.offset + entry.compressed_size);
+  I64        size       = lz4_decompress(compressed, prefix(output, entry.uncompressed_size));
+  if (size != entry.uncompressed_size) {
+    println(ERROR "Block ", block, " of \"", store->mapping->path, "\" is corrupt.");
+    return false;
+  }
+  *result = prefix(output, size);
+  return true;
+}
+
+// The returned text stays valid until the block is evicted, which takes at
+// least BLOCK_CACHE_SIZE other loads.
+static String load_block(BlockCache* cache, BlockStore* store, I64 block) {
+  cache->clock++;
+
+  CachedBlock* victim = &cache->blocks[0];
+  for (I64 i = 0; i < BLOCK_CACHE_SIZE; i++) {
+    CachedBlock* cached = &cache->blocks[i];
+    if (cached->store == store && cached->block == block) {
+      cached->last_used = cache->clock;
+      cache->hits++;
+      return cached->text;
+    }
+    if (cached->last_used < victim->last_used) {
+      victim = cached;
+    }
+  }
+
+  cache->misses++;
+  if (victim->capacity < store->header->max_block_size) {
+    victim->capacity  = store->header->max_block_size;
+    victim->text.data = allocate_bytes(cache->arena, victim->capacity, 1).data;
+  }
+  victim->store     = store;
+  victim->block     = block;
+  victim->last_used = cache->clock;
+  if (!decompress_block(store, block, String(victim->text.data, victim->capacity), &victim->text)) {
+    victim->store     = nullptr;
+    victim->text.size = 0;
+  }
+  return victim->text;
+}
@@ -0,0 +1,71 @@
+// Blocked Bloom filters over the terms of an index. A needle query usually
+// matches a handful of files out of hundreds, and the filter rules out the
+// rest with a few probes into one cache line instead of a dictionary lookup
+// each. Every term picks a 512 bit block with the upper half of its hash and
+// sets BLOOM_PROBES bits in it with the lower half, which at
+// BLOOM_BITS_PER_TERM gives a false positive rate of about one percent.
+
+#define BLOOM_BITS_PER_TERM 10
+#define BLOOM_PROBES        7
+#define BLOOM_BLOCK_BITS    512
+#define BLOOM_BLOCK_WORDS   (BLOOM_BLOCK_BITS / 64)
+
+struct Bloom {
+  U64* blocks;
+  I64  block_count;
+};
+
+static U64 hash_word(String word) {
+  U64 hash = 0xCBF29CE484222325ull;
+  for (I64 i = 0; i < word.size; i++) {
+    hash = (hash ^ word[i]) * 0x100000001B3ull;
+  }
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+  return hash ^ (hash >> 31);
+}
+
+static Bloom* make_bloom(Arena* arena, I64 term_count) {
+  Bloom* bloom       = allocate<Bloom>(arena);
+  I64    bits        = term_count * BLOOM_BITS_PER_TERM;
+  bloom->block_count = (bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+  bloom->block_count = bloom->block_count == 0 ? 1 : bloom->block_count;
+  bloom->blocks      = (U64*) allocate_bytes(arena, bloom->block_count * BLOOM_BLOCK_BITS / 8, 64).data;
+  return bloom;
+}
+
+static U64* bloom_block(Bloom* bloom, U64 hash) {
+  U64 block = ((hash >> 32) * bloom->block_count) >> 32;
+  return &bloom->blocks[block * BLOOM_BLOCK_WORDS];
+}
+
+static void add_to_bloom(Bloom* bloom, String word) {
+  U64  hash  = hash_word(word);
+  U64* block = bloom_block(bloom, hash);
+  U32  probe = hash;
+  U32  step  = (hash >> 17) | 1;
+  for (I64 i = 0; i < BLOOM_PROBES; i++) {
+    U32 bit = probe % BLOOM_BLOCK_BITS;
+    block[bit / 64] |= 1ull << (bit % 64);
+    probe += step;
+  }
+}
+
+// Without a filter every word might be there.
+static bool bloom_contains(Bloom* bloom, String word) {
+  if (bloom == nullptr) {
+    return true;
+  }
+  U64  hash  = hash_word(word);
+  U64* block = bloom_block(bloom, hash);
+  U32  probe = hash;
+  U32  step  = (hash >> 17) | 1;
+  for (I64 i = 0; i < BLOOM_PROBES; i++) {
+    U32 bit = probe % BLOOM_BLOCK_BITS;
+    if ((block[bit / 64] & (1ull << (bit % 64))) == 0) {
+      return false;
+    }
+    probe += step;
+  }
+  return true;
+}
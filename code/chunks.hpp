@@ -0,0 +1,254 @@
+// Query results are streamed as chunks of frames. Clients that accept gzip or
+// deflate get the stream compressed, with every frame a deflate block of its
+// own followed by an empty stored block, the sync flush of zlib. A chunk then
+// decompresses as soon as it arrives, so histogram updates are not held back
+// by frames still to come. Frames under CHUNK_MIN_COMPRESS bytes are stored
+// rather than compressed, which would only make them bigger.
+
+#define CHUNK_MIN_COMPRESS 128
+#define CHUNK_MAX_PARTS    16
+
+enum Encoding {
+  ENCODING_NONE,
+  ENCODING_GZIP,
+  ENCODING_DEFLATE,
+};
+
+// Only the main thread writes responses, one at a time.
+struct ChunkStream {
+  Arena    arena;
+  I32      connection_fd;
+  Encoding encoding;
+  U32      checksum;
+  I64      size;
+};
+
+static ChunkStream chunk_stream;
+
+static void write_response(I32 connection_fd, String response) {
+  TRACE_ZONE_BYTES(ZONE_WRITE, response.size);
+  I64 bytes_written = io_write(connection_fd, response);
+  if (bytes_written == -1) {
+    println(ERROR "Failed to write to connection: ", get_error(), '.');
+  } else {
+    add(&stats.bytes_streamed, bytes_written);
+    if (bytes_written < response.size) {
+      println(WARN "Wrote less bytes than expected.");
+    }
+  }
+}
+
+static bool same_ignoring_case(String a, String b) {
+  bool same = a.size == b.size;
+  for (I64 i = 0; i < a.size && same; i++) {
+    same = to_lower(a[i]) == to_lower(b[i]);
+  }
+  return same;
+}
+
+// The value of the header called name, which is matched ignoring case.
+static String header_value(String request, String name) {
+  I64 line_start = find(request, '\n') + 1;
+  while (line_start < request.size) {
+    I64    line_end = find(request, '\n', line_start);
+    String line     = slice(request, line_start, line_end);
+    line_start      = line_end + 1;
+
+    if (line.size <= name.size || line[name.size] != ':') {
+      continue;
+    }
+    if (same_ignoring_case(prefix(line, name.size), name)) {
+      return suffix(line, name.size + 1);
+    }
+  }
+  return {};
+}
+
+static String trim(String value) {
+  I64 start = 0;
+  I64 end   = value.size;
+  while (start < end && (value[start] == ' ' || value[start] == '\t' || value[start] == '\r')) {
+    start++;
+  }
+  while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t' || value[end - 1] == '\r')) {
+    end--;
+  }
+  return slice(value, start, end);
+}
+
+// Whether an Accept-Encoding value takes coding. Its own entry decides over
+// "*", and a quality of zero, however it is written, refuses a coding.
+static bool accepts_encoding(String accepted, String coding) {
+  I32 wildcard = -1;
+  for (I64 start = 0; start < accepted.size;) {
+    I64    end   = find(accepted, ',', start);
+    String entry = slice(accepted, start, end);
+    start        = end + 1;
+
+    I64    semicolon = find(entry, ';');
+    String name      = trim(prefix(entry, semicolon));
+    bool   refused   = false;
+    for (I64 i = semicolon + 1; i < entry.size;) {
+      I64    parameter_end = find(entry, ';', i);
+      String parameter     = trim(slice(entry, i, parameter_end));
+      i                    = parameter_end + 1;
+      if (parameter.size > 2 && to_lower(parameter[0]) == 'q' && parameter[1] == '=') {
+	refused = true;
+	for (I64 j = 2; j < parameter.size && refused; j++) {
+	  refused = parameter[j] == '0' || parameter[j] == '.';
+	}
+      }
+    }
+
+    if (same_ignoring_case(name, coding)) {
+      return !refused;
+    }
+    if (name == "*") {
+      wildcard = refused ? 0 : 1;
+    }
+  }
+  return wildcard == 1;
+}
+
+static void write_chunk(I32 connection_fd, struct iovec* parts, I32 count) {
+  assert(count <= CHUNK_MAX_PARTS);
+  I64 chunk_size = 0;
+  for (I32 i = 0; i < count; i++) {
+    chunk_size += parts[i].iov_len;
+  }
+
+  U8           storage[16]       = {};
+  String       chunk_size_string = to_hex_string(chunk_size, storage);
+  struct iovec iovecs[CHUNK_MAX_PARTS + 3];
+  iovecs[0] = to_iovec(chunk_size_string);
+  iovecs[1] = to_iovec("\r\n");
+  memcpy(&iovecs[2], parts, sizeof(struct iovec) * count);
+  iovecs[count + 2] = to_iovec("\r\n");
+
+  I64 bytes_written = io_writev(connection_fd, iovecs, count + 3);
+  if (bytes_written == -1) {
+    println(ERROR "Failed to write to connection: ", get_error(), '.');
+  } else {
+    add(&stats.bytes_streamed, bytes_written);
+  }
+}
+
+// Picks the encoding from the request's Accept-Encoding and sends the headers,
+// and the gzip or zlib header as a chunk of its own.
+static void start_chunks(I32 connection_fd, String request) {
+  if (chunk_stream.arena.memory == nullptr) {
+    chunk_stream.arena = make_arena(1ll << 32);
+  }
+  chunk_stream.connection_fd = connection_fd;
+  chunk_stream.size          = 0;
+
+  String accepted = header_value(request, "Accept-Encoding");
+  if (accepts_encoding(accepted, "gzip")) {
+    chunk_stream.encoding = ENCODING_GZIP;
+    chunk_stream.checksum = 0;
+  } else if (accepts_encoding(accepted, "deflate")) {
+    chunk_stream.encoding = ENCODING_DEFLATE;
+    chunk_stream.checksum = 1;
+  } else {
+    chunk_stream.encoding = ENCODING_NONE;
+  }
+
+  const char*  encodings[] = { "", "Content-Encoding: gzip\r\n", "Content-Encoding: deflate\r\n" };
+  struct iovec headers[]   = {
+    to_iovec("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nContent-Type: application/octet-stream\r\n"),
+    to_iovec(encodings[chunk_stream.encoding]),
+    to_iovec("Vary: Accept-Encoding\r\n\r\n"),
+  };
+  I64 bytes_written = io_writev(connection_fd, headers, length(headers));
+  if (bytes_written == -1) {
+    println(ERROR "Failed to write to connection: ", get_error(), '.');
+    return;
+  }
+  add(&stats.bytes_streamed, bytes_written);
+
+  // No name, no modification time, and an unknown operating system for gzip,
+  // a 32 KiB window at the fastest level for zlib.
+  U8 gzip_header[] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+  U8 zlib_header[] = { 0x78, 0x01 };
+  if (chunk_stream.encoding == ENCODING_GZIP) {
+    struct iovec part = to_iovec(String(gzip_header, sizeof(gzip_header)));
+    write_chunk(connection_fd, &part, 1);
+  } else if (chunk_stream.encoding == ENCODING_DEFLATE) {
+    struct iovec part = to_iovec(String(zlib_header, sizeof(zlib_header)));
+    write_chunk(connection_fd, &part, 1);
+  }
+}
+
+// Sends one frame made of parts as a chunk, compressed if the client asked.
+static void write_frame(I32 connection_fd, struct iovec* parts, I32 count) {
+  I64 frame_size = 0;
+  for (I32 i = 0; i < count; i++) {
+    frame_size += parts[i].iov_len;
+  }
+  TRACE_ZONE_BYTES(ZONE_WRITE, frame_size);
+
+  if (chunk_stream.encoding == ENCODING_NONE || chunk_stream.connection_fd != connection_fd) {
+    write_chunk(connection_fd, parts, count);
+    return;
+  }
+
+  Arena* arena = &chunk_stream.arena;
+  I64    saved = save(arena);
+  String frame = allocate_bytes(arena, frame_size, 1);
+  I64    used  = 0;
+  for (I32 i = 0; i < count; i++) {
+    memcpy(&frame[used], parts[i].iov_base, parts[i].iov_len);
+    used += parts[i].iov_len;
+  }
+
+  if (chunk_stream.encoding == ENCODING_GZIP) {
+    chunk_stream.checksum = gzip_crc32(frame, chunk_stream.checksum);
+  } else {
+    chunk_stream.checksum = zlib_adler32(frame, chunk_stream.checksum);
+  }
+  chunk_stream.size += frame_size;
+
+  String    output = allocate_bytes(arena, frame_size + frame_size / 8 + 64, 1);
+  BitWriter writer = {};
+  writer.output    = output.data;
+  if (frame_size < CHUNK_MIN_COMPRESS) {
+    store_block(&writer, frame, false);
+  } else {
+    deflate_block(arena, &writer, frame, false);
+    store_block(&writer, {}, false);
+  }
+
+  struct iovec part = to_iovec(prefix(output, writer.used));
+  write_chunk(connection_fd, &part, 1);
+  restore(arena, saved);
+}
+
+// Ends the compressed stream with an empty final block and its trailer, then
+// the chunks.
+static void finish_chunks(I32 connection_fd) {
+  if (chunk_stream.encoding != ENCODING_NONE && chunk_stream.connection_fd == connection_fd) {
+    U8        output[16] = {};
+    BitWriter writer     = {};
+    writer.output        = output;
+    write_bits(&writer, 1, 1);
+    write_bits(&writer, 1, 2);
+    write_symbol(&writer, 256);
+    align_to_byte(&writer);
+
+    if (chunk_stream.encoding == ENCODING_GZIP) {
+      U32 trailer[] = { chunk_stream.checksum, (U32) chunk_stream.size };
+      memcpy(&output[writer.used], trailer, sizeof(trailer));
+      writer.used += sizeof(trailer);
+    } else {
+      for (I32 i = 3; i >= 0; i--) {
+	output[writer.used] = chunk_stream.checksum >> (8 * i);
+	writer.used++;
+      }
+    }
+
+    struct iovec part = to_iovec(String(output, writer.used));
+    write_chunk(connection_fd, &part, 1);
+    chunk_stream.encoding = ENCODING_NONE;
+  }
+  write_response(connection_fd, "0\r\n\r\n");
+}
@@ -0,0 +1,258 @@
+// Size-tiered compaction of per-file indexes. A directory of rotated logs
+// gives one small index per file, and every query looks each of them up
+// separately. Indexes are put in tiers by their number of postings, every
+// tier MERGE_MIN_POSTINGS times merge_factor to the power of the tier, and
+// whenever a tier holds merge_factor of them they are merged into a single
+// segment one tier up. Merged segments are unlinked as soon as they are
+// mapped, so nothing is left in the spill directory when the process exits.
+//
+// Queries may be running over the list while it is compacted, so merges only
+// read their inputs, and the list only changes under the lock. A merge that
+// fails, say on a full spill directory, leaves its inputs in the list and
+// stops compaction, and queries go on over the unmerged indexes.
+
+#define MERGE_MIN_POSTINGS (1 << 16)
+#define MAX_TIERS          64
+
+struct MergeCursor {
+  TermIterator terms;
+  String       word;
+  Postings     postings;
+  I64          first_part;
+  I32          input;
+};
+
+// Ties are broken by input, whose parts come in order, so the merged postings
+// stay sorted.
+static bool merge_less(MergeCursor* a, MergeCursor* b) {
+  I32 comparison = compare(a->word, b->word);
+  return comparison < 0 || (comparison == 0 && a->input < b->input);
+}
+
+static void sift_down_merge(MergeCursor** heap, I64 count, I64 i) {
+  while (true) {
+    I64 smallest = i;
+    for (I64 child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++) {
+      if (merge_less(heap[child], heap[smallest])) {
+	smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    MergeCursor* swap = heap[i];
+    heap[i]           = heap[smallest];
+    heap[smallest]    = swap;
+    i                 = smallest;
+  }
+}
+
+static I32 count_parts(Index* index) {
+  return index->part_count > 0 ? index->part_count : 1;
+}
+
+// Block locations keep the block in their upper 32 bits, which have to leave
+// room for the part.
+static bool is_mergeable(Index* index) {
+  return index->store == nullptr || index->store->header->block_count < (1ll << (FILE_SHIFT - 32));
+}
+
+static I64 index_tier(Index* index, I64 merge_factor) {
+  I64 tier = 0;
+  for (I64 size = MERGE_MIN_POSTINGS; size <= index->stats.postings && tier < MAX_TIERS - 1; size *= merge_factor) {
+    tier++;
+  }
+  return tier;
+}
+
+// Returns nullptr, with nothing left in the spill directory, if the merged
+// segment cannot be written or mapped.
+static Index* merge_indexes(Arena* index_arena, Arena* scratch_arena, Options* options, Index** inputs, I32 input_count) {
+  TRACE_ZONE(ZONE_MERGE);
+  static I64 merges = 0;
+
+  I64 start = now_nanoseconds();
+  I64 saved = save(scratch_arena);
+
+  char name[64] = {};
+  snprintf(name, sizeof(name), "merged-%d-%lld.segment", getpid(), merges);
+  merges++;
+  String path = concatonate_paths(index_arena, options->spill_directory, name);
+
+  Index* merged = allocate<Index>(index_arena);
+  for (I32 i = 0; i < input_count; i++) {
+    merged->part_count += count_parts(inputs[i]);
+  }
+  merged->parts = allocate_array<Index*>(index_arena, merged->part_count);
+
+  MergeCursor*  cursors = allocate_array<MergeCursor>(scratch_arena, input_count);
+  MergeCursor** heap    = allocate_array<MergeCursor*>(scratch_arena, input_count);
+  I64           heaped  = 0;
+  I32           parts   = 0;
+  for (I32 i = 0; i < input_count; i++) {
+    Index* input = inputs[i];
+    if (input->part_count > 0) {
+      memcpy(&merged->parts[parts], input->parts, sizeof(Index*) * input->part_count);
+    } else {
+      merged->parts[parts] = input;
+    }
+
+    cursors[i].terms      = iterate_terms(input);
+    cursors[i].first_part = parts;
+    cursors[i].input      = i;
+    if (next_term(&cursors[i].terms, &cursors[i].word, &cursors[i].postings)) {
+      heap[heaped] = &cursors[i];
+      heaped++;
+    }
+    parts                  += count_parts(input);
+    merged->template_count += input->template_count;
+
+    merged->stats.build_nanoseconds += input->stats.build_nanoseconds;
+    merged->stats.arena_bytes       += input->stats.arena_bytes;
+  }
+  for (I64 i = heaped / 2 - 1; i >= 0; i--) {
+    sift_down_merge(heap, heaped, i);
+  }
+
+  // Template terms are unique to the index they were mined in, so they merge
+  // like any other term and the templates only have to be listed together.
+  merged->templates = allocate_array<Template*>(index_arena, merged->template_count);
+  I64 templates     = 0;
+  for (I32 i = 0; i < input_count; i++) {
+    if (inputs[i]->template_count > 0) {
+      memcpy(&merged->templates[templates], inputs[i]->templates, sizeof(Template*) * inputs[i]->template_count);
+    }
+    templates += inputs[i]->template_count;
+  }
+
+  SegmentWriter writer = {};
+  if (!open_segment_writer(scratch_arena, &writer, path, SEGMENT_CHUNK_SIZE)) {
+    restore(scratch_arena, saved);
+    return nullptr;
+  }
+  while (heaped > 0) {
+    String word = heap[0]->word;
+    begin_term(&writer, word);
+    while (heaped > 0 && heap[0]->word == word) {
+      MergeCursor* cursor    = heap[0];
+      bool         has_parts = cursor->terms.index->part_count > 0;
+      for (I64 i = 0; i < cursor->postings.count; i++) {
+	I64 location = cursor->postings.values[i];
+	if (has_parts) {
+	  location = make_file_location(cursor->first_part + location_file(location), file_location(location));
+	} else {
+	  location = make_file_location(cursor->first_part, location);
+	}
+	write_posting(&writer, location);
+      }
+
+      if (!next_term(&cursor->terms, &cursor->word, &cursor->postings)) {
+	heaped--;
+	heap[0] = heap[heaped];
+      }
+      sift_down_merge(heap, heaped, 0);
+    }
+    end_term(&writer);
+  }
+  bool written = close_segment_writer(scratch_arena, &writer);
+  restore(scratch_arena, saved);
+
+  merged->mapping = written ? map_file(index_arena, path) : nullptr;
+  merged->segment = merged->mapping != nullptr ? open_segment(index_arena, merged->mapping) : nullptr;
+  if (unlink((char*) path.data) == -1) {
+    println(WARN "Failed to unlink \"", path, "\": ", get_error(), '.');
+  }
+  if (merged->segment == nullptr) {
+    if (merged->mapping != nullptr) {
+      retire(merged->mapping);
+      release(merged->mapping);
+    }
+    return nullptr;
+  }
+  advise(merged->mapping, MADV_RANDOM);
+
+  number_segment_terms(index_arena, scratch_arena, merged);
+  merged->stats.build_nanoseconds += now_nanoseconds() - start;
+  merged->bloom                    = build_bloom(index_arena, merged);
+  merged->references               = 1;
+  println(INFO "Merged ", (I64) input_count, " indexes covering ", (I64) merged->part_count, " files into \"", path, "\".");
+  return merged;
+}
+
+// The inputs' postings stay in the node arena, which cannot give them back,
+// but the segments they were built into are unmapped once no request is
+// searching them any more.
+static void retire_inputs(Index** inputs, I32 input_count) {
+  for (I32 i = 0; i < input_count; i++) {
+    drop_reference(inputs[i]);
+  }
+}
+
+// Keeps merging the lowest tier that holds merge_factor indexes until none
+// does, which leaves at most merge_factor - 1 indexes in every tier.
+static void compact_indexes(Arena* index_arena, Arena* scratch_arena, Options* options, Index** indexes, pthread_mutex_t* lock) {
+  I64 merge_factor = options->merge_factor;
+  if (merge_factor < 2) {
+    return;
+  }
+
+  while (true) {
+    I64     saved       = save(scratch_arena);
+    Index** inputs      = allocate_array<Index*>(scratch_arena, merge_factor);
+    I32     input_count = 0;
+
+    pthread_mutex_lock(lock);
+    I64 counts[MAX_TIERS] = {};
+    for (Index* index = *indexes; index != nullptr; index = index->next) {
+      if (is_mergeable(index)) {
+	counts[index_tier(index, merge_factor)]++;
+      }
+    }
+
+    I64 tier = 0;
+    while (tier < MAX_TIERS && counts[tier] < merge_factor) {
+      tier++;
+    }
+
+    I64 parts = 0;
+    for (Index* index = *indexes; tier < MAX_TIERS && index != nullptr && input_count < merge_factor; index = index->next) {
+      if (is_mergeable(index) && index_tier(index, merge_factor) == tier && parts + count_parts(index) <= MAX_PARTS) {
+	inputs[input_count] = index;
+	input_count++;
+	parts += count_parts(index);
+      }
+    }
+    pthread_mutex_unlock(lock);
+
+    if (input_count < 2) {
+      restore(scratch_arena, saved);
+      break;
+    }
+
+    Index* merged = merge_indexes(index_arena, scratch_arena, options, inputs, input_count);
+    if (merged == nullptr) {
+      println(WARN "Stopped compacting, ", (I64) input_count, " indexes could not be merged.");
+      restore(scratch_arena, saved);
+      break;
+    }
+
+    pthread_mutex_lock(lock);
+    for (Index** link = indexes; *link != nullptr;) {
+      bool merged_away = false;
+      for (I32 i = 0; i < input_count && !merged_away; i++) {
+	merged_away = inputs[i] == *link;
+      }
+      if (merged_away) {
+	*link = (*link)->next;
+      } else {
+	link = &(*link)->next;
+      }
+    }
+    merged->next = *indexes;
+    *indexes     = merged;
+    retire_inputs(inputs, input_count);
+    pthread_mutex_unlock(lock);
+
+    restore(scratch_arena, saved);
+  }
+}
@@ -0,0 +1,639 @@
+// Scatter-gather over shard processes. A coordinator owns no logs, it forwards
+// every /api/query to each shard and merges the frames they stream back:
+// histograms and approximations are summed, pages are merged, top values are
+// merged and the summaries shards send at the end become one partial frame.
+//
+// Page n of a coordinator is lines n * PAGE_SIZE up to (n + 1) * PAGE_SIZE of
+// the lines of every shard merged by time. Those are all among the first
+// (n + 1) * PAGE_SIZE lines of each shard in time order, which is what shards
+// send a coordinator instead of their pages.
+//
+// Shards are driven with non-blocking sockets and poll, so one that is slow to
+// connect or to answer only holds back its own results. Shards that are not
+// done SHARD_GRACE milliseconds after the query's deadline are dropped and the
+// results are marked partial.
+
+#define SHARD_GRACE 500
+
+struct Shard {
+  String             name;
+  struct sockaddr_in address;
+};
+
+// HOST:PORT[,HOST:PORT...]
+static Shard* parse_shards(Arena* arena, String list, I32* shard_count) {
+  *shard_count = 1;
+  for (I64 i = 0; i < list.size; i++) {
+    *shard_count += list[i] == ',';
+  }
+
+  Shard* shards = allocate_array<Shard>(arena, *shard_count);
+  for (I32 i = 0; i < *shard_count; i++) {
+    I64    comma = find(list, ',');
+    String name  = prefix(list, comma);
+    list         = suffix(list, comma + 1);
+
+    I64 colon = find(name, ':');
+    I64 port  = parse_number(suffix(name, colon + 1));
+    if (colon == name.size || port <= 0 || port > 65535) {
+      println(ERROR "Expected HOST:PORT for shard \"", name, "\".");
+      exit(EXIT_FAILURE);
+    }
+
+    String host = with_extension(arena, prefix(name, colon), "");
+
+    struct addrinfo  hints  = {};
+    struct addrinfo* result = nullptr;
+    hints.ai_family         = AF_INET;
+    hints.ai_socktype       = SOCK_STREAM;
+    if (getaddrinfo((char*) host.data, nullptr, &hints, &result) != 0 || result == nullptr) {
+      println(ERROR "Failed to resolve shard \"", name, "\".");
+      exit(EXIT_FAILURE);
+    }
+    shards[i].name             = name;
+    shards[i].address          = *(struct sockaddr_in*) result->ai_addr;
+    shards[i].address.sin_port = htons(port);
+    freeaddrinfo(result);
+  }
+  return shards;
+}
+
+enum ShardState {
+  SHARD_CONNECTING,
+  SHARD_READING,
+  SHARD_DONE,
+  SHARD_FAILED,
+};
+
+// The response is decoded in two steps: chunked transfer encoding from input
+// into body, then frames out of body.
+struct ShardStream {
+  Shard*     shard;
+  I32        fd;
+  ShardState state;
+
+  String input;
+  I64    input_filled;
+  I64    input_consumed;
+  bool   status_read;
+  bool   headers_read;
+  I64    chunk_left;
+  bool   chunk_crlf;
+
+  String body;
+  I64    body_filled;
+  I64    body_consumed;
+
+  I32*   histogram;
+  bool   has_histogram;
+  String page;
+  I32    summary[5];
+  bool   has_summary;
+  I32*   approximate;
+  bool   has_approximate;
+  String top;
+  I32    top_header[3];
+  I32    coverage[4];
+  bool   has_coverage;
+};
+
+static void fail_shard(ShardStream* stream, String why) {
+  if (stream->state == SHARD_FAILED || stream->state == SHARD_DONE) {
+    return;
+  }
+  println(WARN "Shard ", stream->shard->name, " failed: ", why, '.');
+  add(&stats.shard_failures, 1);
+  if (stream->fd != -1) {
+    assert(close(stream->fd) == 0);
+    stream->fd = -1;
+  }
+  stream->state = SHARD_FAILED;
+}
+
+static I64 parse_hex(String input) {
+  I64 result = 0;
+  for (I64 i = 0; i < input.size; i++) {
+    U8 c = to_lower(input[i]);
+    if (!is_hex(c)) {
+      return -1;
+    }
+    result = 16 * result + from_hex(c);
+  }
+  return input.size == 0 ? -1 : result;
+}
+
+// Buffers grow by doubling into the arena, the old ones are left behind until
+// the request is over.
+static void reserve(Arena* arena, String* buffer, I64 filled, I64 size) {
+  if (size > buffer->size) {
+    I64    capacity = buffer->size == 0 ? 4096 : buffer->size;
+    while (capacity < size) {
+      capacity *= 2;
+    }
+    String grown = allocate_bytes(arena, capacity, 1);
+    if (filled > 0) {
+      memcpy(grown.data, buffer->data, filled);
+    }
+    *buffer = grown;
+  }
+}
+
+static bool decode_chunks(Arena* arena, ShardStream* stream) {
+  while (stream->state == SHARD_READING && stream->input_consumed < stream->input_filled) {
+    String pending = slice(stream->input, stream->input_consumed, stream->input_filled);
+
+    if (stream->chunk_left > 0) {
+      I64 copied = min(stream->chunk_left, pending.size);
+      reserve(arena, &stream->body, stream->body_filled, stream->body_filled + copied);
+      memcpy(&stream->body[stream->body_filled], pending.data, copied);
+      stream->body_filled    += copied;
+      stream->input_consumed += copied;
+      stream->chunk_left     -= copied;
+      stream->chunk_crlf      = stream->chunk_left == 0;
+      continue;
+    }
+
+    if (stream->chunk_crlf) {
+      if (pending.size < 2) {
+	return true;
+      }
+      stream->input_consumed += 2;
+      stream->chunk_crlf      = false;
+      continue;
+    }
+
+    I64 newline = find(pending, '\n');
+    if (newline == pending.size) {
+      return true;
+    }
+    String line = prefix(pending, newline);
+    if (line.size > 0 && line[line.size - 1] == '\r') {
+      line.size--;
+    }
+    stream->input_consumed += newline + 1;
+
+    if (!stream->status_read) {
+      if (!starts_with(line, "HTTP/1.1 200")) {
+	return false;
+      }
+      stream->status_read = true;
+    } else if (!stream->headers_read) {
+      stream->headers_read = line.size == 0;
+    } else {
+      I64 size = parse_hex(line);
+      if (size < 0) {
+	return false;
+      }
+      if (size == 0) {
+	stream->state = SHARD_DONE;
+	assert(close(stream->fd) == 0);
+	stream->fd = -1;
+      }
+      stream->chunk_left = size;
+    }
+  }
+
+  I64 left = stream->input_filled - stream->input_consumed;
+  memmove(stream->input.data, &stream->input[stream->input_consumed], left);
+  stream->input_filled   = left;
+  stream->input_consumed = 0;
+  return true;
+}
+
+struct Gather {
+  I32  bins;
+  bool logs_changed;
+  bool histogram_changed;
+};
+
+static void read_frames(Arena* arena, ShardStream* stream, Gather* gather) {
+  while (stream->body_filled - stream->body_consumed >= 8) {
+    U8* frame = &stream->body[stream->body_consumed];
+    I32 tag   = 0;
+    I32 size  = 0;
+    memcpy(&tag, frame, sizeof(tag));
+    memcpy(&size, frame + 4, sizeof(size));
+
+    // Histograms carry their number of bins instead of a size.
+    I64 payload_size = tag == 2 ? sizeof(I32) * (I64) size : size;
+    if (payload_size < 0 || stream->body_filled - stream->body_consumed < 8 + payload_size) {
+      break;
+    }
+    U8* payload = frame + 8;
+
+    if (tag == 7) {
+      stream->page = allocate_bytes(arena, payload_size, 4);
+      memcpy(stream->page.data, payload, payload_size);
+      gather->logs_changed = true;
+    } else if (tag == 2) {
+      memset(stream->histogram, 0, sizeof(I32) * gather->bins);
+      memcpy(stream->histogram, payload, sizeof(I32) * min(size, gather->bins));
+      stream->has_histogram     = true;
+      gather->histogram_changed = true;
+    } else if (tag == 3) {
+      memcpy(stream->summary, payload, min(payload_size, (I64) sizeof(stream->summary)));
+      stream->has_summary = true;
+    } else if (tag == 4 && payload_size == (I64) sizeof(I32) * (3 + 2 * gather->bins)) {
+      memcpy(stream->approximate, payload, payload_size);
+      stream->has_approximate = true;
+    } else if (tag == 6 && payload_size == (I64) sizeof(stream->coverage)) {
+      memcpy(stream->coverage, payload, payload_size);
+      stream->has_coverage = true;
+    } else if (tag == 5 && payload_size >= (I64) (3 * sizeof(I32))) {
+      stream->top = allocate_bytes(arena, payload_size, 4);
+      memcpy(stream->top.data, payload, payload_size);
+      memcpy(stream->top_header, payload, sizeof(stream->top_header));
+    }
+    stream->body_consumed += 8 + payload_size;
+  }
+
+  I64 left = stream->body_filled - stream->body_consumed;
+  memmove(stream->body.data, &stream->body[stream->body_consumed], left);
+  stream->body_filled   = left;
+  stream->body_consumed = 0;
+}
+
+static void connect_shard(ShardStream* stream) {
+  stream->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (stream->fd == -1) {
+    fail_shard(stream, get_error());
+    return;
+  }
+  struct sockaddr_in address = stream->shard->address;
+  if (connect(stream->fd, (struct sockaddr*) &address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+    fail_shard(stream, get_error());
+  }
+}
+
+static void send_request(ShardStream* stream, String request) {
+  I32       error = 0;
+  socklen_t size  = sizeof(error);
+  if (getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0) {
+    fail_shard(stream, strerror(error == 0 ? errno : error));
+    return;
+  }
+  // The request is far smaller than a fresh socket's send buffer.
+  if (send(stream->fd, request.data, request.size, MSG_NOSIGNAL) != request.size) {
+    fail_shard(stream, "could not send the request");
+    return;
+  }
+  stream->state = SHARD_READING;
+}
+
+static void receive(Arena* arena, ShardStream* stream, Gather* gather) {
+  reserve(arena, &stream->input, stream->input_filled, stream->input_filled + 4096);
+  I64 bytes_read = recv(stream->fd, &stream->input[stream->input_filled], stream->input.size - stream->input_filled, MSG_DONTWAIT);
+  if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (bytes_read <= 0) {
+    fail_shard(stream, bytes_read == 0 ? String("connection closed before the last chunk") : get_error());
+    return;
+  }
+  stream->input_filled += bytes_read;
+  if (!decode_chunks(arena, stream)) {
+    fail_shard(stream, "malformed response");
+    return;
+  }
+  read_frames(arena, stream, gather);
+}
+
+static void write_gathered_histogram(I32 connection_fd, ShardStream* streams, I32 shard_count, I32 bins, I32* histogram) {
+  memset(histogram, 0, sizeof(I32) * bins);
+  for (I32 i = 0; i < shard_count; i++) {
+    for (I32 j = 0; streams[i].has_histogram && j < bins; j++) {
+      histogram[j] += streams[i].histogram[j];
+    }
+  }
+  write_histogram(connection_fd, bins, histogram);
+}
+
+struct GatheredLine {
+  I64    time;
+  String line;
+  U8     level;
+  I32    shard;
+  I32    position;
+};
+
+// Lines from the same second keep their shard's order, and shards come in
+// order, so every page is cut out of the same merge and consecutive pages
+// neither repeat nor skip a line.
+static I32 compare_gathered_lines(const void* a, const void* b) {
+  GatheredLine* left  = (GatheredLine*) a;
+  GatheredLine* right = (GatheredLine*) b;
+  if (left->time != right->time) {
+    return left->time < right->time ? -1 : 1;
+  }
+  if (left->shard != right->shard) {
+    return left->shard - right->shard;
+  }
+  return left->position - right->position;
+}
+
+// Times are moved over to the first shard's start, which is the same for all
+// of them unless their clocks disagree on the time zone.
+static void write_gathered_page(Arena* arena, I32 connection_fd, ShardStream* streams, I32 shard_count, I32 page_number) {
+  I64   saved      = save(arena);
+  Page* pages      = allocate_array<Page>(arena, shard_count);
+  I64   line_count = 0;
+  for (I32 i = 0; i < shard_count; i++) {
+    if (streams[i].page.size > 0 && parse_page(streams[i].page, &pages[i])) {
+      line_count += pages[i].count;
+    }
+  }
+
+  GatheredLine* lines      = allocate_array<GatheredLine>(arena, line_count);
+  I64           used       = 0;
+  I64           start_time = 0;
+  for (I32 i = 0; i < shard_count; i++) {
+    Page* shard = &pages[i];
+    if (used == 0) {
+      start_time = shard->start_time;
+    }
+    for (I32 j = 0; j < shard->count; j++) {
+      // Lines are stored with their newlines, which add_to_page expects.
+      I64 end = shard->offsets[j] + shard->lengths[j];
+      end     = end < shard->text.size && shard->text[end] == '\n' ? end + 1 : end;
+
+      lines[used].time     = shard->start_time + shard->times[j];
+      lines[used].line     = slice(shard->text, shard->offsets[j], end);
+      lines[used].level    = shard->levels[j];
+      lines[used].shard    = i;
+      lines[used].position = j;
+      used++;
+    }
+  }
+  qsort(lines, used, sizeof(GatheredLine), compare_gathered_lines);
+
+  I64  first = min((I64) PAGE_SIZE * page_number, used);
+  I64  last  = min(first + PAGE_SIZE, used);
+  Page page  = make_page(arena, last - first);
+  page.start_time = start_time;
+  for (I64 i = first; i < last; i++) {
+    add_to_page(arena, &page, lines[i].line, lines[i].time, lines[i].level);
+  }
+  write_page(connection_fd, &page);
+  restore(arena, saved);
+}
+
+// Estimates add up, and so do the variances behind the error bars of shards
+// that sampled independently.
+static void write_gathered_approximate(Arena* arena, I32 connection_fd, ShardStream* streams, I32 shard_count, I32 bins) {
+  Approximation approximation = {};
+  approximation.estimate      = allocate_array<F64>(arena, bins);
+  approximation.variance      = allocate_array<F64>(arena, bins);
+  for (I32 i = 0; i < shard_count; i++) {
+    I32* approximate = streams[i].approximate;
+    if (!streams[i].has_approximate) {
+      continue;
+    }
+    approximation.samples  += approximate[1];
+    approximation.postings += approximate[2];
+    for (I32 j = 0; j < bins; j++) {
+      F64 error                  = approximate[3 + bins + j] / 1.96;
+      approximation.estimate[j] += approximate[3 + j];
+      approximation.variance[j] += error * error;
+    }
+  }
+  write_approximate(arena, connection_fd, bins, &approximation);
+}
+
+static I32 compare_top_words(const void* a, const void* b) {
+  TopValue* left  = (TopValue*) a;
+  TopValue* right = (TopValue*) b;
+  I32 comparison  = compare(left->word, right->word);
+  return comparison != 0 ? comparison : left->source - right->source;
+}
+
+// Shards send every counter they have. A value a shard does not have was
+// counted there at most its floor times, which goes into both the count and
+// the error, the same way SpaceSaving counts a value it evicted.
+static void write_gathered_top(Arena* arena, I32 connection_fd, ShardStream* streams, I32 shard_count, I32 k) {
+  I64 saved       = save(arena);
+  I64 value_count = 0;
+  I64 total       = 0;
+  I64 floors      = 0;
+  for (I32 i = 0; i < shard_count; i++) {
+    value_count += streams[i].top_header[0];
+    total       += streams[i].top_header[1];
+    floors      += streams[i].top_header[2];
+  }
+
+  TopValue* values = allocate_array<TopValue>(arena, value_count);
+  I64       used   = 0;
+  for (I32 i = 0; i < shard_count; i++) {
+    String top    = streams[i].top;
+    I64    offset = sizeof(streams[i].top_header);
+    for (I32 j = 0; j < streams[i].top_header[0] && offset + 3 * (I64) sizeof(I32) <= top.size; j++) {
+      I32 entry[3] = {};
+      memcpy(entry, &top[offset], sizeof(entry));
+      offset += sizeof(entry);
+      if (entry[2] < 0 || offset + entry[2] > top.size) {
+	break;
+      }
+      values[used].word   = slice(top, offset, offset + entry[2]);
+      values[used].count  = entry[0];
+      values[used].error  = entry[1];
+      values[used].source = i;
+      used++;
+      offset += align(entry[2], 4);
+    }
+  }
+  qsort(values, used, sizeof(TopValue), compare_top_words);
+
+  I32 merged = 0;
+  for (I64 i = 0; i < used;) {
+    TopValue value  = values[i];
+    I64      missed = floors - streams[value.source].top_header[2];
+    for (i++; i < used && values[i].word == value.word; i++) {
+      value.count += values[i].count;
+      value.error += values[i].error;
+      missed      -= streams[values[i].source].top_header[2];
+    }
+    value.count   += missed;
+    value.error   += missed;
+    values[merged] = value;
+    merged++;
+  }
+  qsort(values, merged, sizeof(TopValue), compare_top_counts);
+  write_top(arena, connection_fd, values, min(merged, k), total, floors);
+  restore(arena, saved);
+}
+
+// parameters_line is the raw query string, before parse_parameters decoded it
+// in place.
+static void gather_query(
+  Arena*     query_arena,
+  Arena*     scratch_arena,
+  I32        connection_fd,
+  Shard*     shards,
+  I32        shard_count,
+  String     parameters_line,
+  Parameters parameters,
+  I64        query_timeout,
+  I64*       phases
+) {
+  I64 start = now_nanoseconds();
+  I64 saved = save(scratch_arena);
+
+  I64 timeout = query_timeout;
+  if (0 < parameters.timeout && parameters.timeout < timeout) {
+    timeout = parameters.timeout;
+  }
+  I64 deadline = start + 1000000 * (timeout + SHARD_GRACE);
+
+  // The last timeout in a query string wins, so shards stop at the same
+  // deadline as the coordinator, and they send every line up to its page.
+  String request = allocate_bytes(scratch_arena, parameters_line.size + 128, 1);
+  request.size   = snprintf(
+    (char*) request.data, request.size,
+    "GET /api/query?%.*s&timeout=%lld&summary=1&lines=%lld HTTP/1.1\r\nConnection: close\r\n\r\n",
+    (I32) parameters_line.size, parameters_line.data, timeout, (I64) PAGE_SIZE * (parameters.page + 1)
+  );
+
+  Gather gather = {};
+  gather.bins   = 100;
+
+  ShardStream*   streams = allocate_array<ShardStream>(scratch_arena, shard_count);
+  struct pollfd* polls   = allocate_array<struct pollfd>(scratch_arena, shard_count + 1);
+  for (I32 i = 0; i < shard_count; i++) {
+    streams[i].shard       = &shards[i];
+    streams[i].fd          = -1;
+    streams[i].histogram   = allocate_array<I32>(scratch_arena, gather.bins);
+    streams[i].approximate = allocate_array<I32>(scratch_arena, 3 + 2 * gather.bins);
+    connect_shard(&streams[i]);
+  }
+
+  I32* histogram            = allocate_array<I32>(scratch_arena, gather.bins);
+  I64  last_write        = start;
+  bool wrote_approximate = parameters.approximate <= 0;
+  bool disconnected      = false;
+  while (!disconnected) {
+    I32 polled = 0;
+    for (I32 i = 0; i < shard_count; i++) {
+      if (streams[i].state == SHARD_CONNECTING || streams[i].state == SHARD_READING) {
+	polls[polled].fd     = streams[i].fd;
+	polls[polled].events = streams[i].state == SHARD_CONNECTING ? POLLOUT : POLLIN;
+	polled++;
+      }
+    }
+    if (polled == 0) {
+      break;
+    }
+    polls[polled].fd     = connection_fd;
+    polls[polled].events = POLLIN | POLLRDHUP;
+
+    I64 now = now_nanoseconds();
+    if (now >= deadline) {
+      for (I32 i = 0; i < shard_count; i++) {
+	fail_shard(&streams[i], "no answer before the deadline");
+      }
+      break;
+    }
+    I64 wait = min((deadline - now) / 1000000 + 1, (I64) 1000);
+    if (poll(polls, polled + 1, wait) == -1 && errno != EINTR) {
+      println(ERROR "Failed to poll shards: ", get_error(), '.');
+      break;
+    }
+
+    if (polls[polled].revents != 0 && connection_closed(connection_fd)) {
+      disconnected = true;
+      break;
+    }
+
+    I32 j = 0;
+    for (I32 i = 0; i < shard_count; i++) {
+      ShardStream* stream = &streams[i];
+      if (stream->state != SHARD_CONNECTING && stream->state != SHARD_READING) {
+	continue;
+      }
+      I32 revents = polls[j].revents;
+      j++;
+      if (revents == 0) {
+	continue;
+      }
+      if (stream->state == SHARD_CONNECTING) {
+	send_request(stream, request);
+      } else {
+	receive(scratch_arena, stream, &gather);
+      }
+    }
+
+    I64 write_start = now_nanoseconds();
+    if (!wrote_approximate) {
+      bool ready = true;
+      for (I32 i = 0; i < shard_count; i++) {
+	ready = ready && (streams[i].has_approximate || streams[i].state == SHARD_DONE || streams[i].state == SHARD_FAILED);
+      }
+      if (ready) {
+	write_gathered_approximate(scratch_arena, connection_fd, streams, shard_count, gather.bins);
+	wrote_approximate = true;
+      }
+    }
+    // Shards resend their logs after every index they search, so merged
+    // frames go out at most once a second, like a single process's histograms.
+    if (write_start - last_write >= 1000000000) {
+      if (gather.histogram_changed) {
+	write_gathered_histogram(connection_fd, streams, shard_count, gather.bins, histogram);
+	gather.histogram_changed = false;
+      }
+      if (gather.logs_changed) {
+	write_gathered_page(query_arena, connection_fd, streams, shard_count, parameters.page);
+	gather.logs_changed = false;
+      }
+      last_write = write_start;
+    }
+    phases[PHASE_WRITE] += now_nanoseconds() - write_start;
+  }
+
+  Cancel cancel = {};
+  cancel.start  = start;
+  I32 failed      = 0;
+  I32 indexes     = 0;
+  I64 coverage[4] = {};
+  for (I32 i = 0; i < shard_count; i++) {
+    ShardStream* stream = &streams[i];
+    if (stream->fd != -1) {
+      assert(close(stream->fd) == 0);
+    }
+    failed += stream->state == SHARD_FAILED;
+    for (I32 j = 0; j < 4 && stream->has_coverage; j++) {
+      coverage[j] += stream->coverage[j];
+    }
+    if (stream->has_summary) {
+      if (stream->summary[0] != CANCEL_NONE && cancel.reason == CANCEL_NONE) {
+	cancel.reason = (CancelReason) stream->summary[0];
+      }
+      cancel.indexes_searched += stream->summary[2];
+      indexes                 += stream->summary[3];
+      cancel.lines_scanned    += stream->summary[4];
+    }
+  }
+  if (failed > 0) {
+    cancel.reason = CANCEL_SHARD_FAILED;
+  }
+
+  if (disconnected) {
+    println(WARN "Client disconnected, cancelled query on ", (I64) shard_count, " shards.");
+    add(&stats.queries_disconnected, 1);
+  } else {
+    if (gather.logs_changed) {
+      write_gathered_page(query_arena, connection_fd, streams, shard_count, parameters.page);
+    }
+    if (parameters.group.size > 0) {
+      write_gathered_top(scratch_arena, connection_fd, streams, shard_count, parameters.k);
+    }
+    if (coverage[0] < coverage[1]) {
+      write_coverage(connection_fd, coverage[0], coverage[1], coverage[2] << 10, coverage[3] << 10);
+    }
+    write_gathered_histogram(connection_fd, streams, shard_count, gather.bins, histogram);
+    if (cancel.reason != CANCEL_NONE) {
+      println(WARN "Query got partial results, ", (I64) failed, " of ", (I64) shard_count, " shards failed.");
+      add(&stats.queries_timed_out, cancel.reason == CANCEL_DEADLINE);
+      write_partial(connection_fd, &cancel, indexes);
+    }
+    finish_chunks(connection_fd);
+  }
+  restore(scratch_arena, saved);
+}
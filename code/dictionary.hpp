@@ -0,0 +1,175 @@
+// Every distinct term of every file, stored once and numbered in the order it
+// was first seen. Indexes keep numbers instead of words, so a word that is in
+// hundreds of files is stored once, and a query finds the number of each of
+// its words once for all of them. Words are kept in pages that never move, so
+// the word of a number can be read without the lock, which only guards the
+// table from words to numbers.
+
+#define DICTIONARY_PAGE_BITS  16
+#define DICTIONARY_PAGE_SIZE  (1 << DICTIONARY_PAGE_BITS)
+#define DICTIONARY_MAX_PAGES  (1 << 15)
+#define DICTIONARY_BATCH_SIZE 4096
+
+// Slots hold a term plus one, or zero when empty, next to the lower half of
+// its word's hash, which is enough to place it and to skip most comparisons.
+struct Dictionary {
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  Arena*          word_arena;
+  Arena           slot_arena;
+  String*         pages[DICTIONARY_MAX_PAGES];
+  I32             term_count;
+  I64             word_bytes;
+  I32*            slots;
+  U32*            hashes;
+  I64             slot_count;
+};
+
+static Dictionary dictionary;
+
+static void make_dictionary(Arena* word_arena) {
+  dictionary.word_arena = word_arena;
+  dictionary.slot_arena = make_arena(1ll << 36);
+}
+
+static String term_word(I32 term) {
+  return dictionary.pages[term >> DICTIONARY_PAGE_BITS][term & (DICTIONARY_PAGE_SIZE - 1)];
+}
+
+// The slot of word, or the empty slot it would go in.
+static I64 find_slot(String word, U32 hash) {
+  I64 mask = dictionary.slot_count - 1;
+  for (I64 slot = hash & mask;; slot = (slot + 1) & mask) {
+    I32 entry = dictionary.slots[slot];
+    if (entry == 0 || (dictionary.hashes[slot] == hash && term_word(entry - 1) == word)) {
+      return slot;
+    }
+  }
+}
+
+// The tables it outgrows are left in the slot arena, which at most doubles it.
+static void grow_dictionary() {
+  I32* old_slots  = dictionary.slots;
+  U32* old_hashes = dictionary.hashes;
+  I64  old_count  = dictionary.slot_count;
+
+  dictionary.slot_count = old_count == 0 ? 1 << 16 : 2 * old_count;
+  dictionary.slots      = allocate_array<I32>(&dictionary.slot_arena, dictionary.slot_count);
+  dictionary.hashes     = allocate_array<U32>(&dictionary.slot_arena, dictionary.slot_count);
+
+  I64 mask = dictionary.slot_count - 1;
+  for (I64 i = 0; i < old_count; i++) {
+    if (old_slots[i] != 0) {
+      I64 slot = old_hashes[i] & mask;
+      while (dictionary.slots[slot] != 0) {
+	slot = (slot + 1) & mask;
+      }
+      dictionary.slots[slot]  = old_slots[i];
+      dictionary.hashes[slot] = old_hashes[i];
+    }
+  }
+}
+
+// The number of word, which gets one if it is new. Callers hold the lock.
+static I32 intern_term(String word) {
+  if (2 * (dictionary.term_count + 1ll) > dictionary.slot_count) {
+    grow_dictionary();
+  }
+
+  U32 hash = hash_word(word);
+  I64 slot = find_slot(word, hash);
+  if (dictionary.slots[slot] != 0) {
+    return dictionary.slots[slot] - 1;
+  }
+
+  I32 term = dictionary.term_count;
+  I32 page = term >> DICTIONARY_PAGE_BITS;
+  if (page == DICTIONARY_MAX_PAGES) {
+    println(ERROR "The dictionary ran out of its ", (I64) DICTIONARY_MAX_PAGES * DICTIONARY_PAGE_SIZE, " terms.");
+    exit(EXIT_FAILURE);
+  }
+  if (dictionary.pages[page] == nullptr) {
+    dictionary.pages[page] = allocate_array<String>(dictionary.word_arena, DICTIONARY_PAGE_SIZE);
+  }
+
+  String copy = allocate_bytes(dictionary.word_arena, word.size, 1);
+  memcpy(copy.data, word.data, word.size);
+  dictionary.pages[page][term & (DICTIONARY_PAGE_SIZE - 1)] = copy;
+
+  dictionary.slots[slot]   = term + 1;
+  dictionary.hashes[slot]  = hash;
+  dictionary.word_bytes   += word.size;
+  dictionary.term_count++;
+  return term;
+}
+
+// Numbers the words of a whole file, taking the lock a batch at a time so
+// queries looking up their words do not wait for all of it.
+static void intern_terms(String* words, I32* terms, I64 count) {
+  TRACE_ZONE(ZONE_INTERN);
+  for (I64 start = 0; start < count; start += DICTIONARY_BATCH_SIZE) {
+    I64 end = min(count, start + DICTIONARY_BATCH_SIZE);
+    pthread_mutex_lock(&dictionary.lock);
+    for (I64 i = start; i < end; i++) {
+      terms[i] = intern_term(words[i]);
+    }
+    pthread_mutex_unlock(&dictionary.lock);
+  }
+}
+
+// The number of word, or -1 if no file has it.
+static I32 find_term(String word) {
+  pthread_mutex_lock(&dictionary.lock);
+  I32 term = -1;
+  if (dictionary.slot_count > 0) {
+    term = dictionary.slots[find_slot(word, hash_word(word))] - 1;
+  }
+  pthread_mutex_unlock(&dictionary.lock);
+  return term;
+}
+
+// The numbers of an index's terms by their position in it, and a table back
+// from numbers to positions. Slots hold a position plus one, or zero when
+// empty. A dense array over every number would cost each file the whole
+// dictionary.
+struct TermTable {
+  I32* terms;
+  I32* slots;
+  I64  slot_count;
+};
+
+static U64 term_slot(TermTable* table, I32 term) {
+  return ((U32) term * 0x9E3779B97F4A7C15ull) >> 32 & (table->slot_count - 1);
+}
+
+static TermTable make_term_table(Arena* arena, I32* terms, I64 count) {
+  TermTable table  = {};
+  table.terms      = terms;
+  table.slot_count = 1;
+  while (table.slot_count < 2 * count) {
+    table.slot_count *= 2;
+  }
+  table.slots = allocate_array<I32>(arena, table.slot_count);
+
+  for (I64 i = 0; i < count; i++) {
+    U64 slot = term_slot(&table, terms[i]);
+    while (table.slots[slot] != 0) {
+      slot = (slot + 1) & (table.slot_count - 1);
+    }
+    table.slots[slot] = i + 1;
+  }
+  return table;
+}
+
+// The position of term, or -1 if the index does not have it.
+static I64 find_position(TermTable* table, I32 term) {
+  TRACE_ZONE(ZONE_LOOKUP);
+  if (term < 0 || table->slot_count == 0) {
+    return -1;
+  }
+  for (U64 slot = term_slot(table, term);; slot = (slot + 1) & (table->slot_count - 1)) {
+    I32 position = table->slots[slot] - 1;
+    if (position == -1 || table->terms[position] == term) {
+      return position;
+    }
+  }
+}
@@ -0,0 +1,481 @@
+// Bulk export of every line a query matches, in time order across all
+// indexes. Logs are appended to in time order, so a cursor per file is merged
+// through a heap on the time of its next line, and merged indexes give one
+// cursor for each of their parts. Lines go out in batches of up to
+// EXPORT_BATCH_LINES with a single writev, pointing straight into the mapped
+// logs, so a line is never copied in user space unless it came out of a
+// compressed block. Writes block while the client's socket is full, which
+// holds the merge back to the client's pace, and nothing but the postings and
+// one batch is held however much is exported.
+//
+// Exports take as long as their clients do, so each one runs on a thread of
+// its own over a snapshot of the indexes, and at most MAX_EXPORTS at a time.
+// A client that takes nothing for EXPORT_STALL_TIMEOUT is dropped. Clients
+// only take more once they have read a good part of what they were sent, which
+// a slow one can take seconds over, so the timeout is well above that.
+
+#define EXPORT_BATCH_LINES    512
+#define EXPORT_BUFFER_SIZE    (1 << 16)
+#define EXPORT_PREFETCH_LINES 4096
+#define EXPORT_MAX_STAMP      64
+#define MAX_EXPORTS           4
+#define EXPORT_STALL_TIMEOUT  30000000000ll
+#define EXPORT_WAIT_SLICE     1
+
+// Consecutive lines mostly share their timestamp, so the text it was parsed
+// from is kept in stamp, and a line that starts with the same text has the
+// same time without parsing it again.
+struct ExportCursor {
+  Index* index;
+  bool   mapped;
+  I64*   values;
+  I64    count;
+  I64    next;
+  I64    prefetched;
+  String line;
+  time_t time;
+  I64    time_end;
+  U8     stamp[EXPORT_MAX_STAMP];
+  I64    stamp_size;
+  I32    order;
+};
+
+// Lines out of compressed blocks live in the block cache, which later reads
+// can evict, so they are copied to buffer until the batch is written.
+struct ExportWriter {
+  I32          connection_fd;
+  struct iovec parts[EXPORT_BATCH_LINES];
+  I32          part_count;
+  String       buffer;
+  I64          buffered;
+  I64          lines;
+  I64          progressed;
+  I64          unsent;
+  bool         failed;
+};
+
+// Bytes the client has not taken yet, or -1 where that cannot be told.
+static I64 unsent_bytes(I32 connection_fd) {
+#ifdef __linux__
+  I32 unsent = 0;
+  if (ioctl(connection_fd, SIOCOUTQ, &unsent) == 0) {
+    return unsent;
+  }
+#endif
+  return -1;
+}
+
+// A blocked send only wakes up once a good part of the socket's buffer is
+// free, which can take a slow client longer than the stall timeout, so sends
+// time out every EXPORT_WAIT_SLICE seconds and the client only counts as
+// stalled if it has not taken any of what is queued for it since.
+static bool export_stalled(ExportWriter* writer) {
+  I64 now    = now_nanoseconds();
+  I64 unsent = unsent_bytes(writer->connection_fd);
+  if (unsent != writer->unsent) {
+    writer->unsent     = unsent;
+    writer->progressed = now;
+  }
+  return now - writer->progressed >= EXPORT_STALL_TIMEOUT;
+}
+
+// Short writes only move the batch along, the socket is blocking. The ring
+// belongs to the thread serving requests, so this writes directly.
+static void flush_export(ExportWriter* writer) {
+  TRACE_ZONE(ZONE_WRITE);
+  struct iovec* parts = writer->parts;
+  I32           count = writer->part_count;
+  while (count > 0 && !writer->failed) {
+    I64 bytes_written = writev(writer->connection_fd, parts, count);
+    if (bytes_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (export_stalled(writer)) {
+	println(WARN "Stopped export, the client stopped reading.");
+	writer->failed = true;
+      }
+      continue;
+    }
+    if (bytes_written <= 0) {
+      println(WARN "Stopped export, failed to write to connection: ", get_error(), '.');
+      writer->failed = true;
+      break;
+    }
+    add(&stats.bytes_streamed, bytes_written);
+    writer->progressed = now_nanoseconds();
+
+    while (count > 0 && bytes_written >= (I64) parts->iov_len) {
+      bytes_written -= parts->iov_len;
+      parts++;
+      count--;
+    }
+    if (count > 0) {
+      parts->iov_base  = (U8*) parts->iov_base + bytes_written;
+      parts->iov_len  -= bytes_written;
+    }
+  }
+  writer->part_count = 0;
+  writer->buffered   = 0;
+}
+
+static void add_export_part(ExportWriter* writer, String part) {
+  assert(writer->part_count < EXPORT_BATCH_LINES);
+  writer->parts[writer->part_count] = to_iovec(part);
+  writer->part_count++;
+}
+
+// Room for the line is made before it is copied, so a flush never reuses the
+// buffer under a copy that has not been written yet. A line too long for the
+// buffer is written before the block it is in can be evicted.
+static void export_line(ExportWriter* writer, String line, bool mapped) {
+  bool copy = !mapped && line.size <= writer->buffer.size;
+  if (writer->part_count + 2 > EXPORT_BATCH_LINES || (copy && writer->buffered + line.size > writer->buffer.size)) {
+    flush_export(writer);
+  }
+
+  bool newline = line.size > 0 && line[line.size - 1] == '\n';
+  if (copy) {
+    String copied = slice(writer->buffer, writer->buffered, writer->buffered + line.size);
+    memcpy(copied.data, line.data, line.size);
+    writer->buffered += line.size;
+    line              = copied;
+  }
+  add_export_part(writer, line);
+  if (!newline) {
+    add_export_part(writer, "\n");
+  }
+  if (!mapped && !copy) {
+    flush_export(writer);
+  }
+  writer->lines++;
+}
+
+// Moves the cursor to its next line in the time range, advising the kernel
+// of the pages it is about to read a window at a time.
+static bool advance_export(ExportCursor* cursor, BlockCache* cache, char* log_time_format, time_t start_time, time_t end_time, Cancel* cancel) {
+  while (cursor->next < cursor->count && !should_stop(cancel)) {
+    if (cursor->next == cursor->prefetched) {
+      Postings window    = {};
+      window.values      = &cursor->values[cursor->next];
+      window.count       = min(cursor->count - cursor->next, (I64) EXPORT_PREFETCH_LINES);
+      prefetch_postings(cursor->index, window);
+      cursor->prefetched = cursor->next + window.count;
+    }
+
+    String line = read_line(cursor->index, cursor->values[cursor->next], cache);
+    cursor->line = line;
+    cursor->next++;
+    if (cursor->stamp_size == 0 || line.size < cursor->stamp_size || memcmp(line.data, cursor->stamp, cursor->stamp_size) != 0) {
+      TRACE_ZONE(ZONE_TIME_FILTER);
+      I64 time_end       = 0;
+      cursor->time       = line_time(line, log_time_format, &time_end);
+      cursor->time_end   = time_end;
+      cursor->stamp_size = cursor->time != -1 && time_end <= EXPORT_MAX_STAMP ? time_end : 0;
+      memcpy(cursor->stamp, line.data, cursor->stamp_size);
+    }
+    cancel->lines_scanned++;
+    if (start_time <= cursor->time && cursor->time <= end_time) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Ties are broken by cursor, so equal times always come out the same way.
+static bool export_less(ExportCursor* a, ExportCursor* b) {
+  return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void sift_down_export(ExportCursor** heap, I64 count, I64 i) {
+  while (true) {
+    I64 smallest = i;
+    for (I64 child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++) {
+      if (export_less(heap[child], heap[smallest])) {
+	smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    ExportCursor* swap = heap[i];
+    heap[i]            = heap[smallest];
+    heap[smallest]     = swap;
+    i                  = smallest;
+  }
+}
+
+// Postings of a merged index are grouped by part, and every part is a file of
+// its own with a cursor of its own.
+static I32 add_export_cursors(ExportCursor* cursors, I32 cursor_count, Index* index, Postings postings) {
+  for (I64 start = 0; start < postings.count;) {
+    I64    end  = start + 1;
+    Index* file = index;
+    if (index->part_count > 0) {
+      I64 part = location_file(postings.values[start]);
+      while (end < postings.count && location_file(postings.values[end]) == part) {
+	end++;
+      }
+      file = index->parts[part];
+    } else {
+      end = postings.count;
+    }
+
+    if (cursors != nullptr) {
+      ExportCursor* cursor = &cursors[cursor_count];
+      *cursor              = {};
+      cursor->index        = index;
+      cursor->mapped       = file->store == nullptr;
+      cursor->values       = &postings.values[start];
+      cursor->count        = end - start;
+      cursor->order        = cursor_count;
+    }
+    cursor_count++;
+    start = end;
+  }
+  return cursor_count;
+}
+
+// The matches of every index merged in time order, which exports stream and
+// shards cut their first lines for a coordinator out of.
+struct ExportMerge {
+  ExportCursor*  cursors;
+  ExportCursor** heap;
+  I64            heaped;
+  BlockCache*    cache;
+  char*          log_time_format;
+  time_t         start_time;
+  time_t         end_time;
+};
+
+// Without a start or an end the merge is unbounded on that side.
+static void start_merge(
+  Arena*       scratch_arena,
+  ExportMerge* merge,
+  char*        log_time_format,
+  Index**      indexes,
+  I32          index_count,
+  Parameters   parameters,
+  Query*       query,
+  I64*         phases,
+  Cancel*      cancel
+) {
+  const char* query_time_format = "%Y-%m-%dT%H:%M";
+
+  merge->log_time_format = log_time_format;
+  merge->start_time      = parameters.start.size > 0 ? parse_time(parameters.start, query_time_format) : 0;
+  merge->end_time        = parameters.end.size > 0 ? parse_time(parameters.end, query_time_format) : INT64_MAX;
+
+  Postings* matches      = allocate_array<Postings>(scratch_arena, index_count);
+  I32       cursor_count = 0;
+  for (I32 i = 0; i < index_count; i++) {
+    matches[i]   = match_query(scratch_arena, indexes[i], query, phases, cancel);
+    cursor_count = add_export_cursors(nullptr, cursor_count, indexes[i], matches[i]);
+  }
+
+  merge->cursors = allocate_array<ExportCursor>(scratch_arena, cursor_count);
+  merge->heap    = allocate_array<ExportCursor*>(scratch_arena, cursor_count);
+  I32 added      = 0;
+  for (I32 i = 0; i < index_count; i++) {
+    added = add_export_cursors(merge->cursors, added, indexes[i], matches[i]);
+  }
+
+  merge->cache        = allocate<BlockCache>(scratch_arena);
+  merge->cache->arena = scratch_arena;
+
+  I64 filter_start = now_nanoseconds();
+  for (I32 i = 0; i < cursor_count; i++) {
+    ExportCursor* cursor = &merge->cursors[i];
+    if (advance_export(cursor, merge->cache, log_time_format, merge->start_time, merge->end_time, cancel)) {
+      merge->heap[merge->heaped] = cursor;
+      merge->heaped++;
+    }
+  }
+  for (I64 i = merge->heaped / 2 - 1; i >= 0; i--) {
+    sift_down_export(merge->heap, merge->heaped, i);
+  }
+  phases[PHASE_TIME_FILTER] += now_nanoseconds() - filter_start;
+}
+
+// Other cursors may have evicted the block a line came out of since it was
+// read, but it is cached again when read right before it is used.
+static String merged_line(ExportMerge* merge, ExportCursor* cursor) {
+  return cursor->mapped ? cursor->line : read_line(cursor->index, cursor->values[cursor->next - 1], merge->cache);
+}
+
+static void advance_merge(ExportMerge* merge, Cancel* cancel) {
+  ExportCursor* cursor = merge->heap[0];
+  if (!advance_export(cursor, merge->cache, merge->log_time_format, merge->start_time, merge->end_time, cancel)) {
+    merge->heaped--;
+    merge->heap[0] = merge->heap[merge->heaped];
+  }
+  sift_down_export(merge->heap, merge->heaped, 0);
+}
+
+// Returns the number of lines written.
+static I64 run_export(
+  Arena*     scratch_arena,
+  char*      log_time_format,
+  I32        connection_fd,
+  Index**    indexes,
+  I32        index_count,
+  Parameters parameters,
+  Query*     query,
+  I64*       phases,
+  Cancel*    cancel
+) {
+  I64 saved = save(scratch_arena);
+
+  ExportMerge merge = {};
+  start_merge(scratch_arena, &merge, log_time_format, indexes, index_count, parameters, query, phases, cancel);
+
+  ExportWriter* writer  = allocate<ExportWriter>(scratch_arena);
+  writer->connection_fd = connection_fd;
+  writer->buffer        = allocate_bytes(scratch_arena, EXPORT_BUFFER_SIZE, 1);
+  writer->progressed    = now_nanoseconds();
+  writer->unsent        = -1;
+
+  String headers = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\nConnection: close\r\n\r\n";
+  add_export_part(writer, headers);
+
+  I64 filter_start = now_nanoseconds();
+  while (merge.heaped > 0 && !writer->failed && cancel->reason == CANCEL_NONE) {
+    ExportCursor* cursor = merge.heap[0];
+    export_line(writer, merged_line(&merge, cursor), cursor->mapped);
+    advance_merge(&merge, cancel);
+  }
+  flush_export(writer);
+  phases[PHASE_TIME_FILTER] += now_nanoseconds() - filter_start;
+
+  if (writer->failed && cancel->reason == CANCEL_NONE) {
+    cancel->reason = CANCEL_DISCONNECTED;
+  }
+  I64 lines = writer->lines;
+  restore(scratch_arena, saved);
+  return lines;
+}
+
+// A shard answering a coordinator sends the first parameters.lines lines in
+// time order across all of its indexes as one page, instead of a page out of
+// each index, so the coordinator can merge them with the other shards' and
+// cut any page out of the result.
+static void write_first_lines(
+  Arena*     query_arena,
+  Arena*     scratch_arena,
+  char*      log_time_format,
+  I32        connection_fd,
+  Index**    indexes,
+  I32        index_count,
+  Parameters parameters,
+  Query*     query,
+  I64*       phases,
+  Cancel*    cancel
+) {
+  I64 saved = save(scratch_arena);
+
+  ExportMerge merge = {};
+  start_merge(scratch_arena, &merge, log_time_format, indexes, index_count, parameters, query, phases, cancel);
+
+  I64  filter_start = now_nanoseconds();
+  Page page         = make_page(query_arena, parameters.lines);
+  page.start_time   = merge.start_time;
+  while (merge.heaped > 0 && page.count < page.capacity && cancel->reason == CANCEL_NONE) {
+    ExportCursor* cursor = merge.heap[0];
+    String        line   = merged_line(&merge, cursor);
+    add_to_page(query_arena, &page, line, cursor->time, line_level(line, cursor->time_end));
+    advance_merge(&merge, cancel);
+  }
+  phases[PHASE_TIME_FILTER] += now_nanoseconds() - filter_start;
+
+  if (cancel->reason != CANCEL_DISCONNECTED) {
+    I64 write_start = now_nanoseconds();
+    write_page(connection_fd, &page);
+    phases[PHASE_WRITE] += now_nanoseconds() - write_start;
+  }
+  restore(scratch_arena, saved);
+}
+
+// Everything an export needs from its request is copied or parsed into an
+// arena of its own, which goes away with the thread.
+struct ExportJob {
+  pthread_t  thread;
+  Arena      arena;
+  I32        connection_fd;
+  char*      log_time_format;
+  Snapshot   snapshot;
+  Parameters parameters;
+  Query*     query;
+  I64        start;
+};
+
+static I32 exports_running;
+
+static void* run_export_thread(void* argument) {
+  ExportJob* job = (ExportJob*) argument;
+  TRACE_MARK(mark);
+
+  I64 phases[PHASE_COUNT] = {};
+
+  // Exports run for as long as the client keeps reading.
+  Cancel cancel        = {};
+  cancel.connection_fd = job->connection_fd;
+  cancel.start         = job->start;
+  cancel.deadline      = INT64_MAX;
+
+  Snapshot* snapshot = &job->snapshot;
+  I64       lines    = run_export(
+    &job->arena, job->log_time_format, job->connection_fd, snapshot->indexes, snapshot->index_count,
+    job->parameters, job->query, phases, &cancel
+  );
+  add(&stats.exports, 1);
+  add(&stats.lines_exported, lines);
+  if (cancel.reason == CANCEL_DISCONNECTED) {
+    println(WARN "Client disconnected, stopped export after ", lines, " lines.");
+    add(&stats.queries_disconnected, 1);
+  } else {
+    println(INFO "Exported ", lines, " lines in ", (now_nanoseconds() - job->start) / 1000000, " ms.");
+  }
+  TRACE_REPORT(job->parameters.query, mark);
+  flush();
+
+  release_snapshot(snapshot);
+  if (close(job->connection_fd) == -1) {
+    println(WARN "Failed to close socket: ", get_error(), '.');
+  }
+  __atomic_sub_fetch(&exports_running, 1, __ATOMIC_ACQ_REL);
+
+  Arena arena = job->arena;
+  destroy(&arena);
+  return nullptr;
+}
+
+// Returns false if MAX_EXPORTS are already running. Otherwise the export owns
+// connection_fd from then on and closes it when it is done.
+static bool start_export(char* log_time_format, I32 connection_fd, String parameters_line) {
+  if (__atomic_add_fetch(&exports_running, 1, __ATOMIC_ACQ_REL) > MAX_EXPORTS) {
+    __atomic_sub_fetch(&exports_running, 1, __ATOMIC_ACQ_REL);
+    return false;
+  }
+
+  struct timeval wait = {};
+  wait.tv_sec         = EXPORT_WAIT_SLICE;
+  if (setsockopt(connection_fd, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait)) == -1) {
+    println(WARN "Failed to set a send timeout on the connection: ", get_error(), '.');
+  }
+
+  // The snapshot is taken first, so the query finds the terms of every file
+  // in it.
+  Arena      arena     = make_arena(1ll << 36);
+  ExportJob* job       = allocate<ExportJob>(&arena);
+  job->start           = now_nanoseconds();
+  job->connection_fd   = connection_fd;
+  job->log_time_format = log_time_format;
+  job->snapshot        = take_snapshot(&arena);
+
+  String copied = allocate_bytes(&arena, parameters_line.size, 1);
+  memcpy(copied.data, parameters_line.data, parameters_line.size);
+  job->parameters = parse_parameters(copied);
+  job->query      = parse_query(&arena, job->parameters.query, job->parameters.exact);
+  job->arena      = arena;
+
+  assert(pthread_create(&job->thread, NULL, run_export_thread, job) == 0);
+  assert(pthread_detach(job->thread) == 0);
+  return true;
+}
@@ -0,0 +1,687 @@
+struct Node {
+  U32      is_black;
+  String   word;
+  Postings postings;
+  Node*    children[2];
+};
+
+static void print_tree(Node* node, I64 indents) {
+  for (I64 i = 0; i < indents; i++) {
+    print(' ');
+  }
+
+  if (node == nullptr) {
+    println("nil");
+  } else {
+    String color = node->is_black == 0 ? "\x1b[31m" : "\x1b[30m\x1b[47m";
+    String clear = "\x1b[0m";
+    println(color, node->word, clear);
+  
+    for (I64 i = 0; i < (I64) length(node->children); i++) {
+      print_tree(node->children[i], indents + 1);
+    }
+  }
+}
+
+struct CheckResult {
+  I64 depth;
+  I64 count;
+};
+
+static CheckResult check_node(Node* node) {
+  if (node == nullptr) {
+    return (CheckResult) {};
+  }
+  
+  assert(node->word.size > 0);
+
+  I64 max_depth = 0;
+  I64 min_depth = 0;
+  I64 count     = 0;
+  for (I64 i = 0; i < (I64) length(node->children); i++) {
+    Node* child = node->children[i];
+    if (child != nullptr) {
+      I32  comparison = compare(node->word, child->word);
+      if (i == 0) {
+	assert(comparison > 0);
+      }
+      if (i == 1) {
+	assert(comparison < 0);
+      }
+    }
+    
+    CheckResult result = check_node(child);
+    if (result.depth > max_depth) {
+      max_depth = result.depth;
+    }
+    if (min_depth == 0 || result.depth < min_depth) {
+      min_depth = result.depth;
+    }
+    count += result.count;
+  }
+
+  CheckResult result = {};
+  result.depth       = max_depth + 1;
+  result.count       = count + 1;
+  return result;
+}
+
+static Node* make_node(Arena* arena, String word, I64 offset) {
+  Node* node         = allocate<Node>(arena);
+  node->word         = word;
+  append_posting(arena, &node->postings, offset);
+  return node;
+}
+
+static Node* balance(Node* grandparent) {
+  TRACE_ZONE(ZONE_BALANCE);
+  if (grandparent->is_black) {
+    for (I64 parent_direction = 0; parent_direction < 2; parent_direction++) {
+      Node* parent = grandparent->children[parent_direction];
+      if (parent != nullptr && !parent->is_black) {
+	Node* child = parent->children[parent_direction];
+	if (child != nullptr && !child->is_black) {
+	  child->is_black                         = true;
+	  grandparent->children[parent_direction] = parent->children[1 - parent_direction];
+	  parent->children[1 - parent_direction]  = grandparent;
+	  return parent;
+	}
+	Node* brother = parent->children[1 - parent_direction];
+	if (brother != nullptr && !brother->is_black) {
+	  parent->is_black                        = true;
+	  parent->children[1 - parent_direction]  = brother->children[parent_direction];
+	  grandparent->children[parent_direction] = brother->children[1 - parent_direction];
+	  brother->children[parent_direction]     = parent;
+	  brother->children[1 - parent_direction] = grandparent;
+	  return brother;
+	}
+      }
+    }
+  }
+  return grandparent;
+}
+
+static Node* insert(Arena* arena, Node* node, String word, I64 offset) {
+  if (node == nullptr) {
+    String new_word = allocate_bytes(arena, word.size, 1);
+    memcpy(new_word.data, word.data, word.size);
+    return make_node(arena, new_word, offset);
+  }
+  I32 comparison = compare(word, node->word);
+  if (comparison < 0) {
+    node->children[0] = insert(arena, node->children[0], word, offset);
+  } else if (comparison > 0) {
+    node->children[1] = insert(arena, node->children[1], word, offset);
+  } else if (comparison == 0) {
+    append_posting(arena, &node->postings, offset);
+  }
+  return balance(node);
+}
+
+static Node* insert_word(Arena* arena, Node* root, String word, I64 offset) {
+  TRACE_ZONE(ZONE_INSERT);
+  root           = insert(arena, root, word, offset);
+  root->is_black = true;
+  return root;
+}
+
+static Node* index_lines(Arena* node_arena, TemplateMiner* miner, String logs, I64 base, Node* node_root) {
+  TRACE_ZONE_BYTES(ZONE_INDEX_LINES, logs.size);
+  I64 line_start = 0;
+  for (I64 i = 0; i <= logs.size; i++) {
+    if (i == logs.size || logs[i] == '\n') {
+      String    line     = slice(logs, line_start, i);
+      Template* line_template = miner != nullptr ? mine_line(miner, line) : nullptr;
+      if (line_template != nullptr) {
+	node_root = insert_word(node_arena, node_root, line_template->term, base + line_start);
+      }
+
+      WordIterator words = iterate_words(line);
+      String       word  = {};
+      while (next_word(&words, &word)) {
+	if (is_constant(miner, word)) {
+	  continue;
+	}
+	TokenIterator tokens = iterate_tokens(word);
+	String        term   = {};
+	while (next_token(&tokens, &term)) {
+	  node_root = insert_word(node_arena, node_root, term, base + line_start);
+	}
+      }
+      line_start = i + 1;
+    }
+  }
+  return node_root;
+}
+
+static void print_index_summary(Node* node_root) {
+  CheckResult result = check_node(node_root);
+  println(INFO "Built index with tree_depth=", result.depth, " node_count=", result.count, '.');
+  flush();
+}
+
+static Node* index_logs(Arena* node_arena, TemplateMiner* miner, String logs, Node* node_root) {
+  node_root = index_lines(node_arena, miner, logs, 0, node_root);
+  print_index_summary(node_root);
+  return node_root;
+}
+
+#ifdef __linux__
+
+// Same as index_logs, but the file is streamed through the ring's registered
+// buffers instead of being faulted in through its mapping. Lines that straddle
+// two blocks are stitched together in carry. Returns false if a block could
+// not be read, and closes the reader either way.
+static bool index_blocks(Arena* node_arena, Arena* scratch_arena, TemplateMiner* miner, BlockReader* reader, Node** root) {
+  I64 saved = save(scratch_arena);
+
+  Node*  node_root      = nullptr;
+  String carry          = allocate_bytes(scratch_arena, RING_BUFFER_SIZE, 1);
+  I64    carry_capacity = carry.size;
+  I64    carry_start    = 0;
+  I64    block_start    = 0;
+  carry.size            = 0;
+
+  while (true) {
+    String block = {};
+    if (!next_block(reader, &block)) {
+      restore(scratch_arena, saved);
+      close_blocks(reader);
+      return false;
+    }
+    if (block.size == 0) {
+      break;
+    }
+
+    String rest       = block;
+    I64    rest_start = block_start;
+    if (carry.size > 0) {
+      I64 newline = find(block, '\n');
+      if (carry.size + newline > carry_capacity) {
+	carry_capacity = 2 * (carry.size + newline);
+	String grown   = allocate_bytes(scratch_arena, carry_capacity, 1);
+	memcpy(grown.data, carry.data, carry.size);
+	carry.data = grown.data;
+      }
+      memcpy(&carry[carry.size], block.data, newline);
+      carry.size += newline;
+      if (newline == block.size) {
+	block_start += block.size;
+	continue;
+      }
+
+      node_root  = index_lines(node_arena, miner, carry, carry_start, node_root);
+      carry.size = 0;
+      rest       = suffix(block, newline + 1);
+      rest_start = block_start + newline + 1;
+    }
+
+    I64 last_newline = rest.size - 1;
+    while (last_newline >= 0 && rest[last_newline] != '\n') {
+      last_newline--;
+    }
+    node_root = index_lines(node_arena, miner, prefix(rest, last_newline + 1), rest_start, node_root);
+
+    String tail = suffix(rest, last_newline + 1);
+    if (tail.size > carry_capacity) {
+      carry_capacity = 2 * tail.size;
+      carry.data     = allocate_bytes(scratch_arena, carry_capacity, 1).data;
+    }
+    memcpy(carry.data, tail.data, tail.size);
+    carry.size   = tail.size;
+    carry_start  = rest_start + last_newline + 1;
+    block_start += block.size;
+  }
+
+  if (carry.size > 0) {
+    node_root = index_lines(node_arena, miner, carry, carry_start, node_root);
+  }
+
+  restore(scratch_arena, saved);
+  close_blocks(reader);
+  print_index_summary(node_root);
+  *root = node_root;
+  return true;
+}
+
+#endif
+
+static Node* index_store(Arena* node_arena, Arena* scratch_arena, TemplateMiner* miner, BlockStore* store) {
+  I64    saved     = save(scratch_arena);
+  String buffer    = allocate_bytes(scratch_arena, store->header->max_block_size, 1);
+  Node*  node_root = nullptr;
+  for (I64 block = 0; block < store->header->block_count; block++) {
+    String text = {};
+    if (decompress_block(store, block, buffer, &text)) {
+      node_root = index_lines(node_arena, miner, text, make_location(block, 0), node_root);
+    }
+  }
+  restore(scratch_arena, saved);
+  print_index_summary(node_root);
+  return node_root;
+}
+
+// mktime checks the time zone again on every call, which costs far more than
+// parsing, so the start of the last hour it converted is kept and times in the
+// same hour are counted from it.
+struct HourCache {
+  struct tm hour;
+  time_t    start;
+  bool      valid;
+};
+
+static thread_local HourCache hour_cache;
+
+static time_t parse_time(String input, const char* format, I64* end = nullptr) {
+  struct tm time   = {};
+  char*     result = strptime((char*) input.data, format, &time);
+  if (result == NULL) {
+    return -1;
+  }
+  if (end != nullptr) {
+    *end = (U8*) result - input.data;
+  }
+
+  struct tm* hour = &hour_cache.hour;
+  if (!hour_cache.valid || hour->tm_year != time.tm_year || hour->tm_mon != time.tm_mon || hour->tm_mday != time.tm_mday || hour->tm_hour != time.tm_hour) {
+    struct tm start   = time;
+    start.tm_min      = 0;
+    start.tm_sec      = 0;
+    hour_cache.start  = mktime(&start);
+    hour_cache.valid  = hour_cache.start != -1;
+    *hour             = time;
+  }
+  if (!hour_cache.valid) {
+    return mktime(&time);
+  }
+  return hour_cache.start + 60 * time.tm_min + time.tm_sec;
+}
+
+struct Options {
+  bool   use_ring;
+  String compress_directory;
+  I64    query_timeout;
+  I64    memory_budget;
+  String spill_directory;
+  I64    merge_factor;
+  I64    port;
+  I64    shard;
+  I64    shard_count;
+  String coordinator;
+  bool   mine_templates;
+  I64    index_threads;
+};
+
+struct IndexStats {
+  I64 build_nanoseconds;
+  I64 terms;
+  I64 postings;
+  I64 arena_bytes;
+};
+
+// Offsets in the postings of an index with a store are block locations. An
+// index built under a memory budget has a segment instead of postings. A merged
+// index has a segment and the indexes of the files it covers as parts, and its
+// postings hold the part in their upper FILE_BITS bits. An index with
+// templates leaves their words out of the postings of the lines they cover.
+// Either way its terms are in word order, and terms has their numbers.
+struct Index {
+  Mapping*    mapping;
+  BlockStore* store;
+  Postings*   postings;
+  Segment*    segment;
+  TermTable   terms;
+  Index**     parts;
+  I32         part_count;
+  Template**  templates;
+  I64         template_count;
+  Bloom*      bloom;
+  IndexStats  stats;
+  I32         references;
+  Index*      next;
+};
+
+#define FILE_BITS  16
+#define FILE_SHIFT (64 - FILE_BITS)
+#define MAX_PARTS  (1 << FILE_BITS)
+
+static I64 make_file_location(I64 file, I64 location) {
+  return (file << FILE_SHIFT) | location;
+}
+
+static I64 location_file(I64 location) {
+  return (U64) location >> FILE_SHIFT;
+}
+
+static I64 file_location(I64 location) {
+  return location & ((1ll << FILE_SHIFT) - 1);
+}
+
+static Postings lookup_postings(Index* index, I32 term) {
+  I64 position = find_position(&index->terms, term);
+  if (position == -1) {
+    return {};
+  }
+  if (index->segment != nullptr) {
+    return segment_postings(index->segment, position);
+  }
+  return index->postings[position];
+}
+
+// Walks the terms of an index in sorted order, through its segment's entries
+// or its postings and the dictionary.
+struct TermIterator {
+  Index* index;
+  I64    entry;
+};
+
+static TermIterator iterate_terms(Index* index) {
+  TermIterator terms = {};
+  terms.index        = index;
+  return terms;
+}
+
+static bool next_term(TermIterator* terms, String* word, Postings* postings) {
+  Index* index = terms->index;
+  if (terms->entry == index->stats.terms) {
+    return false;
+  }
+  if (index->segment != nullptr) {
+    SegmentEntry* entry = &index->segment->entries[terms->entry];
+    *word               = String(&index->segment->words[entry->word_offset], entry->word_size);
+    *postings           = segment_postings(index->segment, terms->entry);
+  } else {
+    *word     = term_word(index->terms.terms[terms->entry]);
+    *postings = index->postings[terms->entry];
+  }
+  terms->entry++;
+  return true;
+}
+
+static void add_terms_to_bloom(Bloom* bloom, String word) {
+  TokenIterator tokens = iterate_tokens(word);
+  String        term   = {};
+  while (word.size > 0 && next_token(&tokens, &term)) {
+    add_to_bloom(bloom, term);
+  }
+}
+
+// Words a template always has, or had, are only in the template.
+static Bloom* build_bloom(Arena* arena, Index* index) {
+  I64 word_count = index->stats.terms;
+  for (I64 i = 0; i < index->template_count; i++) {
+    word_count += index->templates[i]->token_count;
+    for (RetiredToken* retired = index->templates[i]->retired; retired != nullptr; retired = retired->next) {
+      word_count++;
+    }
+  }
+
+  Bloom*       bloom    = make_bloom(arena, word_count);
+  TermIterator terms    = iterate_terms(index);
+  String       word     = {};
+  Postings     postings = {};
+  while (next_term(&terms, &word, &postings)) {
+    add_to_bloom(bloom, word);
+  }
+  for (I64 i = 0; i < index->template_count; i++) {
+    Template* line_template = index->templates[i];
+    for (I32 j = 0; j < line_template->token_count; j++) {
+      add_terms_to_bloom(bloom, line_template->tokens[j]);
+    }
+    for (RetiredToken* retired = line_template->retired; retired != nullptr; retired = retired->next) {
+      add_terms_to_bloom(bloom, retired->word);
+    }
+  }
+  return bloom;
+}
+
+static void number_terms(Arena* arena, Index* index, String* words) {
+  I32* terms = allocate_array<I32>(arena, index->stats.terms);
+  intern_terms(words, terms, index->stats.terms);
+  index->terms = make_term_table(arena, terms, index->stats.terms);
+}
+
+static void number_segment_terms(Arena* arena, Arena* scratch_arena, Index* index) {
+  Segment* segment = index->segment;
+  index->stats.terms    = segment->header->term_count;
+  index->stats.postings = segment->header->posting_count;
+
+  I64     saved = save(scratch_arena);
+  String* words = allocate_array<String>(scratch_arena, index->stats.terms);
+  for (I64 i = 0; i < index->stats.terms; i++) {
+    SegmentEntry* entry = &segment->entries[i];
+    words[i]            = String(&segment->words[entry->word_offset], entry->word_size);
+  }
+  number_terms(arena, index, words);
+  restore(scratch_arena, saved);
+}
+
+static void collect_nodes(Node* node, Node** nodes, I64* count) {
+  if (node != nullptr) {
+    collect_nodes(node->children[0], nodes, count);
+    nodes[*count] = node;
+    (*count)++;
+    collect_nodes(node->children[1], nodes, count);
+  }
+}
+
+// Keeps the postings of a finished tree in the node arena, every array cut
+// down to its count, and leaves the words to the dictionary. The tree itself
+// is in the build arena and goes away with it.
+static void freeze_tree(Arena* node_arena, Arena* build_arena, Index* index, Node* root) {
+  CheckResult result = check_node(root);
+  Node**      nodes  = allocate_array<Node*>(build_arena, result.count);
+  String*     words  = allocate_array<String>(build_arena, result.count);
+  I64         count  = 0;
+  collect_nodes(root, nodes, &count);
+
+  index->stats.terms = count;
+  index->postings    = allocate_array<Postings>(node_arena, count);
+  for (I64 i = 0; i < count; i++) {
+    Postings* postings = &index->postings[i];
+    *postings          = nodes[i]->postings;
+    postings->values   = allocate_array<I64>(node_arena, postings->count);
+    postings->capacity = postings->count;
+    memcpy(postings->values, nodes[i]->postings.values, sizeof(I64) * postings->count);
+    words[i]              = nodes[i]->word;
+    index->stats.postings += postings->count;
+  }
+  number_terms(node_arena, index, words);
+}
+
+// The miner's list of templates is in the build arena. Their terms are
+// numbered along with the rest of the index's.
+static void keep_templates(Arena* index_arena, Index* index, TemplateMiner* miner) {
+  if (miner == nullptr) {
+    return;
+  }
+  index->template_count = miner->template_count;
+  index->templates      = allocate_array<Template*>(index_arena, miner->template_count);
+  if (miner->template_count > 0) {
+    memcpy(index->templates, miner->templates, sizeof(Template*) * miner->template_count);
+  }
+  for (I64 i = 0; i < miner->template_count; i++) {
+    index->templates[i]->id = find_term(index->templates[i]->term);
+  }
+  println(INFO "Mined ", miner->template_count, " templates.");
+}
+
+// Trees and the miner's groups are built in build_arena, only what is kept
+// goes to the node and index arenas. Returns nullptr if the log could not be
+// read.
+static Index* build_index(
+  Arena*   index_arena,
+  Arena*   node_arena,
+  Arena*   build_arena,
+  Arena*   scratch_arena,
+  Options* options,
+  String   path
+) {
+  TRACE_ZONE(ZONE_BUILD);
+  Index* index = allocate<Index>(index_arena);
+
+  TemplateMiner* miner = nullptr;
+  if (options->mine_templates) {
+    miner = make_miner(build_arena, index_arena);
+  }
+
+  if (options->compress_directory.size > 0) {
+    String destination = derived_path(index_arena, options->compress_directory, path, ".blocks");
+    if (!compress_file(scratch_arena, path, destination)) {
+      return nullptr;
+    }
+
+    index->mapping = map_file(index_arena, destination);
+    if (index->mapping == nullptr) {
+      return nullptr;
+    }
+    index->store = open_store(index_arena, index->mapping);
+    if (index->store == nullptr) {
+      return nullptr;
+    }
+    if (options->memory_budget > 0) {
+      index->segment = build_segment(index_arena, scratch_arena, path, index->store, options->spill_directory, options->memory_budget, miner);
+      if (index->segment == nullptr) {
+	return nullptr;
+      }
+      number_segment_terms(node_arena, scratch_arena, index);
+    } else {
+      Node* root = index_store(build_arena, scratch_arena, miner, index->store);
+      freeze_tree(node_arena, build_arena, index, root);
+    }
+    advise(index->mapping, MADV_RANDOM);
+    keep_templates(index_arena, index, miner);
+    return index;
+  }
+
+  // The log is read rather than mapped while it is indexed under a budget, so
+  // its pages do not count against it until queries fault them in.
+  if (options->memory_budget > 0) {
+    index->segment = build_segment(index_arena, scratch_arena, path, nullptr, options->spill_directory, options->memory_budget, miner);
+    if (index->segment == nullptr) {
+      return nullptr;
+    }
+    index->mapping = map_file(index_arena, path);
+    if (index->mapping == nullptr) {
+      return nullptr;
+    }
+    number_segment_terms(node_arena, scratch_arena, index);
+    advise(index->mapping, MADV_RANDOM);
+    keep_templates(index_arena, index, miner);
+    return index;
+  }
+  
+  Mapping* mapping = map_file(index_arena, path);
+  if (mapping == nullptr) {
+    return nullptr;
+  }
+
+  Node* root    = nullptr;
+  bool  indexed = false;
+#ifdef __linux__
+  // The ring belongs to the thread serving requests, so only files indexed
+  // before it starts listening go through it.
+  BlockReader reader = {};
+  if (ring.enabled && options->index_threads == 0 && open_blocks(&reader, (char*) path.data)) {
+    if (!index_blocks(build_arena, scratch_arena, miner, &reader, &root)) {
+      release(mapping);
+      return nullptr;
+    }
+    indexed = true;
+  }
+#endif
+  if (!indexed) {
+    advise(mapping, MADV_SEQUENTIAL);
+    root = index_logs(build_arena, miner, mapping->text, nullptr);
+  }
+  advise(mapping, MADV_RANDOM);
+
+  index->mapping = mapping;
+  freeze_tree(node_arena, build_arena, index, root);
+  keep_templates(index_arena, index, miner);
+  return index;
+}
+
+// A log that cannot be indexed is skipped with a warning, the server goes on
+// without it.
+static Index* index_file(
+  Arena*   index_arena,
+  Arena*   node_arena,
+  Arena*   scratch_arena,
+  Options* options,
+  String   path
+) {
+  TRACE_MARK(mark);
+  I64 start       = now_nanoseconds();
+  I64 arena_start = save(node_arena);
+
+  // Postings grow by doubling while the tree is built, so it is built in an
+  // arena of its own and only the frozen postings are kept.
+  Arena  build_arena = make_arena(1ll << 36, true);
+  Index* index       = build_index(index_arena, node_arena, &build_arena, scratch_arena, options, path);
+  destroy(&build_arena);
+  TRACE_REPORT(path, mark);
+  if (index == nullptr) {
+    println(WARN "Skipped \"", path, "\", it could not be indexed.");
+    return nullptr;
+  }
+
+  index->references = 1;
+  index->bloom      = build_bloom(index_arena, index);
+
+  index->stats.build_nanoseconds = now_nanoseconds() - start;
+  index->stats.arena_bytes       = save(node_arena) - arena_start;
+
+  record(&stats.build_latency, index->stats.build_nanoseconds);
+  add(&stats.files_indexed, 1);
+  return index;
+}
+
+static String read_line(Index* index, I64 location, BlockCache* cache = &block_cache) {
+  TRACE_ZONE(ZONE_READ_LINE);
+  if (index->part_count > 0) {
+    index    = index->parts[location_file(location)];
+    location = file_location(location);
+  }
+  String text = index->mapping->text;
+  if (index->store != nullptr) {
+    text     = load_block(cache, index->store, location_block(location));
+    location = location_offset(location);
+  }
+  String line = suffix(text, location);
+  return prefix(line, find(line, '\n') + 1);
+}
+
+// The list holds a reference to every index on it, and requests take one
+// more while they search it, so an index that was merged away keeps its
+// postings until the last request over it is done. The logs of its files stay
+// mapped for the index they were merged into.
+static void drop_reference(Index* index) {
+  if (__atomic_sub_fetch(&index->references, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  if (index->segment != nullptr) {
+    retire(index->segment->mapping);
+    release(index->segment->mapping);
+  }
+  index->postings = nullptr;
+  index->segment  = nullptr;
+  index->terms    = {};
+}
+
+// Queries hold on to the mappings of every file they might read from.
+static void acquire_index(Index* index) {
+  __atomic_fetch_add(&index->references, 1, __ATOMIC_RELAXED);
+  acquire(index->mapping);
+  for (I32 i = 0; i < index->part_count; i++) {
+    acquire(index->parts[i]->mapping);
+  }
+}
+
+static void release_index(Index* index) {
+  release(index->mapping);
+  for (I32 i = 0; i < index->part_count; i++) {
+    release(index->parts[i]->mapping);
+  }
+  drop_reference(index);
+}
@@ -0,0 +1,447 @@
+// Optional io_uring backend. When it is enabled, socket accept/recv/writev and
+// the block reads used while indexing go through a single ring, otherwise every
+// function falls back to the plain blocking syscalls.
+
+static I32 bind(I32 fd, struct sockaddr_in address) {
+  return bind(fd, (struct sockaddr*) &address, sizeof(address));
+}
+
+static I32 accept(I32 fd, struct sockaddr_in* address) {
+  socklen_t address_size = sizeof(*address);
+  return accept(fd, (struct sockaddr*) address, &address_size);
+}
+
+static struct iovec to_iovec(String s) {
+  return (struct iovec) { .iov_base = s.data, .iov_len = (U64) s.size };
+}
+
+static struct iovec to_iovec(I32* n) {
+  return (struct iovec) { .iov_base = n, .iov_len = sizeof(I32) };
+}
+
+static bool write_all(I32 fd, String data) {
+  while (data.size > 0) {
+    I64 bytes_written = write(fd, data.data, data.size);
+    if (bytes_written == -1) {
+      return false;
+    }
+    data = suffix(data, bytes_written);
+  }
+  return true;
+}
+
+#define RING_ENTRIES      64
+#define RING_BUFFER_COUNT 4
+#define RING_BUFFER_SIZE  (1 << 20)
+
+enum {
+  RING_DISCARD = 0,
+  RING_ACCEPT  = 1,
+  RING_WAIT    = 2,
+  RING_READ    = 3,
+  RING_SLOTS   = RING_READ + RING_BUFFER_COUNT,
+};
+
+struct Ring {
+  bool enabled;
+
+#ifdef __linux__
+  I32 fd;
+  U32 entries;
+
+  U32* sq_head;
+  U32* sq_tail;
+  U32* sq_mask;
+  U32* sq_array;
+  U32* cq_head;
+  U32* cq_tail;
+  U32* cq_mask;
+
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+
+  U32  queued;
+  bool done  [RING_SLOTS];
+  I32  result[RING_SLOTS];
+
+  bool               accept_posted;
+  struct sockaddr_in accept_address;
+  socklen_t          accept_address_size;
+
+  String buffers[RING_BUFFER_COUNT];
+#endif
+};
+
+static Ring ring;
+
+#ifdef __linux__
+
+static I32 ring_enter(U32 to_submit, U32 min_complete, U32 flags) {
+  return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static I32 ring_register(U32 opcode, void* argument, U32 count) {
+  return syscall(__NR_io_uring_register, ring.fd, opcode, argument, count);
+}
+
+static void reap() {
+  U32 head = *ring.cq_head;
+  U32 tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+    if (cqe->user_data == RING_DISCARD) {
+      if (cqe->res < 0) {
+	println(WARN "Asynchronous ring operation failed: ", strerror(-cqe->res), '.');
+      }
+    } else {
+      ring.done  [cqe->user_data] = true;
+      ring.result[cqe->user_data] = cqe->res;
+    }
+    head++;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void submit(U32 min_complete) {
+  while (true) {
+    U32 flags  = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    I32 result = ring_enter(ring.queued, min_complete, flags);
+    if (result >= 0) {
+      ring.queued -= result;
+      break;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      println(ERROR "Failed to enter ring: ", get_error(), '.');
+      exit(EXIT_FAILURE);
+    }
+    reap();
+  }
+  reap();
+}
+
+static void queue(struct io_uring_sqe* sqe) {
+  U32 tail = *ring.sq_tail;
+  if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) {
+    submit(0);
+  }
+  U32 index            = tail & *ring.sq_mask;
+  ring.sqes[index]     = *sqe;
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.queued++;
+
+  if (sqe->user_data != RING_DISCARD) {
+    ring.done[sqe->user_data] = false;
+  }
+}
+
+static I32 wait_for(U64 slot) {
+  while (!ring.done[slot]) {
+    submit(1);
+  }
+  ring.done[slot] = false;
+  return ring.result[slot];
+}
+
+static I64 run(struct io_uring_sqe* sqe) {
+  sqe->user_data = RING_WAIT;
+  queue(sqe);
+  I32 result = wait_for(RING_WAIT);
+  if (result < 0) {
+    errno = -result;
+    return -1;
+  }
+  return result;
+}
+
+static void setup_ring(Arena* arena) {
+  struct io_uring_params params = {};
+
+  ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (ring.fd == -1) {
+    println(WARN "Failed to set up io_uring, falling back to syscalls: ", get_error(), '.');
+    return;
+  }
+  ring.entries = params.sq_entries;
+
+  I64 sq_size = params.sq_off.array + params.sq_entries * sizeof(U32);
+  I64 cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) {
+      sq_size = cq_size;
+    }
+    cq_size = sq_size;
+  }
+
+  U8* sq = (U8*) mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  U8* cq = sq;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED) {
+    cq = (U8*) mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  }
+  void* sqes = mmap(
+    NULL,
+    params.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE,
+    ring.fd,
+    IORING_OFF_SQES
+  );
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    println(WARN "Failed to map io_uring, falling back to syscalls: ", get_error(), '.');
+    assert(close(ring.fd) == 0);
+    return;
+  }
+
+  ring.sq_head  = (U32*) &sq[params.sq_off.head];
+  ring.sq_tail  = (U32*) &sq[params.sq_off.tail];
+  ring.sq_mask  = (U32*) &sq[params.sq_off.ring_mask];
+  ring.sq_array = (U32*) &sq[params.sq_off.array];
+  ring.cq_head  = (U32*) &cq[params.cq_off.head];
+  ring.cq_tail  = (U32*) &cq[params.cq_off.tail];
+  ring.cq_mask  = (U32*) &cq[params.cq_off.ring_mask];
+  ring.cqes     = (struct io_uring_cqe*) &cq[params.cq_off.cqes];
+  ring.sqes     = (struct io_uring_sqe*) sqes;
+
+  struct iovec buffers[RING_BUFFER_COUNT] = {};
+  for (I64 i = 0; i < RING_BUFFER_COUNT; i++) {
+    ring.buffers[i] = allocate_bytes(arena, RING_BUFFER_SIZE, 4096);
+    buffers[i]      = to_iovec(ring.buffers[i]);
+  }
+  if (ring_register(IORING_REGISTER_BUFFERS, buffers, RING_BUFFER_COUNT) == -1) {
+    println(WARN "Failed to register io_uring buffers, falling back to syscalls: ", get_error(), '.');
+    assert(close(ring.fd) == 0);
+    return;
+  }
+
+  ring.enabled = true;
+  println(INFO "Using io_uring with ", (I64) ring.entries, " entries.");
+}
+
+#else
+
+static void setup_ring(Arena* arena) {
+  println(WARN "io_uring is only available on Linux, falling back to syscalls.");
+}
+
+#endif
+
+#ifdef __linux__
+
+static void post_accept(I32 listen_fd) {
+  struct io_uring_sqe sqe  = {};
+  sqe.opcode               = IORING_OP_ACCEPT;
+  sqe.fd                   = listen_fd;
+  sqe.addr                 = (U64) &ring.accept_address;
+  sqe.addr2                = (U64) &ring.accept_address_size;
+  sqe.user_data            = RING_ACCEPT;
+  ring.accept_address_size = sizeof(ring.accept_address);
+  ring.accept_posted       = true;
+  queue(&sqe);
+}
+
+#endif
+
+static I32 io_accept(I32 listen_fd, struct sockaddr_in* address) {
+#ifdef __linux__
+  if (ring.enabled) {
+    if (!ring.accept_posted) {
+      post_accept(listen_fd);
+    }
+
+    I32 result         = wait_for(RING_ACCEPT);
+    *address           = ring.accept_address;
+    ring.accept_posted = false;
+    if (result < 0) {
+      errno = -result;
+      return -1;
+    }
+
+    // Keep the next accept in flight while this connection is served, it gets
+    // submitted together with the recv.
+    post_accept(listen_fd);
+    return result;
+  }
+#endif
+  return accept(listen_fd, address);
+}
+
+static I64 io_recv(I32 fd, U8* buffer, I64 size) {
+#ifdef __linux__
+  if (ring.enabled) {
+    struct io_uring_sqe sqe = {};
+    sqe.opcode              = IORING_OP_RECV;
+    sqe.fd                  = fd;
+    sqe.addr                = (U64) buffer;
+    sqe.len                 = size;
+    return run(&sqe);
+  }
+#endif
+  return read(fd, buffer, size);
+}
+
+static I64 writev_once(I32 fd, struct iovec* iovecs, I32 count) {
+#ifdef __linux__
+  if (ring.enabled) {
+    struct io_uring_sqe sqe = {};
+    sqe.opcode              = IORING_OP_WRITEV;
+    sqe.fd                  = fd;
+    sqe.addr                = (U64) iovecs;
+    sqe.len                 = count;
+    return run(&sqe);
+  }
+#endif
+  return writev(fd, iovecs, count);
+}
+
+// Writes every iovec, picking up after short writes, and returns the total or
+// -1. The iovecs are advanced past whatever was written.
+static I64 io_writev(I32 fd, struct iovec* iovecs, I32 count) {
+  I64 total = 0;
+  while (true) {
+    while (count > 0 && iovecs->iov_len == 0) {
+      iovecs++;
+      count--;
+    }
+    if (count == 0) {
+      return total;
+    }
+
+    I64 bytes_written = writev_once(fd, iovecs, count);
+    if (bytes_written == -1) {
+      return -1;
+    }
+    total += bytes_written;
+    while (count > 0 && (U64) bytes_written >= iovecs->iov_len) {
+      bytes_written -= iovecs->iov_len;
+      iovecs++;
+      count--;
+    }
+    if (count > 0) {
+      iovecs->iov_base  = (U8*) iovecs->iov_base + bytes_written;
+      iovecs->iov_len  -= bytes_written;
+    }
+  }
+}
+
+static I64 io_write(I32 fd, String data) {
+  struct iovec iovec = to_iovec(data);
+  return io_writev(fd, &iovec, 1);
+}
+
+// The close is only queued, it gets submitted together with the next accept.
+static I32 io_close(I32 fd) {
+#ifdef __linux__
+  if (ring.enabled) {
+    struct io_uring_sqe sqe = {};
+    sqe.opcode              = IORING_OP_CLOSE;
+    sqe.fd                  = fd;
+    sqe.user_data           = RING_DISCARD;
+    queue(&sqe);
+    return 0;
+  }
+#endif
+  return close(fd);
+}
+
+// Reads a file in order through the registered buffers, keeping every buffer
+// in flight as a fixed-file READ_FIXED. Only used while the ring is enabled.
+struct BlockReader {
+  I32 fd;
+  I64 size;
+  I64 submitted;
+  I64 returned;
+};
+
+#ifdef __linux__
+
+static void submit_block(BlockReader* reader) {
+  I64 block  = reader->submitted;
+  I64 offset = block * RING_BUFFER_SIZE;
+  if (offset >= reader->size) {
+    return;
+  }
+
+  I64                 slot = block % RING_BUFFER_COUNT;
+  struct io_uring_sqe sqe  = {};
+  sqe.opcode               = IORING_OP_READ_FIXED;
+  sqe.flags                = IOSQE_FIXED_FILE;
+  sqe.fd                   = 0;
+  sqe.addr                 = (U64) ring.buffers[slot].data;
+  sqe.len                  = min(reader->size - offset, (I64) RING_BUFFER_SIZE);
+  sqe.off                  = offset;
+  sqe.buf_index            = slot;
+  sqe.user_data            = RING_READ + slot;
+  queue(&sqe);
+  reader->submitted++;
+}
+
+static bool open_blocks(BlockReader* reader, const char* path) {
+  *reader    = {};
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd == -1) {
+    println(ERROR "Failed to open \"", path, "\": ", get_error(), '.');
+    return false;
+  }
+
+  struct stat info = {};
+  assert(fstat(reader->fd, &info) == 0);
+  reader->size = info.st_size;
+
+  if (ring_register(IORING_REGISTER_FILES, &reader->fd, 1) == -1) {
+    println(WARN "Failed to register \"", path, "\" with io_uring: ", get_error(), '.');
+    assert(close(reader->fd) == 0);
+    return false;
+  }
+
+  for (I64 i = 0; i < RING_BUFFER_COUNT; i++) {
+    submit_block(reader);
+  }
+  return true;
+}
+
+// The block stays valid until the next call, and is empty at the end of the
+// file. Returns false if it could not be read.
+static bool next_block(BlockReader* reader, String* block) {
+  I64 offset = reader->returned * RING_BUFFER_SIZE;
+  if (offset >= reader->size) {
+    *block = {};
+    return true;
+  }
+
+  if (reader->returned > 0) {
+    submit_block(reader);
+  }
+
+  I64 slot     = reader->returned % RING_BUFFER_COUNT;
+  I64 expected = min(reader->size - offset, (I64) RING_BUFFER_SIZE);
+  I64 result   = wait_for(RING_READ + slot);
+  reader->returned++;
+  if (result < 0) {
+    println(ERROR "Failed to read block at ", offset, ": ", strerror(-result), '.');
+    return false;
+  }
+
+  *block = prefix(ring.buffers[slot], expected);
+  while (result < expected) {
+    I64 bytes_read = pread(reader->fd, &(*block)[result], expected - result, offset + result);
+    if (bytes_read <= 0) {
+      println(ERROR "Failed to read block at ", offset, ": ", bytes_read == 0 ? "unexpected end of file" : get_error(), '.');
+      return false;
+    }
+    result += bytes_read;
+  }
+  return true;
+}
+
+static void close_blocks(BlockReader* reader) {
+  while (reader->returned < reader->submitted) {
+    wait_for(RING_READ + reader->returned % RING_BUFFER_COUNT);
+    reader->returned++;
+  }
+  if (ring_register(IORING_UNREGISTER_FILES, NULL, 0) == -1) {
+    println(WARN "Failed to unregister file from io_uring: ", get_error(), '.');
+  }
+  assert(close(reader->fd) == 0);
+}
+
+#endif
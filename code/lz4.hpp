@@ -0,0 +1,158 @@
+// A small codec for the LZ4 block format. The compressor is a greedy
+// single-probe matcher, which is plenty for log text, and the decompressor
+// bounds checks everything so a corrupt block is reported instead of crashing.
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_HASH_BITS     12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT   12
+#define LZ4_MAX_OFFSET    65535
+
+static I64 lz4_bound(I64 size) {
+  return size + size / 255 + 16;
+}
+
+static U32 lz4_hash(U32 sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static U8* lz4_write_length(U8* output, I64 length) {
+  while (length >= 255) {
+    *output = 255;
+    output++;
+    length -= 255;
+  }
+  *output = length;
+  return output + 1;
+}
+
+static U8* lz4_write_literals(U8* output, U8* token, String literals) {
+  *token |= min(literals.size, (I64) 15) << 4;
+  if (literals.size >= 15) {
+    output = lz4_write_length(output, literals.size - 15);
+  }
+  memcpy(output, literals.data, literals.size);
+  return output + literals.size;
+}
+
+// Output must have room for lz4_bound(input.size) bytes.
+static I64 lz4_compress(String input, U8* output) {
+  I32 table[1 << LZ4_HASH_BITS];
+  memset(table, 0xFF, sizeof(table));
+
+  U8* out    = output;
+  I64 anchor = 0;
+  I64 i      = 0;
+  while (i < input.size - LZ4_MATCH_LIMIT) {
+    U32 sequence = 0;
+    memcpy(&sequence, &input[i], sizeof(sequence));
+
+    U32 hash      = lz4_hash(sequence);
+    I64 candidate = table[hash];
+    table[hash]   = i;
+
+    if (candidate < 0 || i - candidate > LZ4_MAX_OFFSET || memcmp(&input[candidate], &input[i], LZ4_MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+
+    I64 match_end   = i + LZ4_MIN_MATCH;
+    I64 match_limit = input.size - LZ4_LAST_LITERALS;
+    while (match_end < match_limit && input[match_end] == input[match_end - i + candidate]) {
+      match_end++;
+    }
+    while (i > anchor && candidate > 0 && input[i - 1] == input[candidate - 1]) {
+      i--;
+      candidate--;
+    }
+
+    U8* token = out;
+    *token    = 0;
+    out       = lz4_write_literals(out + 1, token, slice(input, anchor, i));
+
+    I64 offset = i - candidate;
+    out[0]     = offset & 0xFF;
+    out[1]     = offset >> 8;
+    out       += 2;
+
+    I64 match_length = match_end - i - LZ4_MIN_MATCH;
+    *token          |= min(match_length, (I64) 15);
+    if (match_length >= 15) {
+      out = lz4_write_length(out, match_length - 15);
+    }
+
+    i      = match_end;
+    anchor = i;
+  }
+
+  U8* token = out;
+  *token    = 0;
+  out       = lz4_write_literals(out + 1, token, suffix(input, anchor));
+  return out - output;
+}
+
+static bool lz4_read_length(String input, I64* i, I64* length) {
+  U8 byte = 255;
+  while (byte == 255) {
+    if (*i >= input.size) {
+      return false;
+    }
+    byte     = input[*i];
+    *length += byte;
+    *i      += 1;
+  }
+  return true;
+}
+
+// Returns the number of bytes written to output, or -1 if input is malformed.
+static I64 lz4_decompress(String input, String output) {
+  I64 i = 0;
+  I64 o = 0;
+  while (i < input.size) {
+    U8  token          = input[i++];
+    I64 literal_length = token >> 4;
+    if (literal_length == 15 && !lz4_read_length(input, &i, &literal_length)) {
+      return -1;
+    }
+    if (i + literal_length > input.size || o + literal_length > output.size) {
+      return -1;
+    }
+    memcpy(&output[o], &input[i], literal_length);
+    i += literal_length;
+    o += literal_length;
+
+    if (i == input.size) {
+      break;
+    }
+    if (i + 2 > input.size) {
+      return -1;
+    }
+
+    I64 offset = input[i] | (input[i + 1] << 8);
+    i         += 2;
+    if (offset == 0 || offset > o) {
+      return -1;
+    }
+
+    I64 match_length = token & 0xF;
+    if (match_length == 15 && !lz4_read_length(input, &i, &match_length)) {
+      return -1;
+    }
+    match_length += LZ4_MIN_MATCH;
+    if (o + match_length > output.size) {
+      return -1;
+    }
+
+    U8* from = &output[o - offset];
+    U8* to   = &output[o];
+    if (offset >= match_length) {
+      memcpy(to, from, match_length);
+    } else {
+      for (I64 k = 0; k < match_length; k++) {
+	to[k] = from[k];
+      }
+    }
+    o += match_length;
+  }
+  return o;
+}
@@ -3,6 +3,13 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -13,609 +20,393 @@
 #include <unistd.h>
 
 #ifdef __linux__
-#include <sys/sendfile.h>
+#include <linux/io_uring.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #endif
 
 #include "prelude.hpp"
 #include "print.hpp"
 #include "arena.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+#include "mapping.hpp"
+#include "trace.hpp"
+#include "lz4.hpp"
+#include "deflate.hpp"
+#include "chunks.hpp"
+#include "blocks.hpp"
+#include "bloom.hpp"
+#include "dictionary.hpp"
+#include "tokenizer.hpp"
+#include "template.hpp"
+#include "segment.hpp"
+#include "index.hpp"
+#include "compact.hpp"
+#include "background.hpp"
+#include "top.hpp"
+#include "query.hpp"
+#include "export.hpp"
+#include "coordinator.hpp"
+#include "assets.hpp"
 
 #define RESPONSE_400 "HTTP/1.1 400\r\nContent-Length: 0\r\n\r\n"
 #define RESPONSE_404 "HTTP/1.1 404\r\nContent-Length: 0\r\n\r\n"
-
-static I32 bind(I32 fd, struct sockaddr_in address) {
-  return bind(fd, (struct sockaddr*) &address, sizeof(address));
-}
-
-static I32 accept(I32 fd, struct sockaddr_in* address) {
-  socklen_t address_size = sizeof(*address);
-  return accept(fd, (struct sockaddr*) address, &address_size);
-}
-
-static struct iovec to_iovec(String s) {
-  return (struct iovec) { .iov_base = s.data, .iov_len = (U64) s.size };
-}
-
-static struct iovec to_iovec(I32* n) {
-  return (struct iovec) { .iov_base = n, .iov_len = sizeof(I32) };
-}
-
-static void write_response(I32 connection_fd, String response) {
-  I64 bytes_written = write(connection_fd, response.data, response.size);
-  if (bytes_written == -1) {
-    println(ERROR "Failed to write to connection: ", get_error(), '.');
-  } else if (bytes_written < response.size) {
-    println(WARN "Wrote less bytes than expected.");
-  }
-}
-
-static String read_file(const char* path) {
-  I32 fd = open(path, O_RDONLY);
-  if (fd == -1) {
-    println(ERROR "Failed to open \"", path, "\": ", get_error(), '.');
-    exit(EXIT_FAILURE);
-  }
-
-  struct stat info = {};
-  if (fstat(fd, &info) == -1) {
-    println(ERROR "Failed to stat \"", path, "\": ", get_error(), '.');
-    exit(EXIT_FAILURE);
-  }
-
-  String result = {};
-  result.size   = info.st_size;
-  result.data   = (U8*) mmap(NULL, result.size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (result.data == MAP_FAILED) {
-    println(ERROR "Failed to mmap \"", path, "\": ", get_error(), '.');
-    exit(EXIT_FAILURE);
-  }
-
-  assert(close(fd) == 0);
-  return result;
-}
-
-static void close_file(String text) {
-  assert(munmap(text.data, text.size) == 0);
-}
-
-struct Parameters {
-  String query;
-  String start;
-  String end;
-  I32    page;
-};
-
-static void parse_parameter(String* input, Parameters* parameters) {
-  I64    ampersand = find(*input, '&');
-  String pair      = prefix(*input, ampersand);
-  *input           = suffix(*input, ampersand + 1);
-  
-  I64    equals    = find(pair, '=');
-  String key       = prefix(pair, equals);
-  String value     = suffix(pair, equals + 1);
-  
-  for (I64 i = 0; i < value.size; i++) {
-    I64    escape = find(value, '%', i);
-    String digits = slice(value, escape + 1, escape + 3);
-    if (digits.size == 2) {
-      U8 first  = to_lower(digits[0]);
-      U8 second = to_lower(digits[1]);
-      if (is_hex(first) && is_hex(second)) {
-	value[escape] = (from_hex(first) << 4) + from_hex(second);
-	String rest   = suffix(value, escape + 3);
-	if (rest.size > 0) {
-	  memmove(&value[escape + 1], rest.data, rest.size);
-	  value.size -= 2;
-	}
-      }
-    }
-    i = escape;
-  }
-  
-  if (key == "query") {
-    parameters->query = value;
-  }
-  if (key == "start") {
-    parameters->start = value;
-  }
-  if (key == "end") {
-    parameters->end = value;
-  }
-  if (key == "page") {
-    I32 page = 0;
-    for (I64 i = 0; i < value.size; i++) {
-      if (!is_digit(value[i])) {
-	page = 0;
-	break;
+#define RESPONSE_503 "HTTP/1.1 503\r\nContent-Length: 0\r\n\r\n"
+
+static void write_stats(Arena* arena, I32 connection_fd, Snapshot* snapshot) {
+  I64    saved = save(arena);
+  String body  = allocate_bytes(arena, 0, 1);
+
+  append_counter(arena, "indexer_requests_total", "HTTP requests served.", stats.requests);
+  append_counter(arena, "indexer_queries_total", "Queries run.", stats.queries);
+  append_counter(arena, "indexer_queries_timed_out_total", "Queries cut short by their deadline.", stats.queries_timed_out);
+  append_counter(arena, "indexer_queries_disconnected_total", "Queries cancelled because the client went away.", stats.queries_disconnected);
+  append_counter(arena, "indexer_bloom_negatives_total", "Lookups ruled out by an index's Bloom filter.", stats.bloom_negatives);
+  append_counter(arena, "indexer_shard_failures_total", "Shards a coordinator gave up on.", stats.shard_failures);
+  append_counter(arena, "indexer_bytes_streamed_total", "Bytes written to connections.", stats.bytes_streamed);
+  append_counter(arena, "indexer_files_indexed_total", "Log files indexed.", stats.files_indexed);
+  append_counter(arena, "indexer_exports_total", "Exports run.", stats.exports);
+  append_counter(arena, "indexer_lines_exported_total", "Lines written by exports.", stats.lines_exported);
+  append_counter(arena, "indexer_block_cache_hits_total", "Decompressed block cache hits.", block_cache.hits);
+  append_counter(arena, "indexer_block_cache_misses_total", "Decompressed block cache misses.", block_cache.misses);
+  append_gauge(arena, "indexer_exports_running", "Exports streaming right now.", exports_running);
+  append_gauge(arena, "indexer_files_pending", "Log files not indexed yet.", snapshot->file_count - snapshot->files_indexed);
+  append_gauge(arena, "indexer_arena_committed_bytes", "Bytes committed by all arenas.", arena_committed);
+  append_gauge(arena, "indexer_arena_committed_peak_bytes", "Peak bytes committed by all arenas.", arena_committed_peak);
+
+  pthread_mutex_lock(&dictionary.lock);
+  append_gauge(arena, "indexer_dictionary_terms", "Distinct terms in the shared dictionary.", dictionary.term_count);
+  append_gauge(arena, "indexer_dictionary_word_bytes", "Bytes of the words in the shared dictionary.", dictionary.word_bytes);
+  pthread_mutex_unlock(&dictionary.lock);
+
+  append_metric(arena, "indexer_index_build_duration_seconds", "histogram", "Time taken to index a file.");
+  append_histogram(arena, "indexer_index_build_duration_seconds", "", &stats.build_latency);
+  append_metric(arena, "indexer_query_duration_seconds", "histogram", "Time taken to answer a query.");
+  append_histogram(arena, "indexer_query_duration_seconds", "", &stats.query_latency);
+
+  append_metric(arena, "indexer_query_phase_duration_seconds", "histogram", "Time spent in each query phase.");
+  for (I64 i = 0; i < PHASE_COUNT; i++) {
+    char labels[64] = {};
+    snprintf(labels, sizeof(labels), "phase=\"%s\"", phase_names[i]);
+    append_histogram(arena, "indexer_query_phase_duration_seconds", labels, &stats.phase_latency[i]);
+  }
+
+  struct {
+    const char* name;
+    const char* help;
+  } index_metrics[] = {
+    { "indexer_index_build_seconds", "Time taken to index each file." },
+    { "indexer_index_terms",         "Distinct terms in each index." },
+    { "indexer_index_posting_bytes", "Bytes of postings in each index." },
+    { "indexer_index_arena_bytes",   "Arena bytes used by each index." },
+    { "indexer_index_files",         "Log files covered by each index." },
+    { "indexer_index_templates",     "Templates mined from each index." },
+  };
+  for (I64 i = 0; i < (I64) length(index_metrics); i++) {
+    append_metric(arena, index_metrics[i].name, "gauge", index_metrics[i].help);
+    for (I32 j = 0; j < snapshot->index_count; j++) {
+      Index* index = snapshot->indexes[j];
+      append(arena, index_metrics[i].name, "{file=\"");
+      append_label(arena, index->mapping->path);
+      append(arena, "\"} ");
+      IndexStats* index_stats = &index->stats;
+      if (i == 0) {
+	append_seconds(arena, index_stats->build_nanoseconds);
+      } else if (i == 1) {
+	append(arena, index_stats->terms);
+      } else if (i == 2) {
+	append(arena, index_stats->postings * (I64) sizeof(I64));
+      } else if (i == 3) {
+	append(arena, index_stats->arena_bytes);
+      } else if (i == 4) {
+	append(arena, (I64) (index->part_count > 0 ? index->part_count : 1));
+      } else {
+	append(arena, index->template_count);
       }
-      page = 10 * page + value[i] - '0';
+      append(arena, "\n");
     }
-    parameters->page = page;
-  }
-}
-
-static Parameters parse_parameters(String input) {
-  Parameters parameters = {};
-  while (input.size > 0) {
-    parse_parameter(&input, &parameters);
   }
-  return parameters;
-}
-
-struct Offset {
-  I64     value;
-  Offset* next;
-};
 
-static Offset* make_offset(Arena* arena, I64 value) {
-  Offset* offset = allocate<Offset>(arena);
-  offset->value  = value;
-  return offset;
-}
+  body.size = save(arena) - saved;
 
-struct Node {
-  U32     is_black;
-  String  word;
-  Offset* first_offset;
-  Offset* last_offset;
-  Node*   children[2];
-};
+  U8     storage[20]    = {};
+  String content_length = to_string(body.size, storage);
 
-static void print_tree(Node* node, I64 indents) {
-  for (I64 i = 0; i < indents; i++) {
-    print(' ');
-  }
-
-  if (node == nullptr) {
-    println("nil");
+  struct iovec headers[] = {
+    to_iovec("HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "),
+    to_iovec(content_length),
+    to_iovec("\r\n\r\n"),
+    to_iovec(body),
+  };
+  I64 bytes_written = io_writev(connection_fd, headers, length(headers));
+  if (bytes_written == -1) {
+    println(ERROR "Failed to write to connection: ", get_error(), '.');
   } else {
-    String color = node->is_black == 0 ? "\x1b[31m" : "\x1b[30m\x1b[47m";
-    String clear = "\x1b[0m";
-    println(color, node->word, clear);
-  
-    for (I64 i = 0; i < length(node->children); i++) {
-      print_tree(node->children[i], indents + 1);
-    }
+    add(&stats.bytes_streamed, bytes_written);
   }
-}
-
-struct CheckResult {
-  I64 depth;
-  I64 count;
-};
 
-static CheckResult check_node(Node* node) {
-  if (node == nullptr) {
-    return (CheckResult) {};
-  }
-  
-  assert(node->word.size > 0);
-
-  I64 max_depth = 0;
-  I64 min_depth = 0;
-  I64 count     = 0;
-  for (I64 i = 0; i < length(node->children); i++) {
-    Node* child = node->children[i];
-    if (child != nullptr) {
-      I32  comparison = compare(node->word, child->word);
-      if (i == 0) {
-	assert(comparison > 0);
-      }
-      if (i == 1) {
-	assert(comparison < 0);
-      }
-    }
-    
-    CheckResult result = check_node(child);
-    if (result.depth > max_depth) {
-      max_depth = result.depth;
-    }
-    if (min_depth == 0 || result.depth < min_depth) {
-      min_depth = result.depth;
-    }
-    count += result.count;
-  }
-
-  CheckResult result = {};
-  result.depth       = max_depth + 1;
-  result.count       = count + 1;
-  return result;
-}
-
-static Node* make_node(Arena* arena, String word, I64 offset) {
-  Node* node         = allocate<Node>(arena);
-  node->word         = word;
-  node->first_offset = make_offset(arena, offset);
-  node->last_offset  = node->first_offset;
-  return node;
+  restore(arena, saved);
 }
 
-static Node* balance(Node* grandparent) {
-  if (grandparent->is_black) {
-    for (I64 parent_direction = 0; parent_direction < 2; parent_direction++) {
-      Node* parent = grandparent->children[parent_direction];
-      if (parent != nullptr && !parent->is_black) {
-	Node* child = parent->children[parent_direction];
-	if (child != nullptr && !child->is_black) {
-	  child->is_black                         = true;
-	  grandparent->children[parent_direction] = parent->children[1 - parent_direction];
-	  parent->children[1 - parent_direction]  = grandparent;
-	  return parent;
-	}
-	Node* brother = parent->children[1 - parent_direction];
-	if (brother != nullptr && !brother->is_black) {
-	  parent->is_black                        = true;
-	  parent->children[1 - parent_direction]  = brother->children[parent_direction];
-	  grandparent->children[parent_direction] = brother->children[1 - parent_direction];
-	  brother->children[parent_direction]     = parent;
-	  brother->children[1 - parent_direction] = grandparent;
-	  return brother;
-	}
-      }
-    }
-  }
-  return grandparent;
-}
+struct TemplateCount {
+  String text;
+  I64    line_count;
+};
 
-static Node* insert(Arena* node_arena, Arena* word_arena, Node* node, String word, I64 offset) {
-  if (node == nullptr) {
-    String new_word = allocate_bytes(word_arena, word.size, 1);
-    memcpy(new_word.data, word.data, word.size);
-    return make_node(node_arena, new_word, offset);
-  }
-  I32 comparison = compare(word, node->word);
-  if (comparison < 0) {
-    node->children[0] = insert(node_arena, word_arena, node->children[0], word, offset);
-  } else if (comparison > 0) {
-    node->children[1] = insert(node_arena, word_arena, node->children[1], word, offset);
-  } else if (comparison == 0) {
-    Offset* last      = node->last_offset;
-    last->next        = make_offset(node_arena, offset);
-    node->last_offset = last->next;
-  }
-  return balance(node);
+static I32 compare_template_texts(const void* a, const void* b) {
+  return compare(((TemplateCount*) a)->text, ((TemplateCount*) b)->text);
 }
 
-static Offset* lookup(Node* node, String word) {
-  if (node == nullptr) {
-    return 0;
-  }
-  I32 comparison = compare(word, node->word);
-  if (comparison < 0) {
-    return lookup(node->children[0], word);
-  } else if (comparison > 0) {
-    return lookup(node->children[1], word);
-  } else {
-    return node->first_offset;
+static I32 compare_template_counts(const void* a, const void* b) {
+  TemplateCount* left  = (TemplateCount*) a;
+  TemplateCount* right = (TemplateCount*) b;
+  if (left->line_count != right->line_count) {
+    return left->line_count > right->line_count ? -1 : 1;
   }
+  return compare(left->text, right->text);
 }
 
-static Node* index_logs(Arena* node_arena, Arena* word_arena, String logs, Node* node_root) {
-  I64 line_start = 0;
-  for (I64 i = 0; i <= logs.size; i++) {
-    if (i == logs.size || logs[i] == '\n') {
-      if (line_start != i) {
-	String line       = slice(logs, line_start, i);
-	I64    word_start = 0;
-	I64    last_qoute = -1;
-	for (I64 j = 0; j <= line.size; j++) {
-	  if (j == line.size || line[j] == ' ') {
-	    if (word_start != j) {
-	      String word         = slice(line, word_start, j);
-	      node_root           = insert(node_arena, word_arena, node_root, word, line_start);
-	      node_root->is_black = true;
-	    }
-	    word_start = j + 1;
-	  }
-	  if (j < line.size && line[j] == '"') {
-	    if (last_qoute == -1) {
-	      last_qoute = j;
-	    } else {
-	      String qouted_word = slice(line, last_qoute + 1, j);
-	      if (qouted_word.size > 0) {
-		node_root           = insert(node_arena, word_arena, node_root, qouted_word, line_start);
-		node_root->is_black = true;
-	      }
-	      last_qoute = -1;
-	    }
-	  }
-	}
+// Every template mined from the logs with the number of lines it covers, most
+// common first. Files mine their templates separately, so the same one shows
+// up once per file and is added up here.
+static void write_templates(Arena* arena, Arena* scratch_arena, I32 connection_fd, Snapshot* snapshot) {
+  I64 saved_scratch  = save(scratch_arena);
+  I64 template_count = 0;
+  for (I32 i = 0; i < snapshot->index_count; i++) {
+    template_count += snapshot->indexes[i]->template_count;
+  }
+
+  TemplateCount* counts = allocate_array<TemplateCount>(scratch_arena, template_count);
+  I64            used   = 0;
+  for (I32 k = 0; k < snapshot->index_count; k++) {
+    Index* index = snapshot->indexes[k];
+    for (I64 i = 0; i < index->template_count; i++) {
+      Template* line_template = index->templates[i];
+      I64       text_start    = save(scratch_arena);
+      String    text          = allocate_bytes(scratch_arena, 0, 1);
+      for (I32 j = 0; j < line_template->token_count; j++) {
+	append(scratch_arena, j == 0 ? "" : " ");
+	append(scratch_arena, line_template->tokens[j].size > 0 ? line_template->tokens[j] : String("<*>"));
       }
-      line_start = i + 1;
+      text.size               = save(scratch_arena) - text_start;
+      counts[used].text       = text;
+      counts[used].line_count = line_template->line_count;
+      used++;
     }
   }
-  CheckResult result = check_node(node_root);
-  println(INFO "Built index with tree_depth=", result.depth, " node_count=", result.count, '.');
-  flush();
-  return node_root;
-}
-
-static time_t parse_time(String input, const char* format) {
-  struct tm time   = {};
-  char*     result = strptime((char*) input.data, format, &time);
-  return result == NULL ? -1 : mktime(&time);
-}
-
-struct Index {
-  String path;
-  Node*  root;
-  Index* next;
-};
 
-struct Query {
-  String value;
-  Query* child;
-  Query* next;
-};
-
-static Query* parse_query(Arena* arena, String query) {
-  Query* root    = allocate<Query>(arena);
-  Query* current = root;
-  for (I64 i = 0; i < query.size; i++) {
-    I64    word_end = find(query, ' ', i);
-    String word     = slice(query, i, word_end);
-    i               = word_end;
-
-    if (word == "OR") {
-      Query* next   = allocate<Query>(arena);
-      current->next = next;
-      current       = next;
-    } else if (word.size > 0) {
-      Query* query   = allocate<Query>(arena);
-      query->value   = word;
-      query->next    = current->child;
-      current->child = query;
+  qsort(counts, used, sizeof(TemplateCount), compare_template_texts);
+  I64 distinct = 0;
+  for (I64 i = 0; i < used; i++) {
+    if (distinct > 0 && counts[distinct - 1].text == counts[i].text) {
+      counts[distinct - 1].line_count += counts[i].line_count;
+    } else {
+      counts[distinct] = counts[i];
+      distinct++;
     }
   }
-  return root;
-}
-
-static void write_histogram(I32 connection_fd, I32 bins, I32* histogram) {
-  I32 histogram_tag = 2;
+  qsort(counts, distinct, sizeof(TemplateCount), compare_template_counts);
 
-  I64    chunk_size        = sizeof(histogram_tag) + sizeof(bins) + sizeof(I32) * bins;
-  U8     storage[16]       = {};
-  String chunk_size_string = to_hex_string(chunk_size, storage);
-
-  struct iovec headers[] = {
-    to_iovec(chunk_size_string),
-    to_iovec("\r\n"),
-    to_iovec(&histogram_tag),
-    to_iovec(&bins),
-    { .iov_base = histogram, .iov_len = sizeof(I32) * bins },
-    to_iovec("\r\n"),
-  };
-
-  I64 bytes_written = writev(connection_fd, headers, length(headers));
-  if (bytes_written == -1) {
-    println(ERROR "Failed to write to connection: ", get_error(), '.');
+  I64    saved = save(arena);
+  String body  = allocate_bytes(arena, 0, 1);
+  for (I64 i = 0; i < distinct; i++) {
+    append(arena, counts[i].line_count, " ", counts[i].text, "\n");
   }
-}
-
-static void write_logs(Arena* arena, I32 connection_fd, String logs) {
-  I64 saved = save(arena);
+  body.size = save(arena) - saved;
 
-  I32 logs_tag = 1;
-	
-  I64 padding = align(logs.size, 4) - logs.size;
-  logs.size  += padding;
-  allocate_bytes(arena, padding, 1);
-
-  I32 logs_size = logs.size;
-	  
-  I64    chunk_size        = sizeof(logs_tag) + sizeof(logs_size) + logs.size;
-  U8     storage[16]       = {};
-  String chunk_size_string = to_hex_string(chunk_size, storage);
+  U8     storage[20]    = {};
+  String content_length = to_string(body.size, storage);
 
   struct iovec headers[] = {
-    to_iovec(chunk_size_string),
-    to_iovec("\r\n"),
-    to_iovec(&logs_tag),
-    to_iovec(&logs_size),
-    to_iovec(logs),
-    to_iovec("\r\n"),
+    to_iovec("HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Length: "),
+    to_iovec(content_length),
+    to_iovec("\r\n\r\n"),
+    to_iovec(body),
   };
-
-  I64 bytes_written = writev(connection_fd, headers, length(headers));
+  I64 bytes_written = io_writev(connection_fd, headers, length(headers));
   if (bytes_written == -1) {
     println(ERROR "Failed to write to connection: ", get_error(), '.');
+  } else {
+    add(&stats.bytes_streamed, bytes_written);
   }
 
   restore(arena, saved);
+  restore(scratch_arena, saved_scratch);
 }
 
-static void run_query(
-  Arena*     query_arena,
-  char*      log_time_format,
-  I32        connection_fd,
-  Index*     index,
-  Parameters parameters,
-  Query*     query,
-  I32        bins,
-  I32*       histogram,
-  String*    result
-) {
-  const char* query_time_format = "%Y-%m-%dT%H:%M";
+I32 main(I32 argc, char** argv) {
+  atexit(flush);
+
+  // The first three grow with the data so they are chained, the word arena
+  // holding the dictionary every index shares. The query and scratch arenas
+  // are per-request and decommitted after every request. The query arena has
+  // to stay contiguous for run_query's results.
+  Arena arenas[5] = {};
+  for (I64 i = 0; i < 3; i++) {
+    arenas[i] = make_arena(1ll << 36, true);
+  }
+  arenas[3] = make_arena(1ll << 36);
+  arenas[4] = make_arena(1ll << 36);
+
+  Arena* index_arena   = &arenas[0];
+  Arena* word_arena    = &arenas[2];
+  Arena* query_arena   = &arenas[3];
+  Arena* scratch_arena = &arenas[4];
+  make_dictionary(word_arena);
   
-  time_t start_time = parse_time(parameters.start, query_time_format);
-  time_t end_time   = parse_time(parameters.end, query_time_format);
-
-  String logs = read_file((char*) index->path.data);
-
-  for (Query* or_query = query; or_query != nullptr; or_query = or_query->next) {
-    Offset* offsets    = nullptr;
-    bool    first_word = true;
-    
-    for (Query* and_query = or_query->child; and_query != nullptr; and_query = and_query->next) {
-      String  word        = and_query->value;
-      Offset* new_offsets = lookup(index->root, word);
-      if (first_word) {
-	offsets    = new_offsets;
-	first_word = false;
-      } else {
-	Offset* previous = nullptr;
-	for (Offset* i = offsets; i != nullptr; i = i->next) {
-	  bool found = false;
-	  for (Offset* j = new_offsets; j != nullptr; j = j->next) {
-	    if (i->value == j->value) {
-	      found = true;
-	      break;
-	    }
-	  }
-	  if (!found) {
-	    if (previous == nullptr) {
-	      if (offsets != nullptr) {
-		offsets = offsets->next;
-	      }
-	    } else {
-	      previous->next = previous->next->next;
-	    }
-	  } else {
-	    previous = i;
-	  }
-	}
+  Options options         = {};
+  options.query_timeout   = 10000;
+  options.spill_directory = "/tmp";
+  options.merge_factor    = 8;
+  options.port            = 2000;
+  options.index_threads   = 4;
+
+  I32 argument = 1;
+  for (; argument < argc && starts_with(argv[argument], "--"); argument++) {
+    String option = argv[argument];
+    if (option == "--io=uring") {
+      options.use_ring = true;
+    } else if (option == "--io=syscalls") {
+      options.use_ring = false;
+    } else if (starts_with(option, "--compress=")) {
+      options.compress_directory = suffix(option, strlen("--compress="));
+    } else if (starts_with(option, "--timeout=")) {
+      options.query_timeout = parse_number(suffix(option, strlen("--timeout=")));
+      if (options.query_timeout <= 0) {
+	println(ERROR "Expected a positive number of milliseconds in \"", option, "\".");
+	exit(EXIT_FAILURE);
       }
-    }
-
-    I32 page_size    = 64;
-    I32 min_offset   = page_size * parameters.page;
-    I32 max_offset   = min_offset + page_size;
-    I32 offset_count = 0;
-    I32 wrote_logs   = false;
-    
-    I64 last_histogram_write = time(NULL);
-
-    Offset* offset = offsets;
-    while (offset != nullptr) {
-      String line     = suffix(logs, offset->value);
-      I64    line_end = find(line, '\n');
-      line            = prefix(line, line_end + 1);
-
-      {
-	time_t time = -1;
-	for (I64 i = 0; time == -1 && i < line.size; i++) {
-	  time = parse_time(suffix(line, i), log_time_format);
-	}
-	if (time == -1) {
-	  print(WARN "Failed to parse time as ", log_time_format, " in this line: ", line);
-	}
-    
-	if (start_time <= time && time <= end_time) {
-	  if (min_offset <= offset_count && offset_count < max_offset) {
-	    String query_result = allocate_bytes(query_arena, line.size, 1);
-	    memcpy(query_result.data, line.data, line.size);
-	    result->size += line.size;
-	  }
-
-	  F32 value = (F32) (time - start_time) / (end_time - start_time);
-	  histogram[(I32) (bins * value)]++;
-	}
+    } else if (starts_with(option, "--memory-budget=")) {
+      options.memory_budget = parse_size(suffix(option, strlen("--memory-budget=")));
+      if (options.memory_budget < MIN_MEMORY_BUDGET) {
+	println(ERROR "The memory budget in \"", option, "\" must be at least ", (I64) (MIN_MEMORY_BUDGET >> 20), "M.");
+	exit(EXIT_FAILURE);
       }
-      
-      offset = offset->next;
-      offset_count++;
-      
-      if (offset_count == max_offset) {
-	write_histogram(connection_fd, bins, histogram);
-	write_logs(query_arena, connection_fd, *result);
-	wrote_logs = true;
+    } else if (starts_with(option, "--spill-directory=")) {
+      options.spill_directory = suffix(option, strlen("--spill-directory="));
+    } else if (starts_with(option, "--merge-factor=")) {
+      options.merge_factor = parse_number(suffix(option, strlen("--merge-factor=")));
+      if (options.merge_factor < 0 || options.merge_factor == 1) {
+	println(ERROR "Expected 0 to disable merging or a factor of at least 2 in \"", option, "\".");
+	exit(EXIT_FAILURE);
       }
-
-      I64 now = time(NULL);
-      if (now != last_histogram_write) {
-	write_histogram(connection_fd, bins, histogram);
-	last_histogram_write = now;
+    } else if (starts_with(option, "--port=")) {
+      options.port = parse_number(suffix(option, strlen("--port=")));
+      if (options.port <= 0 || options.port > 65535) {
+	println(ERROR "Expected a port number in \"", option, "\".");
+	exit(EXIT_FAILURE);
+      }
+    } else if (starts_with(option, "--shard=")) {
+      String shard        = suffix(option, strlen("--shard="));
+      I64    slash        = find(shard, '/');
+      options.shard       = parse_number(prefix(shard, slash));
+      options.shard_count = parse_number(suffix(shard, slash + 1));
+      if (options.shard < 0 || options.shard_count <= 0 || options.shard >= options.shard_count) {
+	println(ERROR "Expected --shard=INDEX/COUNT with INDEX below COUNT in \"", option, "\".");
+	exit(EXIT_FAILURE);
+      }
+    } else if (starts_with(option, "--coordinator=")) {
+      options.coordinator = suffix(option, strlen("--coordinator="));
+    } else if (starts_with(option, "--index-threads=")) {
+      options.index_threads = parse_number(suffix(option, strlen("--index-threads=")));
+      if (options.index_threads < 0) {
+	println(ERROR "Expected 0 to index before listening or a number of threads in \"", option, "\".");
+	exit(EXIT_FAILURE);
       }
+    } else if (option == "--templates") {
+      options.mine_templates = true;
+    } else if (option == "--fold-case") {
+      tokenizer.fold_case = true;
+    } else if (option == "--normalize-numbers") {
+      tokenizer.normalize_numbers = true;
+    } else if (starts_with(option, "--split=")) {
+      String characters = suffix(option, strlen("--split="));
+      if (characters.size == 0 || contains(characters, " ")) {
+	println(ERROR "Expected characters other than spaces to split words on in \"", option, "\".");
+	exit(EXIT_FAILURE);
+      }
+      for (I64 i = 0; i < characters.size; i++) {
+	tokenizer.split[characters[i]] = true;
+      }
+      tokenizer.splits = true;
+    } else if (starts_with(option, "--trace=")) {
+#ifdef TRACE
+      start_trace(argv[argument] + strlen("--trace="));
+#else
+      println(ERROR "--trace needs a build with TRACE defined.");
+      exit(EXIT_FAILURE);
+#endif
+    } else {
+      println(ERROR "Unknown option \"", option, "\".");
+      exit(EXIT_FAILURE);
     }
+  }
 
-    if (offset_count > 0 && !wrote_logs) {
-      write_logs(query_arena, connection_fd, *result);
+  I32 expected = options.coordinator.size > 0 ? 0 : 2;
+  if (argc - argument != expected) {
+    if (expected == 0) {
+      println(ERROR "A coordinator does not index anything, so it takes no arguments.");
+    } else {
+      println(ERROR "Expected exactly two arguments, the time format and the path to the log file.");
     }
+    println("Usage: indexer [--io=uring|syscalls] [--port=PORT] [--shard=INDEX/COUNT] [--compress=BLOCKS_DIRECTORY] [--timeout=MILLISECONDS] [--memory-budget=SIZE] [--spill-directory=DIRECTORY] [--merge-factor=N] [--index-threads=N] [--templates] [--fold-case] [--normalize-numbers] [--split=CHARACTERS] [--trace=TRACE_JSON] TIME_FORMAT LOGS_PATH");
+    println("       indexer [--port=PORT] [--timeout=MILLISECONDS] --coordinator=HOST:PORT[,HOST:PORT...]");
+    exit(EXIT_FAILURE);
   }
 
-  write_histogram(connection_fd, bins, histogram);
-  close_file(logs);
-}
-
-I32 main(I32 argc, char** argv) {
-  atexit(flush);
-
-  Arena arenas[3] = {};
-  for (I64 i = 0; i < length(arenas); i++) {
-    arenas[i] = make_arena(1ll << 28);
+  // The budget is shared by the threads, each of which builds one file at a
+  // time.
+  if (options.memory_budget > 0 && options.index_threads > 1) {
+    options.index_threads  = min(options.index_threads, options.memory_budget / MIN_MEMORY_BUDGET);
+    options.memory_budget /= options.index_threads;
   }
 
-  Arena* index_arena  = &arenas[0];
-  Arena* node_arena   = &arenas[1];
-  Arena* word_arena   = &arenas[2];
-  Arena* offset_arena = &arenas[0];
-  Arena* query_arena  = &arenas[1];
-  
-  if (argc != 3) {
-    println(ERROR "Expected exactly two arguments, the time format and the path to the log file.");
-    println("Usage: indexer TIME_FORMAT LOGS_PATH");
-    exit(EXIT_FAILURE);
+  if (options.use_ring) {
+    setup_ring(index_arena);
   }
 
-  char*       time_format = argv[1];
-  char*       logs_path   = argv[2];
-  struct stat info        = {};
-  if (stat(logs_path, &info)) {
-    println(ERROR "Failed to stat \"", logs_path, "\": ", get_error(), '.');
-    exit(EXIT_FAILURE);    
+  if (options.compress_directory.size > 0) {
+    if (mkdir((char*) options.compress_directory.data, 0755) == -1 && errno != EEXIST) {
+      println(ERROR "Failed to create \"", options.compress_directory, "\": ", get_error(), '.');
+      exit(EXIT_FAILURE);
+    }
   }
 
-  Index* index = nullptr;
-
-  if (S_ISREG(info.st_mode)) {
-    println(INFO "Indexing ", logs_path, '.');
-    flush();
-
-    String logs = read_file(logs_path);
-    Node*  root = index_logs(node_arena, word_arena, logs, nullptr);
-    close_file(logs);
-
-    index       = allocate<Index>(index_arena);
-    index->path = logs_path;
-    index->root = root;
+  if (options.memory_budget > 0 || options.merge_factor > 0) {
+    if (mkdir((char*) options.spill_directory.data, 0755) == -1 && errno != EEXIST) {
+      println(ERROR "Failed to create \"", options.spill_directory, "\": ", get_error(), '.');
+      exit(EXIT_FAILURE);
+    }
   }
 
-  if (S_ISDIR(info.st_mode)) {
-    DIR* dir = opendir(logs_path);
-    assert(dir != NULL);
+  block_cache.arena = index_arena;
 
-    while (true) {
-      dirent* entry = readdir(dir);
-      if (entry == NULL) {
-	break;
-      }
+  // Writing to a connection the client already closed must fail with EPIPE
+  // instead of killing the server.
+  signal(SIGPIPE, SIG_IGN);
 
-      String log_path = entry->d_name;
-      if (log_path == "." || log_path == "..") {
-	continue;
-      }
+  load_assets();
 
-      log_path = concatonate_paths(index_arena, logs_path, log_path);
-      
-      println(INFO "Indexing \"", log_path, "\".");
-      flush();
-      
-      String logs = read_file((char*) log_path.data);
-      Node*  root = index_logs(node_arena, word_arena, logs, nullptr);
-
-      Index* new_index = allocate<Index>(index_arena);
-      new_index->path  = log_path;
-      new_index->root  = root;
-      new_index->next  = index;
-      index            = new_index;
-      
-      close_file(logs);
-    }
-    
-    assert(closedir(dir) == 0);
+  char*  time_format = nullptr;
+  Shard* shards      = nullptr;
+  I32    shard_count = 0;
+  if (options.coordinator.size > 0) {
+    shards = parse_shards(index_arena, options.coordinator, &shard_count);
+    indexing.done = true;
+  } else {
+    time_format = argv[argument];
+    list_log_files(index_arena, &options, argv[argument + 1]);
+    start_indexing(index_arena, arenas, options.index_threads);
   }
   
-  I64 port = 2000;
+  decommit(scratch_arena);
+  for (I64 i = 0; i < (I64) length(arenas); i++) {
+    println(INFO "arenas[", i, "] used=", save(&arenas[i]), " committed=", committed_bytes(&arenas[i]), '.');
+  }
+
+  I64 port = options.port;
   
   I32 listen_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (listen_fd == -1) {
@@ -652,14 +443,15 @@ I32 main(I32 argc, char** argv) {
 
   while (true) {
     struct sockaddr_in client_address = {};
-    I32                connection_fd  = accept(listen_fd, &client_address);
+    I32                connection_fd  = io_accept(listen_fd, &client_address);
     if (connection_fd == -1) {
       print(ERROR "Failed to accept connection: ", get_error(), '.');
     } else {
       println(INFO "New connection from ", inet_ntoa(server_address.sin_addr), '.');
 
-      U8  buffer[4096];
-      I64 bytes_read = read(connection_fd, buffer, sizeof(buffer));
+      U8   buffer[4096];
+      I64  bytes_read = io_recv(connection_fd, buffer, sizeof(buffer));
+      bool handed_off = false;
       if (bytes_read == -1) {
 	println(ERROR "Failed to read from connection: ", get_error(), '.');
       }
@@ -670,123 +462,184 @@ I32 main(I32 argc, char** argv) {
 	println(INFO "Dumping request.");
 	print(request);
 
-	String query_prefix = "GET /api/query?";
+	String query_prefix  = "GET /api/query?";
+	String export_prefix = "GET /api/export?";
+
+	// Indexes published or merged while the request runs only show up in
+	// the next one, so a request sees the same indexes from start to end.
+	I64      request_saved = save(query_arena);
+	Snapshot snapshot      = take_snapshot(query_arena);
+
+	add(&stats.requests, 1);
 
-	if (starts_with(request, query_prefix)) {
-	  I64 saved = save(query_arena);
+	if (starts_with(request, query_prefix) && shards != nullptr) {
+	  I64 saved       = save(query_arena);
+	  I64 query_start = now_nanoseconds();
+
+	  I64 phases[PHASE_COUNT] = {};
+
+	  // Parsing decodes the parameters in place, and shards need them as sent.
+	  String rest            = suffix(request, query_prefix.size);
+	  String parameters_line = prefix(rest, find(rest, ' '));
+	  String forwarded       = allocate_bytes(query_arena, parameters_line.size, 1);
+	  memcpy(forwarded.data, parameters_line.data, parameters_line.size);
+	  Parameters parameters  = parse_parameters(parameters_line);
+	  phases[PHASE_PARSE]    = now_nanoseconds() - query_start;
+
+	  start_chunks(connection_fd, request);
+	  gather_query(query_arena, scratch_arena, connection_fd, shards, shard_count, forwarded, parameters, options.query_timeout, phases);
+
+	  add(&stats.queries, 1);
+	  record(&stats.query_latency, now_nanoseconds() - query_start);
+	  for (I64 i = 0; i < PHASE_COUNT; i++) {
+	    record(&stats.phase_latency[i], phases[i]);
+	  }
+	  restore(query_arena, saved);
+	} else if (starts_with(request, query_prefix)) {
+	  TRACE_MARK(mark);
+	  I64 saved       = save(query_arena);
+	  I64 query_start = now_nanoseconds();
 	  
+	  I64 phases[PHASE_COUNT] = {};
+
 	  String     rest            = suffix(request, query_prefix.size);
 	  String     parameters_line = prefix(rest, find(rest, ' '));
 	  Parameters parameters      = parse_parameters(parameters_line);
-	  Query*     query           = parse_query(query_arena, parameters.query);
-
-	  String header =
-	    "HTTP/1.1 200 OK\r\n"
-	    "Transfer-Encoding: chunked\r\n"
-	    "Content-Type: application/octet-stream\r\n"
-	    "\r\n";
+	  Query*     query           = parse_query(query_arena, parameters.query, parameters.exact);
+	  phases[PHASE_PARSE]        = now_nanoseconds() - query_start;
 
-	  I64 bytes_written = write(connection_fd, header.data, header.size);
-	  if (bytes_written == -1) {
-	    println(ERROR "Failed to write to connection: ", get_error(), '.');
+	  start_chunks(connection_fd, request);
+	  // A coordinator needs every shard's files to add them up.
+	  if (!snapshot.done || parameters.summary) {
+	    write_coverage(connection_fd, snapshot.files_indexed, snapshot.file_count, snapshot.bytes_indexed, snapshot.bytes_total);
 	  }
 	  
 	  I32 histogram[100] = {};
 	  I32 bins           = length(histogram);
-	  
-	  String logs = allocate_bytes(query_arena, 0, 1);
-	  for (Index* i = index; i != nullptr; i = i->next) {
-	    run_query(query_arena, time_format, connection_fd, i, parameters, query, bins, histogram, &logs);
-	  }
 
-	  String trailer = "0\r\n\r\n";
-	  bytes_written  = write(connection_fd, trailer.data, trailer.size);
-	  if (bytes_written == -1) {
-	    println(ERROR "Failed to write to connection: ", get_error(), '.');
+	  I64 timeout = options.query_timeout;
+	  if (0 < parameters.timeout && parameters.timeout < timeout) {
+	    timeout = parameters.timeout;
 	  }
 
-	  restore(query_arena, saved);
-	} else {
-	  const char* file_path    = nullptr;
-	  String      content_type = {};
-	  if (starts_with(request, "GET / ")) {
-	    file_path    = "assets/index.html";
-	    content_type = "text/html; charset=utf-8";
-	  } else if (starts_with(request, "GET /styles.css ")) {
-	    file_path    = "assets/styles.css";
-	    content_type = "text/css";
-	  } else if (starts_with(request, "GET /script.js ")) {
-	    file_path    = "assets/script.js";
-	    content_type = "text/javascript";
-	  } else if (starts_with(request, "GET /api_key.js ")) {
-	    file_path    = "assets/api_key.js";
-	    content_type = "text/javascript";
-	  } else if (starts_with(request, "GET /favicon.ico ")) {
-	    file_path    = "assets/favicon.ico";
-	    content_type = "image/ico";
+	  Cancel cancel        = {};
+	  cancel.connection_fd = connection_fd;
+	  cancel.start         = query_start;
+	  cancel.deadline      = query_start + 1000000 * timeout;
+	  
+	  I32 index_count = snapshot.index_count;
+
+	  // The approximation shares the query's deadline, and every index gets
+	  // an equal part of whatever is left of its budget.
+	  if (parameters.approximate > 0) {
+	    Approximation approximation = {};
+	    approximation.estimate      = allocate_array<F64>(query_arena, bins);
+	    approximation.variance      = allocate_array<F64>(query_arena, bins);
+
+	    Random random       = { (U64) query_start };
+	    I64    sample_end   = min(cancel.deadline, now_nanoseconds() + 1000000 * parameters.approximate);
+	    I32    indexes_left = index_count;
+	    for (I32 i = 0; i < index_count && cancel.reason == CANCEL_NONE; i++) {
+	      I64 now      = now_nanoseconds();
+	      I64 deadline = now + (sample_end - now) / indexes_left;
+	      sample_histogram(scratch_arena, time_format, snapshot.indexes[i], parameters, query, bins, &approximation, &random, deadline, phases, &cancel);
+	      indexes_left--;
+	    }
+	    if (cancel.reason != CANCEL_DISCONNECTED) {
+	      write_approximate(query_arena, connection_fd, bins, &approximation);
+	    }
 	  }
-
-	  if (file_path == nullptr) {
-	    write_response(connection_fd, RESPONSE_404);
-	    println(ERROR "Invalid file path.");
-	  } else {
-	    I32 file_fd = open(file_path, O_RDONLY);
-	    assert(file_fd != -1);
 	  
-	    struct stat info = {};
-	    assert(fstat(file_fd, &info) != -1);
-	    I64 file_size    = info.st_size;
-
-	    U8     storage[20]    = {};
-	    String content_length = to_string(file_size, storage);
+	  Top* top = nullptr;
+	  if (parameters.group.size > 0) {
+	    top = make_query_top(query_arena, parameters, query);
+	  }
 	  
-	    struct iovec headers[] = {
-	      to_iovec("HTTP/1.1 200 OK\r\nContent-Length: "),
-	      to_iovec(content_length),
-	      to_iovec("\r\nContent-Type: "),
-	      to_iovec(content_type),
-	      to_iovec("\r\n\r\n")
-	    };
-
-#ifdef __APPLE__
-	    struct sf_hdtr hdtr = {};
-	    hdtr.headers        = headers;
-	    hdtr.hdr_cnt        = length(headers);
-
-	    off_t length      = 0;
-	    I32   send_result = sendfile(file_fd, connection_fd, 0, &length, &hdtr, 0);
-	    if (send_result == -1) {
-	      println(ERROR "Failed to send file: ", get_error(), '.');
+	  // Every index adds up to a page of lines, unless a coordinator asked
+	  // for the first lines across all of them.
+	  Page  page       = make_page(query_arena, PAGE_SIZE * index_count);
+	  Page* index_page = parameters.lines > 0 ? nullptr : &page;
+	  for (I32 i = 0; i < index_count; i++) {
+	    if (cancel.reason == CANCEL_NONE) {
+	      run_query(query_arena, scratch_arena, time_format, connection_fd, snapshot.indexes[i], parameters, query, bins, histogram, index_page, top, phases, &cancel);
 	    }
-#endif
-	    
-#ifdef __linux__
-	    I64 bytes_written = writev(connection_fd, headers, length(headers));
-	    if (bytes_written == -1) {
-	      println(ERROR "Failed to write headers: ", get_error(), '.');
+	    if (cancel.reason == CANCEL_NONE) {
+	      cancel.indexes_searched++;
 	    }
+	  }
+	  if (parameters.lines > 0 && cancel.reason == CANCEL_NONE) {
+	    write_first_lines(query_arena, scratch_arena, time_format, connection_fd, snapshot.indexes, index_count, parameters, query, phases, &cancel);
+	  }
 
-	    bytes_written = sendfile(connection_fd, file_fd, 0, file_size);
-	    if (bytes_written == -1) {
-	      println(ERROR "Failed to send file: ", get_error(), '.');
-	    }
-#endif
+	  // Partial counts are still the top of what was searched. A coordinator
+	  // gets every counter, so values just short of the top on one shard
+	  // can still add up to the top across all of them.
+	  if (top != nullptr && cancel.reason != CANCEL_DISCONNECTED) {
+	    I64       saved_scratch = save(scratch_arena);
+	    TopValue* values        = top_values(scratch_arena, top);
+	    I32       count         = parameters.summary ? top->used : min(top->used, top->k);
+	    write_top(scratch_arena, connection_fd, values, count, top->total, top_floor(top));
+	    restore(scratch_arena, saved_scratch);
+	  }
+
+	  if (cancel.reason == CANCEL_DEADLINE) {
+	    println(
+	      WARN "Query ran past its ", timeout, " ms deadline after searching ", (I64) cancel.indexes_searched,
+	      " of ", (I64) index_count, " indexes and ", cancel.lines_scanned, " lines."
+	    );
+	    add(&stats.queries_timed_out, 1);
+	    write_partial(connection_fd, &cancel, index_count);
+	  } else if (cancel.reason == CANCEL_NONE && parameters.summary) {
+	    write_partial(connection_fd, &cancel, index_count);
+	  }
+
+	  if (cancel.reason == CANCEL_DISCONNECTED) {
+	    println(WARN "Client disconnected, cancelled query after ", cancel.lines_scanned, " lines.");
+	    add(&stats.queries_disconnected, 1);
+	  } else {
+	    finish_chunks(connection_fd);
+	  }
 
-	    assert(close(file_fd) == 0);
+	  add(&stats.queries, 1);
+	  record(&stats.query_latency, now_nanoseconds() - query_start);
+	  for (I64 i = 0; i < PHASE_COUNT; i++) {
+	    record(&stats.phase_latency[i], phases[i]);
 	  }
+	  TRACE_REPORT(parameters.query, mark);
+
+	  restore(query_arena, saved);
+	} else if (starts_with(request, export_prefix) && shards == nullptr) {
+	  String rest            = suffix(request, export_prefix.size);
+	  String parameters_line = prefix(rest, find(rest, ' '));
+	  if (start_export(time_format, connection_fd, parameters_line)) {
+	    handed_off = true;
+	  } else {
+	    println(WARN "Refused an export, ", (I64) MAX_EXPORTS, " are already running.");
+	    write_response(connection_fd, RESPONSE_503);
+	  }
+	} else if (starts_with(request, "GET /api/stats ")) {
+	  write_stats(query_arena, connection_fd, &snapshot);
+	} else if (starts_with(request, "GET /api/templates ")) {
+	  write_templates(query_arena, scratch_arena, connection_fd, &snapshot);
+	} else if (!serve_asset(connection_fd, request)) {
+	  write_response(connection_fd, RESPONSE_404);
+	  println(ERROR "Invalid file path.");
 	}
+	release_snapshot(&snapshot);
+	restore(query_arena, request_saved);
       }
-      if (close(connection_fd) == -1) {
+      if (!handed_off && io_close(connection_fd) == -1) {
 	println(WARN "Failed to close socket: ", get_error(), '.');
       }
     }
 
-    /* Print memory usage.
-    for (I64 i = 0; i < length(arenas); i++) {
-      println(INFO "arenas[", i, "].used=", arenas[i].used);
-    }
-    */
-    
+    decommit(query_arena);
+    decommit(scratch_arena);
+    println(
+      INFO "Memory committed=", arena_committed, " peak=", arena_committed_peak,
+      " query_peak=", query_arena->peak, '.'
+    );
+
     flush();
   }
 }
@@ -0,0 +1,157 @@
+// Log files stay mapped for the lifetime of the process. Every index holds a
+// reference to its mapping and every query takes another one while it reads
+// lines, so a rotated file keeps its old contents mapped until the last user
+// releases it.
+
+// Logs can be rotated away or become unreadable while the server runs, so
+// failing to map one is only reported.
+static bool read_file(const char* path, String* text) {
+  I32 fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    println(ERROR "Failed to open \"", path, "\": ", get_error(), '.');
+    return false;
+  }
+
+  struct stat info = {};
+  if (fstat(fd, &info) == -1) {
+    println(ERROR "Failed to stat \"", path, "\": ", get_error(), '.');
+    assert(close(fd) == 0);
+    return false;
+  }
+
+  String result = {};
+  result.size   = info.st_size;
+  result.data   = (U8*) mmap(NULL, result.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  assert(close(fd) == 0);
+  if (result.data == MAP_FAILED) {
+    println(ERROR "Failed to mmap \"", path, "\": ", get_error(), '.');
+    return false;
+  }
+
+  *text = result;
+  return true;
+}
+
+static void close_file(String text) {
+  assert(munmap(text.data, text.size) == 0);
+}
+
+// A retired mapping is unmapped by whoever takes it to no references, so the
+// retired bit lives in the reference count and both change in one step.
+#define MAPPING_RETIRED (1 << 30)
+
+struct Mapping {
+  String   path;
+  String   text;
+  dev_t    device;
+  ino_t    inode;
+  I32      references;
+  Mapping* next;
+};
+
+static Mapping*        mappings;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Mapping* acquire(Mapping* mapping) {
+  __atomic_fetch_add(&mapping->references, 1, __ATOMIC_RELAXED);
+  return mapping;
+}
+
+static bool is_retired(Mapping* mapping) {
+  return (__atomic_load_n(&mapping->references, __ATOMIC_ACQUIRE) & MAPPING_RETIRED) != 0;
+}
+
+static void release(Mapping* mapping) {
+  I32 references = __atomic_sub_fetch(&mapping->references, 1, __ATOMIC_ACQ_REL);
+  if (references == MAPPING_RETIRED && mapping->text.size > 0) {
+    close_file(mapping->text);
+    mapping->text = {};
+  }
+}
+
+static void retire(Mapping* mapping) {
+  I32 references = __atomic_fetch_or(&mapping->references, MAPPING_RETIRED, __ATOMIC_ACQ_REL);
+  if (references == 0 && mapping->text.size > 0) {
+    close_file(mapping->text);
+    mapping->text = {};
+  }
+}
+
+// Returns nullptr if the file cannot be mapped.
+static Mapping* map_file(Arena* arena, String path) {
+  struct stat info = {};
+  if (stat((char*) path.data, &info) == -1) {
+    println(ERROR "Failed to stat \"", path, "\": ", get_error(), '.');
+    return nullptr;
+  }
+
+  // Files are mapped from every indexing thread.
+  pthread_mutex_lock(&mappings_lock);
+  for (Mapping* mapping = mappings; mapping != nullptr; mapping = mapping->next) {
+    if (!is_retired(mapping) && mapping->path == path) {
+      if (mapping->device == info.st_dev && mapping->inode == info.st_ino && mapping->text.size == info.st_size) {
+	pthread_mutex_unlock(&mappings_lock);
+	return acquire(mapping);
+      }
+      println(INFO "\"", path, "\" was rotated, retiring its old mapping.");
+      retire(mapping);
+    }
+  }
+
+  String text = {};
+  if (info.st_size > 0 && !read_file((char*) path.data, &text)) {
+    pthread_mutex_unlock(&mappings_lock);
+    return nullptr;
+  }
+
+  Mapping* mapping    = allocate<Mapping>(arena);
+  mapping->path       = path;
+  mapping->text       = text;
+  mapping->device     = info.st_dev;
+  mapping->inode      = info.st_ino;
+  mapping->references = 1;
+  mapping->next       = mappings;
+  mappings            = mapping;
+  pthread_mutex_unlock(&mappings_lock);
+  return mapping;
+}
+
+static void advise(Mapping* mapping, I32 advice) {
+  if (mapping->text.size > 0 && madvise(mapping->text.data, mapping->text.size, advice) == -1) {
+    println(WARN "Failed to madvise \"", mapping->path, "\": ", get_error(), '.');
+  }
+}
+
+// Ranges closer together than this are merged into a single madvise call.
+#define PREFETCH_GAP (64 * 1024)
+
+struct Prefetch {
+  Mapping* mapping;
+  I64      start;
+  I64      end;
+  I64      calls;
+};
+
+static void flush_prefetch(Prefetch* prefetch) {
+  if (prefetch->end > prefetch->start) {
+    I64 page  = sysconf(_SC_PAGESIZE);
+    I64 start = prefetch->start & ~(page - 1);
+    madvise(&prefetch->mapping->text.data[start], prefetch->end - start, MADV_WILLNEED);
+    prefetch->calls++;
+  }
+  prefetch->start = 0;
+  prefetch->end   = 0;
+}
+
+static void prefetch_range(Prefetch* prefetch, I64 start, I64 end) {
+  end = min(end, prefetch->mapping->text.size);
+  if (prefetch->end > prefetch->start && start <= prefetch->end + PREFETCH_GAP && start >= prefetch->start) {
+    if (end > prefetch->end) {
+      prefetch->end = end;
+    }
+  } else {
+    flush_prefetch(prefetch);
+    prefetch->start = start;
+    prefetch->end   = end;
+  }
+}
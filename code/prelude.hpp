@@ -6,6 +6,7 @@ typedef unsigned char      U8;
 typedef unsigned int       U32;
 typedef unsigned long long U64;
 typedef float              F32;
+typedef double             F64;
 
 template <typename A>
 static A min(A a, A b) {
@@ -33,6 +34,23 @@ static U8 is_digit(U8 c) {
   return '0' <= c && c <= '9';
 }
 
+// Splitmix64, good enough for sampling and synthetic data.
+struct Random {
+  U64 state;
+};
+
+static U64 next(Random* random) {
+  random->state += 0x9E3779B97F4A7C15ull;
+  U64 z = random->state;
+  z     = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z     = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static I64 next_below(Random* random, I64 limit) {
+  return next(random) % limit;
+}
+
 struct String {
   U8* data;
   I64 size;
@@ -111,6 +129,38 @@ static String to_hex_string(I64 n, U8 storage[16]) {
   return String(start, end - start);
 }
 
+// Returns -1 unless input is a non-empty run of decimal digits.
+static I64 parse_number(String input) {
+  I64 result = 0;
+  for (I64 i = 0; i < input.size; i++) {
+    if (!is_digit(input[i])) {
+      return -1;
+    }
+    result = 10 * result + input[i] - '0';
+  }
+  return input.size == 0 ? -1 : result;
+}
+
+// Sizes like 512, 64K, 256M or 2G.
+static I64 parse_size(String value) {
+  I64 result = 0;
+  I64 i      = 0;
+  for (; i < value.size && is_digit(value[i]); i++) {
+    result = 10 * result + value[i] - '0';
+  }
+  if (i < value.size) {
+    U8 unit = to_lower(value[i]);
+    if (unit == 'k') {
+      result <<= 10;
+    } else if (unit == 'm') {
+      result <<= 20;
+    } else if (unit == 'g') {
+      result <<= 30;
+    }
+  }
+  return result;
+}
+
 static String suffix(String base, I64 start) {
   start      = min(start, base.size);
   base.data += start;
@@ -129,7 +179,7 @@ static String slice(String base, I64 start, I64 end) {
 
 static I64 find(String base, char c, I64 start = 0) {
   start      = min(start, base.size);
-  U8* result = (U8*) memchr(&base.data[start], c, base.size);
+  U8* result = (U8*) memchr(&base.data[start], c, base.size - start);
   return result == NULL ? base.size : (result - base.data);
 }
 
@@ -5,22 +5,35 @@
 static U8  print_buffer[4096];
 static I64 print_buffered;
 
+// Files are indexed on threads of their own, so the buffer is only touched
+// under a lock. It is recursive because a whole line is printed under it.
+#ifdef __APPLE__
+static pthread_mutex_t print_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+#else
+static pthread_mutex_t print_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#endif
+
 static void flush() {
+  pthread_mutex_lock(&print_lock);
   if (print_buffered > 0) {
     write(STDOUT_FILENO, print_buffer, print_buffered);
     print_buffered = 0;
   }
+  pthread_mutex_unlock(&print_lock);
 }
 
 static void print(char c) {
+  pthread_mutex_lock(&print_lock);
   if (print_buffered == sizeof(print_buffer)) {
     flush();
   }
   print_buffer[print_buffered] = c;
   print_buffered++;
+  pthread_mutex_unlock(&print_lock);
 }
 
 static void print(String message) {
+  pthread_mutex_lock(&print_lock);
   if (message.size > sizeof(print_buffer)) {
     flush();
     write(STDOUT_FILENO, message.data, message.size);
@@ -31,6 +44,7 @@ static void print(String message) {
     memcpy(&print_buffer[print_buffered], message.data, message.size);
     print_buffered += message.size;
   }
+  pthread_mutex_unlock(&print_lock);
 }
 
 static void print(I64 n) {
@@ -39,14 +53,18 @@ static void print(I64 n) {
 }
 
 static void print(auto first, auto second, auto... rest) {
+  pthread_mutex_lock(&print_lock);
   print(first);
   print(second);
   (print(rest), ...);
+  pthread_mutex_unlock(&print_lock);
 }
 
 static void println(auto... arguments) {
+  pthread_mutex_lock(&print_lock);
   (print(arguments), ...);
   print('\n');
+  pthread_mutex_unlock(&print_lock);
 }
 
 static String get_error() {
@@ -0,0 +1,872 @@
+struct Parameters {
+  String query;
+  String start;
+  String end;
+  I32    page;
+  I64    lines;
+  I64    timeout;
+  I64    approximate;
+  bool   summary;
+  String group;
+  I32    k;
+  bool   exact;
+};
+
+static void parse_parameter(String* input, Parameters* parameters) {
+  I64    ampersand = find(*input, '&');
+  String pair      = prefix(*input, ampersand);
+  *input           = suffix(*input, ampersand + 1);
+  
+  I64    equals    = find(pair, '=');
+  String key       = prefix(pair, equals);
+  String value     = suffix(pair, equals + 1);
+  
+  for (I64 i = 0; i < value.size; i++) {
+    I64    escape = find(value, '%', i);
+    String digits = slice(value, escape + 1, escape + 3);
+    if (digits.size == 2) {
+      U8 first  = to_lower(digits[0]);
+      U8 second = to_lower(digits[1]);
+      if (is_hex(first) && is_hex(second)) {
+	value[escape] = (from_hex(first) << 4) + from_hex(second);
+	String rest   = suffix(value, escape + 3);
+	if (rest.size > 0) {
+	  memmove(&value[escape + 1], rest.data, rest.size);
+	  value.size -= 2;
+	}
+      }
+    }
+    i = escape;
+  }
+  
+  if (key == "query") {
+    parameters->query = value;
+  }
+  if (key == "start") {
+    parameters->start = value;
+  }
+  if (key == "end") {
+    parameters->end = value;
+  }
+  if (key == "page") {
+    I64 page         = parse_number(value);
+    parameters->page = page < 0 ? 0 : page;
+  }
+  if (key == "lines") {
+    I64 lines         = parse_number(value);
+    parameters->lines = lines < 0 ? 0 : lines;
+  }
+  if (key == "timeout") {
+    parameters->timeout = parse_number(value);
+  }
+  if (key == "approximate") {
+    parameters->approximate = parse_number(value);
+  }
+  if (key == "summary") {
+    parameters->summary = value == "1";
+  }
+  if (key == "exact") {
+    parameters->exact = value == "1";
+  }
+  if (key == "group") {
+    parameters->group = value;
+  }
+  if (key == "k") {
+    I64 k         = parse_number(value);
+    parameters->k = k <= 0 ? TOP_DEFAULT_K : min(k, (I64) TOP_MAX_K);
+  }
+}
+
+static Parameters parse_parameters(String input) {
+  Parameters parameters = {};
+  parameters.k          = TOP_DEFAULT_K;
+  while (input.size > 0) {
+    parse_parameter(&input, &parameters);
+  }
+  return parameters;
+}
+
+#define CANCEL_CHECK_INTERVAL 4096
+
+enum CancelReason {
+  CANCEL_NONE,
+  CANCEL_DEADLINE,
+  CANCEL_DISCONNECTED,
+  CANCEL_SHARD_FAILED,
+};
+
+// Queries only look at the clock and the socket every CANCEL_CHECK_INTERVAL
+// postings or lines, so checking is cheap even for the broadest queries. A
+// connection_fd of -1 means there is no client to watch.
+struct Cancel {
+  I32          connection_fd;
+  I64          start;
+  I64          deadline;
+  I64          until_check;
+  CancelReason reason;
+  I64          lines_scanned;
+  I32          indexes_searched;
+};
+
+// The request has already been read, so a peer that closed or reset the
+// connection is the only way a non-blocking peek can see end of file or fail.
+static bool connection_closed(I32 connection_fd) {
+  U8  byte   = 0;
+  I64 result = recv(connection_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return result == 0 || (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static bool should_stop(Cancel* cancel) {
+  if (cancel->reason == CANCEL_NONE) {
+    cancel->until_check--;
+    if (cancel->until_check <= 0) {
+      cancel->until_check = CANCEL_CHECK_INTERVAL;
+      if (now_nanoseconds() > cancel->deadline) {
+	cancel->reason = CANCEL_DEADLINE;
+      } else if (cancel->connection_fd != -1 && connection_closed(cancel->connection_fd)) {
+	cancel->reason = CANCEL_DISCONNECTED;
+      }
+    }
+  }
+  return cancel->reason != CANCEL_NONE;
+}
+
+// A folded word is looked up both as its value and as its folded term, which
+// is the value behind FOLDED_PREFIX. Terms are their numbers in the
+// dictionary, or -1 for words no file has.
+struct Query {
+  String value;
+  String folded;
+  I32    term;
+  I32    folded_term;
+  Query* child;
+  Query* next;
+};
+
+// Words are folded like the tokenizer folds them unless the search is exact.
+// Their numbers are found here, once for every index.
+static Query* parse_query(Arena* arena, String query, bool exact) {
+  bool   folded  = folds() && !exact;
+  Query* root    = allocate<Query>(arena);
+  Query* current = root;
+  for (I64 i = 0; i < query.size; i++) {
+    I64    word_end = find(query, ' ', i);
+    String word     = slice(query, i, word_end);
+    i               = word_end;
+
+    if (word == "OR") {
+      Query* next   = allocate<Query>(arena);
+      current->next = next;
+      current       = next;
+    } else if (word.size > 0) {
+      Query* query   = allocate<Query>(arena);
+      query->value   = word;
+      query->next    = current->child;
+      current->child = query;
+
+      U8     buffer[MAX_FOLDED_SIZE];
+      String folded_word = folded ? fold_word(buffer, word) : String();
+      if (folded_word.size > 0) {
+	query->folded = allocate_bytes(arena, folded_word.size, 1);
+	memcpy(query->folded.data, folded_word.data, folded_word.size);
+	query->value  = suffix(query->folded, 1);
+      }
+      query->term        = find_term(query->value);
+      query->folded_term = query->folded.size > 0 ? find_term(query->folded) : -1;
+    }
+  }
+  return root;
+}
+
+// Terms the query asks for are on every line it matches, so they are left
+// out of the co-occurring terms.
+static Top* make_query_top(Arena* arena, Parameters parameters, Query* query) {
+  I32 word_count = 0;
+  for (Query* or_query = query; or_query != nullptr; or_query = or_query->next) {
+    for (Query* word = or_query->child; word != nullptr; word = word->next) {
+      word_count += word->folded.size > 0 ? 2 : 1;
+    }
+  }
+
+  Top* top = make_top(arena, parameters.group, parameters.k, word_count);
+  I32  i   = 0;
+  for (Query* or_query = query; or_query != nullptr; or_query = or_query->next) {
+    for (Query* word = or_query->child; word != nullptr; word = word->next) {
+      top->exclude[i] = word->value;
+      i++;
+      if (word->folded.size > 0) {
+	top->exclude[i] = word->folded;
+	i++;
+      }
+    }
+  }
+  return top;
+}
+
+static void write_histogram(I32 connection_fd, I32 bins, I32* histogram) {
+  I32 histogram_tag = 2;
+
+  struct iovec parts[] = {
+    to_iovec(&histogram_tag),
+    to_iovec(&bins),
+    { .iov_base = histogram, .iov_len = sizeof(I32) * bins },
+  };
+  write_frame(connection_fd, parts, length(parts));
+}
+
+#define PAGE_SIZE   64
+#define LEVEL_WORDS 3
+
+enum Level {
+  LEVEL_NONE,
+  LEVEL_TRACE,
+  LEVEL_DEBUG,
+  LEVEL_INFO,
+  LEVEL_WARN,
+  LEVEL_ERROR,
+  LEVEL_FATAL,
+};
+
+static const char* level_names[] = { "", "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL" };
+
+// A page of results in columns, so clients can render and sort it without
+// parsing the lines. The lines keep their newlines and are contiguous at the
+// end of the arena, so the columns are sized up front.
+struct Page {
+  I32*   times;
+  I32*   offsets;
+  I32*   lengths;
+  U8*    levels;
+  I32    count;
+  I32    capacity;
+  I64    start_time;
+  String text;
+};
+
+static Page make_page(Arena* arena, I32 capacity) {
+  Page page     = {};
+  page.capacity = capacity;
+  page.times    = allocate_array<I32>(arena, capacity);
+  page.offsets  = allocate_array<I32>(arena, capacity);
+  page.lengths  = allocate_array<I32>(arena, capacity);
+  page.levels   = allocate_array<U8>(arena, capacity);
+  page.text     = allocate_bytes(arena, 0, 1);
+  return page;
+}
+
+// The first level name among the first LEVEL_WORDS words after the time, so
+// something like a thread name in front of it does not hide it.
+static U8 line_level(String line, I64 time_end) {
+  WordIterator words = iterate_words(suffix(line, time_end));
+  String       word  = {};
+  for (I32 i = 0; i < LEVEL_WORDS && next_word(&words, &word); i++) {
+    for (U8 level = LEVEL_TRACE; level < length(level_names); level++) {
+      if (word == level_names[level]) {
+	return level;
+      }
+    }
+    if (word == "WARNING") {
+      return LEVEL_WARN;
+    }
+  }
+  return LEVEL_NONE;
+}
+
+static void add_to_page(Arena* arena, Page* page, String line, time_t time, U8 level) {
+  if (page->count == page->capacity) {
+    return;
+  }
+  String copy = allocate_bytes(arena, line.size, 1);
+  memcpy(copy.data, line.data, line.size);
+
+  I32 i            = page->count;
+  page->times[i]   = time - page->start_time;
+  page->offsets[i] = page->text.size;
+  page->lengths[i] = line.size > 0 && line[line.size - 1] == '\n' ? line.size - 1 : line.size;
+  page->levels[i]  = level;
+  page->text.size += line.size;
+  page->count++;
+}
+
+// Reads a page frame's payload back into page, pointing into the payload.
+static bool parse_page(String payload, Page* page) {
+  I32 header[4] = {};
+  if (payload.size < (I64) sizeof(header)) {
+    return false;
+  }
+  memcpy(header, payload.data, sizeof(header));
+
+  I32 count     = header[0];
+  I32 text_size = header[1];
+  I64 columns   = 3 * sizeof(I32) * (I64) count + align(count, 4);
+  if (count < 0 || text_size < 0 || payload.size < (I64) sizeof(header) + columns + text_size) {
+    return false;
+  }
+
+  U8* column       = &payload[sizeof(header)];
+  page->count      = count;
+  page->capacity   = count;
+  page->start_time = (I64) (U32) header[2] | (I64) header[3] << 32;
+  page->times      = (I32*) column;
+  page->offsets    = (I32*) (column + sizeof(I32) * count);
+  page->lengths    = (I32*) (column + 2 * sizeof(I32) * count);
+  page->levels     = column + 3 * sizeof(I32) * count;
+  page->text       = String(column + columns, text_size);
+  return true;
+}
+
+// Tag 7: the count, the size of the text and the start time split in two,
+// then the columns of times in seconds after the start, offsets and lengths
+// into the text, and levels, which are single bytes padded to 4 like the text.
+static void write_page(I32 connection_fd, Page* page) {
+  U8 padding[4] = {};
+
+  I32 page_tag   = 7;
+  I32 count      = page->count;
+  I32 header[4]  = { count, (I32) page->text.size, (I32) page->start_time, (I32) (page->start_time >> 32) };
+  I64 level_size = align(count, 4);
+  I64 text_size  = align(page->text.size, 4);
+  I32 page_size  = sizeof(header) + 3 * sizeof(I32) * count + level_size + text_size;
+
+  struct iovec parts[] = {
+    to_iovec(&page_tag),
+    to_iovec(&page_size),
+    { .iov_base = header, .iov_len = sizeof(header) },
+    { .iov_base = page->times, .iov_len = sizeof(I32) * count },
+    { .iov_base = page->offsets, .iov_len = sizeof(I32) * count },
+    { .iov_base = page->lengths, .iov_len = sizeof(I32) * count },
+    { .iov_base = page->levels, .iov_len = (U64) count },
+    { .iov_base = padding, .iov_len = (U64) (level_size - count) },
+    to_iovec(page->text),
+    { .iov_base = padding, .iov_len = (U64) (text_size - page->text.size) },
+  };
+  write_frame(connection_fd, parts, length(parts));
+}
+
+// Tells the client its results were cut short, why, and how far the query got.
+// A coordinator asks shards for this as a summary of every query, in which case
+// complete results send it with CANCEL_NONE.
+static void write_partial(I32 connection_fd, Cancel* cancel, I32 index_count) {
+  I32 partial_tag = 3;
+  I32 partial[]   = {
+    cancel->reason,
+    (I32) ((now_nanoseconds() - cancel->start) / 1000000),
+    cancel->indexes_searched,
+    index_count,
+    (I32) min(cancel->lines_scanned, (I64) INT32_MAX),
+  };
+  I32 partial_size = sizeof(partial);
+
+  struct iovec parts[] = {
+    to_iovec(&partial_tag),
+    to_iovec(&partial_size),
+    { .iov_base = partial, .iov_len = sizeof(partial) },
+  };
+  write_frame(connection_fd, parts, length(parts));
+}
+
+// Sent ahead of the results while files are still being indexed, with how many
+// of the files and of their kilobytes the results cover.
+static void write_coverage(I32 connection_fd, I32 files_indexed, I32 file_count, I64 bytes_indexed, I64 bytes_total) {
+  I32 coverage_tag = 6;
+  I32 coverage[]   = {
+    files_indexed,
+    file_count,
+    (I32) min(bytes_indexed >> 10, (I64) INT32_MAX),
+    (I32) min(bytes_total >> 10, (I64) INT32_MAX),
+  };
+  I32 coverage_size = sizeof(coverage);
+
+  struct iovec parts[] = {
+    to_iovec(&coverage_tag),
+    to_iovec(&coverage_size),
+    { .iov_base = coverage, .iov_len = sizeof(coverage) },
+  };
+  write_frame(connection_fd, parts, length(parts));
+}
+
+// The first posting at or after from that is not below value. It steps out in
+// doubling strides and then bisects the last one, so skipping ahead n postings
+// takes O(log n) comparisons.
+static I64 gallop(Postings postings, I64 from, I64 value) {
+  I64 step = 1;
+  I64 low  = from;
+  I64 high = from;
+  while (high < postings.count && postings.values[high] < value) {
+    low   = high + 1;
+    high += step;
+    step *= 2;
+  }
+  high = min(high, postings.count);
+  while (low < high) {
+    I64 middle = low + (high - low) / 2;
+    if (postings.values[middle] < value) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Postings are sorted by location, so every posting of the shorter list is
+// searched for in the rest of the longer one, which skips most of the longer
+// one when the two differ a lot in size. A line shows up once in the result
+// however many times it has either word. The result is a new list in arena,
+// the postings in the index stay untouched.
+static Postings intersect(Arena* arena, Postings a, Postings b, Cancel* cancel) {
+  if (b.count < a.count) {
+    Postings swapped = a;
+    a                = b;
+    b                = swapped;
+  }
+
+  Postings result = {};
+  I64      j      = 0;
+  for (I64 i = 0; i < a.count && j < b.count; i++) {
+    if (should_stop(cancel)) {
+      return {};
+    }
+    I64 value = a.values[i];
+    if (result.count > 0 && result.values[result.count - 1] == value) {
+      continue;
+    }
+    j = gallop(b, j, value);
+    if (j < b.count && b.values[j] == value) {
+      append_posting(arena, &result, value);
+    }
+  }
+  return result;
+}
+
+// Both lists in one, still sorted, with every location once.
+static Postings unite(Arena* arena, Postings a, Postings b, Cancel* cancel) {
+  Postings result = {};
+  result.values   = allocate_array<I64>(arena, a.count + b.count);
+  result.capacity = a.count + b.count;
+  I64 i = 0;
+  I64 j = 0;
+  while (i < a.count || j < b.count) {
+    if (should_stop(cancel)) {
+      return {};
+    }
+    I64 value = 0;
+    if (j == b.count || (i < a.count && a.values[i] <= b.values[j])) {
+      value = a.values[i];
+      i++;
+    } else {
+      value = b.values[j];
+      j++;
+    }
+    if (result.count == 0 || result.values[result.count - 1] != value) {
+      result.values[result.count] = value;
+      result.count++;
+    }
+  }
+  return result;
+}
+
+// A word is posted once for every time a line has it, so a line can be in its
+// postings more than once. Lists without repeats are returned as they are.
+static Postings distinct(Arena* arena, Postings postings, Cancel* cancel) {
+  I64 first_repeat = 1;
+  while (first_repeat < postings.count && postings.values[first_repeat] != postings.values[first_repeat - 1]) {
+    if (should_stop(cancel)) {
+      return {};
+    }
+    first_repeat++;
+  }
+  if (first_repeat >= postings.count) {
+    return postings;
+  }
+
+  Postings result = {};
+  result.values   = allocate_array<I64>(arena, postings.count);
+  result.capacity = postings.count;
+  memcpy(result.values, postings.values, sizeof(I64) * first_repeat);
+  result.count    = first_repeat;
+  for (I64 i = first_repeat; i < postings.count; i++) {
+    if (should_stop(cancel)) {
+      return {};
+    }
+    if (postings.values[i] != result.values[result.count - 1]) {
+      result.values[result.count] = postings.values[i];
+      result.count++;
+    }
+  }
+  return result;
+}
+
+// Unites lists in pairs, and then the results in pairs, so every posting is
+// copied once per level rather than once per list. Overwrites lists.
+static Postings unite_all(Arena* arena, Postings* lists, I64 count, Cancel* cancel) {
+  if (count == 0) {
+    return {};
+  }
+  while (count > 1) {
+    for (I64 i = 0; i < count; i += 2) {
+      if (should_stop(cancel)) {
+	return {};
+      }
+      lists[i / 2] = i + 1 < count ? unite(arena, lists[i], lists[i + 1], cancel) : lists[i];
+    }
+    count = (count + 1) / 2;
+  }
+  return lists[0];
+}
+
+// A word a template has is on all of its lines, and a word it had before it
+// became a parameter is on as many of its first lines as it had then.
+static Postings lookup_word(Arena* arena, Index* index, String word, I32 term, Cancel* cancel) {
+  Postings* lists      = allocate_array<Postings>(arena, index->template_count + 1);
+  I64       list_count = 1;
+  lists[0]             = lookup_postings(index, term);
+  for (I64 i = 0; i < index->template_count; i++) {
+    Template* line_template = index->templates[i];
+    I64       line_count    = 0;
+    for (I32 j = 0; j < line_template->token_count && line_count == 0; j++) {
+      if (line_template->tokens[j].size > 0 && has_term(line_template->tokens[j], word)) {
+	line_count = line_template->line_count;
+      }
+    }
+    for (RetiredToken* retired = line_template->retired; retired != nullptr; retired = retired->next) {
+      if (retired->line_count > line_count && has_term(retired->word, word)) {
+	line_count = retired->line_count;
+      }
+    }
+
+    if (line_count > 0) {
+      Postings lines    = lookup_postings(index, line_template->id);
+      lines.count       = min(lines.count, line_count);
+      lists[list_count] = lines;
+      list_count++;
+    }
+  }
+  return list_count == 1 ? lists[0] : unite_all(arena, lists, list_count, cancel);
+}
+
+// Every posting of the first word that all the other words of an AND query
+// also have.
+static Postings match_postings(Arena* scratch_arena, Index* index, Query* or_query, I64* phases, Cancel* cancel) {
+  // One word the filter rules out is enough to know nothing matches, without
+  // looking any of them up.
+  I64 filter_start = now_nanoseconds();
+  for (Query* and_query = or_query->child; and_query != nullptr; and_query = and_query->next) {
+    bool found = bloom_contains(index->bloom, and_query->value) || (and_query->folded.size > 0 && bloom_contains(index->bloom, and_query->folded));
+    if (!found) {
+      phases[PHASE_LOOKUP] += now_nanoseconds() - filter_start;
+      add(&stats.bloom_negatives, 1);
+      return {};
+    }
+  }
+  phases[PHASE_LOOKUP] += now_nanoseconds() - filter_start;
+
+  Postings postings   = {};
+  bool     first_word = true;
+  for (Query* and_query = or_query->child; and_query != nullptr && cancel->reason == CANCEL_NONE; and_query = and_query->next) {
+    I64      lookup_start  = now_nanoseconds();
+    Postings new_postings  = lookup_word(scratch_arena, index, and_query->value, and_query->term, cancel);
+    if (and_query->folded.size > 0) {
+      Postings folded = lookup_word(scratch_arena, index, and_query->folded, and_query->folded_term, cancel);
+      new_postings    = unite(scratch_arena, new_postings, folded, cancel);
+    }
+    I64      lookup_end    = now_nanoseconds();
+    phases[PHASE_LOOKUP]  += lookup_end - lookup_start;
+
+    if (first_word) {
+      postings   = new_postings;
+      first_word = false;
+    } else {
+      TRACE_ZONE(ZONE_INTERSECT);
+      postings = intersect(scratch_arena, postings, new_postings, cancel);
+      phases[PHASE_INTERSECT] += now_nanoseconds() - lookup_end;
+    }
+  }
+  return postings;
+}
+
+// Every line any AND query matches, once and in order, so the whole query is
+// a single pass over the log however many branches it has.
+static Postings match_query(Arena* scratch_arena, Index* index, Query* query, I64* phases, Cancel* cancel) {
+  Postings postings = {};
+  for (Query* or_query = query; or_query != nullptr && cancel->reason == CANCEL_NONE; or_query = or_query->next) {
+    Postings branch      = match_postings(scratch_arena, index, or_query, phases, cancel);
+    I64      unite_start = now_nanoseconds();
+    {
+      TRACE_ZONE(ZONE_INTERSECT);
+      postings = or_query == query ? distinct(scratch_arena, branch, cancel) : unite(scratch_arena, postings, branch, cancel);
+    }
+    phases[PHASE_INTERSECT] += now_nanoseconds() - unite_start;
+  }
+  return postings;
+}
+
+static time_t line_time(String line, const char* log_time_format, I64* time_end = nullptr) {
+  time_t time = -1;
+  for (I64 i = 0; time == -1 && i < line.size; i++) {
+    time = parse_time(suffix(line, i), log_time_format, time_end);
+    if (time != -1 && time_end != nullptr) {
+      *time_end += i;
+    }
+  }
+  return time;
+}
+
+// The end of the range is inclusive, so lines right at it go in the last bin.
+static I32 time_bin(time_t time, time_t start_time, time_t end_time, I32 bins) {
+  F32 value = (F32) (time - start_time) / (end_time - start_time);
+  return min((I32) (bins * value), bins - 1);
+}
+
+#define APPROXIMATE_SAMPLES     4096
+#define APPROXIMATE_MIN_SAMPLES 64
+
+// Every index is sampled independently, so their estimates and variances
+// simply add up.
+struct Approximation {
+  F64* estimate;
+  F64* variance;
+  I64  samples;
+  I64  postings;
+};
+
+static I64 reverse_bits(I64 value, I64 bits) {
+  I64 result = 0;
+  for (I64 i = 0; i < bits; i++) {
+    result = (result << 1) | ((value >> i) & 1);
+  }
+  return result;
+}
+
+// Splits the postings of the query into up to APPROXIMATE_SAMPLES strata
+// of consecutive postings, which are consecutive stretches of the log and so
+// roughly time blocks, and reads one random line from each. Strata are visited
+// in bit-reversed order, so when the deadline cuts sampling short the samples
+// taken so far still cover the whole file evenly. Queries with few enough
+// matches are read in full, which makes their estimate exact.
+static void sample_histogram(
+  Arena*         scratch_arena,
+  char*          log_time_format,
+  Index*         index,
+  Parameters     parameters,
+  Query*         query,
+  I32            bins,
+  Approximation* approximation,
+  Random*        random,
+  I64            deadline,
+  I64*           phases,
+  Cancel*        cancel
+) {
+  const char* query_time_format = "%Y-%m-%dT%H:%M";
+
+  time_t start_time = parse_time(parameters.start, query_time_format);
+  time_t end_time   = parse_time(parameters.end, query_time_format);
+
+  acquire_index(index);
+  I64      saved    = save(scratch_arena);
+  I32*     hits     = allocate_array<I32>(scratch_arena, bins);
+  Postings postings = match_query(scratch_arena, index, query, phases, cancel);
+
+  I64 sample_start = now_nanoseconds();
+  I64 strata       = min(postings.count, (I64) APPROXIMATE_SAMPLES);
+  I64 bits         = 0;
+  while ((1ll << bits) < strata) {
+    bits++;
+  }
+
+  I64 samples = 0;
+  for (I64 k = 0; k < (1ll << bits) && !should_stop(cancel); k++) {
+    I64 stratum = reverse_bits(k, bits);
+    if (stratum >= strata) {
+      continue;
+    }
+    if (samples >= APPROXIMATE_MIN_SAMPLES && samples % 16 == 0 && now_nanoseconds() > deadline) {
+      break;
+    }
+
+    I64    first  = postings.count * stratum / strata;
+    I64    last   = postings.count * (stratum + 1) / strata;
+    I64    chosen = first + next_below(random, last - first);
+    String line   = read_line(index, postings.values[chosen]);
+    time_t time   = line_time(line, log_time_format);
+    if (start_time <= time && time <= end_time) {
+      hits[time_bin(time, start_time, end_time, bins)]++;
+    }
+    samples++;
+    cancel->lines_scanned++;
+  }
+
+  // The variance is that of a simple random sample with the finite
+  // population correction, which stratifying can only make smaller.
+  F64 count = postings.count;
+  for (I32 i = 0; samples > 0 && i < bins; i++) {
+    F64 fraction = (F64) hits[i] / samples;
+    approximation->estimate[i] += count * fraction;
+    approximation->variance[i] += count * count * fraction * (1 - fraction) / samples * (1 - samples / count);
+  }
+  approximation->samples  += samples;
+  approximation->postings += postings.count;
+  phases[PHASE_SAMPLE]    += now_nanoseconds() - sample_start;
+
+  restore(scratch_arena, saved);
+  release_index(index);
+}
+
+// An estimated histogram with the half width of a 95% confidence interval for
+// every bin, sent ahead of the exact histogram frames.
+static void write_approximate(Arena* arena, I32 connection_fd, I32 bins, Approximation* approximation) {
+  I64  saved   = save(arena);
+  I32  count   = 3 + 2 * bins;
+  I32* payload = allocate_array<I32>(arena, count);
+  payload[0]   = bins;
+  payload[1]   = min(approximation->samples, (I64) INT32_MAX);
+  payload[2]   = min(approximation->postings, (I64) INT32_MAX);
+  for (I32 i = 0; i < bins; i++) {
+    payload[3 + i]        = (I32) (approximation->estimate[i] + 0.5);
+    payload[3 + bins + i] = (I32) ceil(1.96 * sqrt(approximation->variance[i]));
+  }
+
+  I32 approximate_tag  = 4;
+  I32 approximate_size = sizeof(I32) * count;
+
+  struct iovec parts[] = {
+    to_iovec(&approximate_tag),
+    to_iovec(&approximate_size),
+    { .iov_base = payload, .iov_len = (U64) approximate_size },
+  };
+  write_frame(connection_fd, parts, length(parts));
+
+  restore(arena, saved);
+}
+
+// Postings of a merged index are grouped by part, so the prefetch only moves
+// to the next mapping once.
+static void prefetch_postings(Index* index, Postings postings) {
+  Prefetch prefetch = {};
+  Index*   part     = nullptr;
+  for (I64 i = 0; i < postings.count; i++) {
+    I64    offset = postings.values[i];
+    Index* source = index;
+    if (index->part_count > 0) {
+      source = index->parts[location_file(offset)];
+      offset = file_location(offset);
+    }
+    if (source != part) {
+      if (part != nullptr) {
+	flush_prefetch(&prefetch);
+      }
+      part             = source;
+      prefetch.mapping = source->mapping;
+    }
+
+    if (source->store != nullptr) {
+      BlockEntry entry = source->store->directory[location_block(offset)];
+      prefetch_range(&prefetch, entry.offset, entry.offset + entry.compressed_size);
+    } else {
+      prefetch_range(&prefetch, offset, offset + 1);
+    }
+  }
+  if (part != nullptr) {
+    flush_prefetch(&prefetch);
+  }
+}
+
+// Results are appended to the query arena and have to stay contiguous, so
+// anything else run_query allocates goes into the scratch arena. Without a
+// page only histograms and top values are counted.
+static void run_query(
+  Arena*     query_arena,
+  Arena*     scratch_arena,
+  char*      log_time_format,
+  I32        connection_fd,
+  Index*     index,
+  Parameters parameters,
+  Query*     query,
+  I32        bins,
+  I32*       histogram,
+  Page*      page,
+  Top*       top,
+  I64*       phases,
+  Cancel*    cancel
+) {
+  TRACE_ZONE(ZONE_QUERY);
+  const char* query_time_format = "%Y-%m-%dT%H:%M";
+  
+  time_t start_time = parse_time(parameters.start, query_time_format);
+  time_t end_time   = parse_time(parameters.end, query_time_format);
+  if (page != nullptr) {
+    page->start_time = start_time;
+  }
+
+  acquire_index(index);
+  I64 saved = save(scratch_arena);
+
+  Postings offsets = match_query(scratch_arena, index, query, phases, cancel);
+
+  prefetch_postings(index, offsets);
+
+  I32 min_offset   = PAGE_SIZE * parameters.page;
+  I32 max_offset   = min_offset + PAGE_SIZE;
+  I32 offset_count = 0;
+  I32 wrote_logs   = false;
+  
+  I64 last_histogram_write = time(NULL);
+  I64 filter_start         = now_nanoseconds();
+  I64 write_nanoseconds    = 0;
+
+  while (offset_count < offsets.count && !should_stop(cancel)) {
+    String line = read_line(index, offsets.values[offset_count]);
+    cancel->lines_scanned++;
+
+    {
+      TRACE_ZONE(ZONE_TIME_FILTER);
+      I64    time_end = 0;
+      time_t time     = line_time(line, log_time_format, &time_end);
+      if (time == -1) {
+	print(WARN "Failed to parse time as ", log_time_format, " in this line: ", line);
+      }
+  
+      if (start_time <= time && time <= end_time) {
+	if (page != nullptr && min_offset <= offset_count && offset_count < max_offset) {
+	  add_to_page(query_arena, page, line, time, line_level(line, time_end));
+	}
+
+	histogram[time_bin(time, start_time, end_time, bins)]++;
+	if (top != nullptr) {
+	  add_line_to_top(top, line, time_end);
+	}
+      }
+    }
+    
+    offset_count++;
+    
+    if (page != nullptr && offset_count == max_offset) {
+      I64 write_start = now_nanoseconds();
+      write_histogram(connection_fd, bins, histogram);
+      write_page(connection_fd, page);
+      wrote_logs         = true;
+      write_nanoseconds += now_nanoseconds() - write_start;
+    }
+
+    I64 now = time(NULL);
+    if (now != last_histogram_write) {
+      I64 write_start = now_nanoseconds();
+      write_histogram(connection_fd, bins, histogram);
+      last_histogram_write = now;
+      write_nanoseconds   += now_nanoseconds() - write_start;
+    }
+  }
+
+  I64 write_start = now_nanoseconds();
+  phases[PHASE_TIME_FILTER] += write_start - filter_start - write_nanoseconds;
+  if (cancel->reason != CANCEL_DISCONNECTED) {
+    if (page != nullptr && offset_count > 0 && !wrote_logs) {
+      write_page(connection_fd, page);
+    }
+    write_histogram(connection_fd, bins, histogram);
+  }
+  phases[PHASE_WRITE] += now_nanoseconds() - write_start + write_nanoseconds;
+
+  restore(scratch_arena, saved);
+  release_index(index);
+}
@@ -0,0 +1,690 @@
+// Postings and the bounded-memory way of building them. Instead of growing a
+// tree for the whole file, a segment build reads the log in chunks and
+// collects (word, offset) pairs until they fill the memory budget, sorts them
+// and spills them to a run file. Once the whole log has been read the runs are
+// merged into a segment: every word's postings, then a dictionary of entries
+// sorted by word, then the words themselves. Segments are mapped and their
+// terms numbered when opened, so serving one costs page cache and a table of
+// numbers rather than heap for the postings.
+
+// Offsets of every line a word appears on, in the order they were indexed,
+// which is also ascending.
+struct Postings {
+  I64* values;
+  I64  count;
+  I64  capacity;
+};
+
+// Postings grow by doubling, the arrays they outgrow are left in the arena.
+static void append_posting(Arena* arena, Postings* postings, I64 value) {
+  if (postings->count == postings->capacity) {
+    I64  capacity = postings->capacity == 0 ? 1 : 2 * postings->capacity;
+    I64* values   = allocate_array<I64>(arena, capacity);
+    if (postings->count > 0) {
+      memcpy(values, postings->values, sizeof(I64) * postings->count);
+    }
+    postings->values   = values;
+    postings->capacity = capacity;
+  }
+  postings->values[postings->count] = value;
+  postings->count++;
+}
+
+// Words are separated by spaces, and whatever is between a pair of double
+// qoutes is a word as well.
+struct WordIterator {
+  String line;
+  I64    next;
+  I64    word_start;
+  I64    last_qoute;
+};
+
+static WordIterator iterate_words(String line) {
+  WordIterator words = {};
+  words.line         = line;
+  words.last_qoute   = -1;
+  return words;
+}
+
+static bool next_word(WordIterator* words, String* word) {
+  String line = words->line;
+  while (words->next <= line.size) {
+    I64 j = words->next;
+    words->next++;
+
+    if (j == line.size || line[j] == ' ') {
+      I64 word_start    = words->word_start;
+      words->word_start = j + 1;
+      if (word_start != j) {
+	*word = slice(line, word_start, j);
+	return true;
+      }
+    } else if (line[j] == '"') {
+      if (words->last_qoute == -1) {
+	words->last_qoute = j;
+      } else {
+	String qouted_word = slice(line, words->last_qoute + 1, j);
+	words->last_qoute  = -1;
+	if (qouted_word.size > 0) {
+	  *word = qouted_word;
+	  return true;
+	}
+      }
+    }
+  }
+  return false;
+}
+
+#define SEGMENT_MAGIC      0x47455349
+#define SEGMENT_CHUNK_SIZE (1 << 20)
+#define MIN_MEMORY_BUDGET  (4ll << 20)
+
+struct SegmentHeader {
+  U32 magic;
+  U32 reserved;
+  I64 term_count;
+  I64 posting_count;
+  I64 entries_offset;
+  I64 words_offset;
+};
+
+struct SegmentEntry {
+  I64 word_offset;
+  I64 word_size;
+  I64 postings_offset;
+  I64 postings_count;
+};
+
+struct Segment {
+  Mapping*       mapping;
+  SegmentHeader* header;
+  SegmentEntry*  entries;
+  U8*            words;
+};
+
+struct Writer {
+  I32    fd;
+  String buffer;
+  I64    buffered;
+  I64    written;
+  bool   failed;
+};
+
+static Writer make_writer(Arena* arena, I32 fd, I64 buffer_size) {
+  Writer writer = {};
+  writer.fd     = fd;
+  writer.buffer = allocate_bytes(arena, buffer_size, 1);
+  return writer;
+}
+
+static void flush_writer(Writer* writer) {
+  if (!writer->failed && !write_all(writer->fd, prefix(writer->buffer, writer->buffered))) {
+    writer->failed = true;
+  }
+  writer->buffered = 0;
+}
+
+static void write_bytes(Writer* writer, const void* data, I64 size) {
+  writer->written += size;
+  while (size > 0) {
+    if (writer->buffered == writer->buffer.size) {
+      flush_writer(writer);
+    }
+    I64 copied = min(size, writer->buffer.size - writer->buffered);
+    memcpy(&writer->buffer[writer->buffered], data, copied);
+    writer->buffered += copied;
+    data              = (U8*) data + copied;
+    size             -= copied;
+  }
+}
+
+struct Reader {
+  I32    fd;
+  String buffer;
+  I64    start;
+  I64    end;
+};
+
+static Reader make_reader(Arena* arena, I32 fd, I64 buffer_size) {
+  Reader reader = {};
+  reader.fd     = fd;
+  reader.buffer = allocate_bytes(arena, buffer_size, 1);
+  return reader;
+}
+
+// Returns false if the file ended or could not be read before size bytes.
+static bool read_bytes(Reader* reader, void* data, I64 size) {
+  while (size > 0) {
+    if (reader->start == reader->end) {
+      I64 bytes_read = read(reader->fd, reader->buffer.data, reader->buffer.size);
+      if (bytes_read <= 0) {
+	return false;
+      }
+      reader->start = 0;
+      reader->end   = bytes_read;
+    }
+    I64 copied = min(size, reader->end - reader->start);
+    memcpy(data, &reader->buffer[reader->start], copied);
+    reader->start += copied;
+    data           = (U8*) data + copied;
+    size          -= copied;
+  }
+  return true;
+}
+
+struct RunPair {
+  U8* word;
+  I64 word_size;
+  I64 offset;
+};
+
+// Pairs and the words they point at share the memory budget. Every spilled
+// run is sorted by word and holds one record per distinct word: its size, its
+// bytes, the number of postings and the postings.
+struct RunBuilder {
+  Arena*   path_arena;
+  String   directory;
+  String   source_path;
+  RunPair* pairs;
+  I64      pair_count;
+  I64      pair_capacity;
+  String   words;
+  I64      words_used;
+  I64      run_count;
+  bool     failed;
+
+  TemplateMiner* miner;
+};
+
+static String run_path(RunBuilder* runs, I64 run) {
+  char extension[32] = {};
+  snprintf(extension, sizeof(extension), ".run%lld", run);
+  return derived_path(runs->path_arena, runs->directory, runs->source_path, extension);
+}
+
+static I32 compare_pairs(const void* a, const void* b) {
+  RunPair* first      = (RunPair*) a;
+  RunPair* second     = (RunPair*) b;
+  I32      comparison = compare(String(first->word, first->word_size), String(second->word, second->word_size));
+  if (comparison != 0) {
+    return comparison;
+  }
+  return first->offset < second->offset ? -1 : first->offset > second->offset;
+}
+
+static void spill_run(Arena* scratch_arena, RunBuilder* runs) {
+  if (runs->pair_count == 0) {
+    return;
+  }
+  qsort(runs->pairs, runs->pair_count, sizeof(RunPair), compare_pairs);
+
+  I64    saved = save(scratch_arena);
+  String path  = run_path(runs, runs->run_count);
+  I32    fd    = open((char*) path.data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    println(ERROR "Failed to open \"", path, "\": ", get_error(), '.');
+    runs->failed = true;
+    restore(scratch_arena, saved);
+    return;
+  }
+
+  Writer writer = make_writer(scratch_arena, fd, SEGMENT_CHUNK_SIZE);
+  for (I64 i = 0; i < runs->pair_count;) {
+    String word = String(runs->pairs[i].word, runs->pairs[i].word_size);
+    I64    end  = i + 1;
+    while (end < runs->pair_count && String(runs->pairs[end].word, runs->pairs[end].word_size) == word) {
+      end++;
+    }
+
+    I32 word_size = word.size;
+    I64 count     = end - i;
+    write_bytes(&writer, &word_size, sizeof(word_size));
+    write_bytes(&writer, word.data, word.size);
+    write_bytes(&writer, &count, sizeof(count));
+    for (; i < end; i++) {
+      write_bytes(&writer, &runs->pairs[i].offset, sizeof(I64));
+    }
+  }
+  flush_writer(&writer);
+  if (writer.failed) {
+    println(ERROR "Failed to write \"", path, "\": ", get_error(), '.');
+    runs->failed = true;
+  }
+  assert(close(fd) == 0);
+  restore(scratch_arena, saved);
+
+  runs->run_count++;
+  runs->pair_count = 0;
+  runs->words_used = 0;
+}
+
+static void add_pair(Arena* scratch_arena, RunBuilder* runs, String word, I64 offset) {
+  if (runs->pair_count == runs->pair_capacity || runs->words_used + word.size > runs->words.size) {
+    spill_run(scratch_arena, runs);
+  }
+  if (word.size > runs->words.size) {
+    println(WARN "Skipping a ", word.size, " byte word that does not fit in the memory budget.");
+    return;
+  }
+
+  U8* copy = &runs->words[runs->words_used];
+  memcpy(copy, word.data, word.size);
+  runs->words_used += word.size;
+
+  RunPair* pair   = &runs->pairs[runs->pair_count];
+  pair->word      = copy;
+  pair->word_size = word.size;
+  pair->offset    = offset;
+  runs->pair_count++;
+}
+
+static void add_lines(Arena* scratch_arena, RunBuilder* runs, String text, I64 base) {
+  TRACE_ZONE_BYTES(ZONE_INDEX_LINES, text.size);
+  for (I64 line_start = 0; line_start < text.size;) {
+    I64 line_end = find(text, '\n', line_start);
+    if (line_end != line_start) {
+      String    line     = slice(text, line_start, line_end);
+      Template* line_template = runs->miner != nullptr ? mine_line(runs->miner, line) : nullptr;
+      if (line_template != nullptr) {
+	add_pair(scratch_arena, runs, line_template->term, base + line_start);
+      }
+
+      WordIterator words = iterate_words(line);
+      String       word  = {};
+      while (next_word(&words, &word)) {
+	if (is_constant(runs->miner, word)) {
+	  continue;
+	}
+	TokenIterator tokens = iterate_tokens(word);
+	String        term   = {};
+	while (next_token(&tokens, &term)) {
+	  add_pair(scratch_arena, runs, term, base + line_start);
+	}
+      }
+    }
+    line_start = line_end + 1;
+  }
+}
+
+// Reads the log SEGMENT_CHUNK_SIZE bytes at a time, keeping the partial line at
+// the end of every chunk for the next one.
+static bool add_file(Arena* scratch_arena, RunBuilder* runs, String path) {
+  I32 fd = open((char*) path.data, O_RDONLY);
+  if (fd == -1) {
+    println(ERROR "Failed to open \"", path, "\": ", get_error(), '.');
+    return false;
+  }
+
+  String buffer = allocate_bytes(scratch_arena, SEGMENT_CHUNK_SIZE, 1);
+  I64    filled = 0;
+  I64    base   = 0;
+  while (true) {
+    I64 bytes_read = read(fd, &buffer[filled], buffer.size - filled);
+    if (bytes_read == -1) {
+      println(ERROR "Failed to read \"", path, "\": ", get_error(), '.');
+      assert(close(fd) == 0);
+      return false;
+    }
+    filled += bytes_read;
+
+    I64 consumed = filled;
+    if (bytes_read > 0) {
+      consumed = filled - 1;
+      while (consumed >= 0 && buffer[consumed] != '\n') {
+	consumed--;
+      }
+      consumed++;
+    }
+
+    if (consumed == 0 && filled == buffer.size) {
+      String grown = allocate_bytes(scratch_arena, 2 * buffer.size, 1);
+      memcpy(grown.data, buffer.data, filled);
+      buffer = grown;
+      continue;
+    }
+
+    add_lines(scratch_arena, runs, prefix(buffer, consumed), base);
+    memmove(buffer.data, &buffer[consumed], filled - consumed);
+    filled -= consumed;
+    base   += consumed;
+    if (bytes_read == 0) {
+      break;
+    }
+  }
+
+  assert(close(fd) == 0);
+  return true;
+}
+
+static void add_store(Arena* scratch_arena, RunBuilder* runs, BlockStore* store) {
+  String buffer = allocate_bytes(scratch_arena, store->header->max_block_size, 1);
+  for (I64 block = 0; block < store->header->block_count; block++) {
+    String text = {};
+    if (decompress_block(store, block, buffer, &text)) {
+      add_lines(scratch_arena, runs, text, make_location(block, 0));
+    }
+  }
+}
+
+struct RunCursor {
+  Reader reader;
+  String word;
+  I64    word_capacity;
+  I64    count;
+  I64    run;
+  bool   done;
+};
+
+static void advance_cursor(Arena* arena, RunCursor* cursor) {
+  I32 word_size = 0;
+  if (!read_bytes(&cursor->reader, &word_size, sizeof(word_size))) {
+    cursor->done = true;
+    return;
+  }
+  if (word_size > cursor->word_capacity) {
+    cursor->word_capacity = 2 * word_size;
+    cursor->word.data     = allocate_bytes(arena, cursor->word_capacity, 1).data;
+  }
+  cursor->word.size = word_size;
+  if (!read_bytes(&cursor->reader, cursor->word.data, word_size) || !read_bytes(&cursor->reader, &cursor->count, sizeof(cursor->count))) {
+    println(ERROR "Run ", cursor->run, " ended in the middle of a record.");
+    cursor->done = true;
+  }
+}
+
+// Ties are broken by run, so postings of the same word come out in file order.
+static bool cursor_less(RunCursor* a, RunCursor* b) {
+  I32 comparison = compare(a->word, b->word);
+  return comparison < 0 || (comparison == 0 && a->run < b->run);
+}
+
+static void sift_down(RunCursor** heap, I64 count, I64 i) {
+  while (true) {
+    I64 smallest = i;
+    for (I64 child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++) {
+      if (cursor_less(heap[child], heap[smallest])) {
+	smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    RunCursor* swap = heap[i];
+    heap[i]         = heap[smallest];
+    heap[smallest]  = swap;
+    i               = smallest;
+  }
+}
+
+static bool append_file(Arena* scratch_arena, Writer* writer, I32 fd) {
+  assert(lseek(fd, 0, SEEK_SET) == 0);
+  I64    saved  = save(scratch_arena);
+  String buffer = allocate_bytes(scratch_arena, SEGMENT_CHUNK_SIZE, 1);
+  I64    bytes_read;
+  while ((bytes_read = read(fd, buffer.data, buffer.size)) > 0) {
+    write_bytes(writer, buffer.data, bytes_read);
+  }
+  restore(scratch_arena, saved);
+  return bytes_read == 0;
+}
+
+// path with extension appended, null terminated like concatonate_paths.
+static String with_extension(Arena* arena, String path, String extension) {
+  if (path.size > 0 && path[path.size - 1] == 0) {
+    path.size--;
+  }
+  String result = allocate_bytes(arena, path.size + extension.size + 1, 1);
+  memcpy(result.data, path.data, path.size);
+  memcpy(&result[path.size], extension.data, extension.size);
+  return result;
+}
+
+// Terms have to be added in sorted order. Postings go straight into the
+// segment while entries and words go to two side files appended when it is
+// closed, so writing one only ever needs three buffers.
+struct SegmentWriter {
+  String        path;
+  String        entries_path;
+  String        words_path;
+  I32           segment_fd;
+  I32           entries_fd;
+  I32           words_fd;
+  Writer        postings;
+  Writer        entries;
+  Writer        words;
+  SegmentHeader header;
+  SegmentEntry  entry;
+};
+
+static bool open_segment_writer(Arena* arena, SegmentWriter* writer, String path, I64 buffer_size) {
+  writer->path         = path;
+  writer->entries_path = with_extension(arena, path, ".entries");
+  writer->words_path   = with_extension(arena, path, ".words");
+
+  writer->segment_fd = open((char*) path.data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  writer->entries_fd = open((char*) writer->entries_path.data, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  writer->words_fd   = open((char*) writer->words_path.data, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (writer->segment_fd == -1 || writer->entries_fd == -1 || writer->words_fd == -1) {
+    println(ERROR "Failed to create \"", path, "\": ", get_error(), '.');
+    I32    fds[]   = { writer->segment_fd, writer->entries_fd, writer->words_fd };
+    String paths[] = { path, writer->entries_path, writer->words_path };
+    for (I64 i = 0; i < (I64) length(fds); i++) {
+      if (fds[i] != -1) {
+	assert(close(fds[i]) == 0);
+	unlink((char*) paths[i].data);
+      }
+    }
+    return false;
+  }
+
+  writer->postings     = make_writer(arena, writer->segment_fd, buffer_size);
+  writer->entries      = make_writer(arena, writer->entries_fd, buffer_size);
+  writer->words        = make_writer(arena, writer->words_fd, buffer_size);
+  writer->header       = {};
+  writer->header.magic = SEGMENT_MAGIC;
+  write_bytes(&writer->postings, &writer->header, sizeof(writer->header));
+  return true;
+}
+
+static void begin_term(SegmentWriter* writer, String word) {
+  writer->entry                 = {};
+  writer->entry.word_offset     = writer->words.written;
+  writer->entry.word_size       = word.size;
+  writer->entry.postings_offset = writer->postings.written;
+  write_bytes(&writer->words, word.data, word.size);
+}
+
+static void write_posting(SegmentWriter* writer, I64 value) {
+  write_bytes(&writer->postings, &value, sizeof(value));
+  writer->entry.postings_count++;
+}
+
+static void end_term(SegmentWriter* writer) {
+  write_bytes(&writer->entries, &writer->entry, sizeof(writer->entry));
+  writer->header.term_count++;
+  writer->header.posting_count += writer->entry.postings_count;
+}
+
+static bool close_segment_writer(Arena* scratch_arena, SegmentWriter* writer) {
+  flush_writer(&writer->entries);
+  flush_writer(&writer->words);
+  writer->header.entries_offset = writer->postings.written;
+  writer->header.words_offset   = writer->postings.written + writer->entries.written;
+
+  bool ok = !writer->entries.failed && !writer->words.failed;
+  ok      = ok && append_file(scratch_arena, &writer->postings, writer->entries_fd);
+  ok      = ok && append_file(scratch_arena, &writer->postings, writer->words_fd);
+  flush_writer(&writer->postings);
+  ok      = ok && !writer->postings.failed;
+  ok      = ok && pwrite(writer->segment_fd, &writer->header, sizeof(writer->header), 0) == sizeof(writer->header);
+  if (!ok) {
+    println(ERROR "Failed to write \"", writer->path, "\": ", get_error(), '.');
+  }
+
+  assert(close(writer->segment_fd) == 0);
+  assert(close(writer->entries_fd) == 0);
+  assert(close(writer->words_fd) == 0);
+  unlink((char*) writer->entries_path.data);
+  unlink((char*) writer->words_path.data);
+  return ok;
+}
+
+static bool merge_runs(Arena* scratch_arena, RunBuilder* runs, String path, I64 memory_budget) {
+  I64 saved       = save(scratch_arena);
+  I64 buffer_size = memory_budget / (runs->run_count + 4);
+  buffer_size     = buffer_size < (4 << 10) ? (4 << 10) : buffer_size;
+
+  RunCursor*  cursors = allocate_array<RunCursor>(scratch_arena, runs->run_count);
+  RunCursor** heap    = allocate_array<RunCursor*>(scratch_arena, runs->run_count);
+  I64         heaped  = 0;
+  for (I64 run = 0; run < runs->run_count; run++) {
+    String run_file = run_path(runs, run);
+    I32    fd       = open((char*) run_file.data, O_RDONLY);
+    if (fd == -1) {
+      println(ERROR "Failed to open \"", run_file, "\": ", get_error(), '.');
+      restore(scratch_arena, saved);
+      return false;
+    }
+    if (unlink((char*) run_file.data) == -1) {
+      println(WARN "Failed to unlink \"", run_file, "\": ", get_error(), '.');
+    }
+
+    cursors[run].reader = make_reader(scratch_arena, fd, buffer_size);
+    cursors[run].run    = run;
+    advance_cursor(scratch_arena, &cursors[run]);
+    if (!cursors[run].done) {
+      heap[heaped] = &cursors[run];
+      heaped++;
+    }
+  }
+  for (I64 i = heaped / 2 - 1; i >= 0; i--) {
+    sift_down(heap, heaped, i);
+  }
+
+  SegmentWriter writer = {};
+  bool          ok     = open_segment_writer(scratch_arena, &writer, path, buffer_size);
+
+  String word          = {};
+  I64    word_capacity = 0;
+  while (ok && heaped > 0) {
+    begin_term(&writer, heap[0]->word);
+
+    // The word has to be copied, advancing the cursor that holds it overwrites it.
+    if (heap[0]->word.size > word_capacity) {
+      word_capacity = 2 * heap[0]->word.size;
+      word.data     = allocate_bytes(scratch_arena, word_capacity, 1).data;
+    }
+    word.size = heap[0]->word.size;
+    memcpy(word.data, heap[0]->word.data, word.size);
+
+    while (heaped > 0 && heap[0]->word == word) {
+      RunCursor* cursor = heap[0];
+      for (I64 i = 0; i < cursor->count; i++) {
+	I64 offset = 0;
+	if (!read_bytes(&cursor->reader, &offset, sizeof(offset))) {
+	  println(ERROR "Run ", cursor->run, " ended in the middle of a record.");
+	  break;
+	}
+	write_posting(&writer, offset);
+      }
+
+      advance_cursor(scratch_arena, cursor);
+      if (cursor->done) {
+	heaped--;
+	heap[0] = heap[heaped];
+      }
+      sift_down(heap, heaped, 0);
+    }
+    end_term(&writer);
+  }
+  ok = ok && close_segment_writer(scratch_arena, &writer);
+
+  for (I64 run = 0; run < runs->run_count; run++) {
+    assert(close(cursors[run].reader.fd) == 0);
+  }
+  restore(scratch_arena, saved);
+  return ok;
+}
+
+static Segment* open_segment(Arena* arena, Mapping* mapping) {
+  String         text   = mapping->text;
+  SegmentHeader* header = (SegmentHeader*) text.data;
+  if (text.size < (I64) sizeof(SegmentHeader) || header->magic != SEGMENT_MAGIC || header->words_offset > text.size) {
+    println(ERROR "\"", mapping->path, "\" is not a valid segment.");
+    return nullptr;
+  }
+
+  Segment* segment = allocate<Segment>(arena);
+  segment->mapping = mapping;
+  segment->header  = header;
+  segment->entries = (SegmentEntry*) &text[header->entries_offset];
+  segment->words   = &text[header->words_offset];
+  return segment;
+}
+
+// Tokenizes the log, or its block store when it has one, into runs of at most
+// memory_budget bytes and merges them into a segment in directory. Logs in
+// different directories can share a file name, and indexers can share a spill
+// directory, so the runs and the segment are named by process and count. The
+// segment is unlinked as soon as it is mapped.
+static Segment* build_segment(
+  Arena*         index_arena,
+  Arena*         scratch_arena,
+  String         path,
+  BlockStore*    store,
+  String         directory,
+  I64            memory_budget,
+  TemplateMiner* miner
+) {
+  static I64 segments = 0;
+
+  I64 saved = save(scratch_arena);
+
+  char name[64] = {};
+  snprintf(name, sizeof(name), "segment-%d-%lld", getpid(), __atomic_fetch_add(&segments, 1, __ATOMIC_RELAXED));
+
+  // Leave room for the read buffer and for lines longer than it.
+  I64 run_budget = memory_budget - 2 * SEGMENT_CHUNK_SIZE;
+
+  RunBuilder runs    = {};
+  runs.path_arena    = scratch_arena;
+  runs.directory     = directory;
+  runs.source_path   = String(name);
+  runs.pair_capacity = run_budget * 3 / 4 / sizeof(RunPair);
+  runs.pairs         = allocate_array<RunPair>(scratch_arena, runs.pair_capacity);
+  runs.words         = allocate_bytes(scratch_arena, run_budget / 4, 1);
+  runs.miner         = miner;
+
+  bool ok = true;
+  if (store != nullptr) {
+    add_store(scratch_arena, &runs, store);
+  } else {
+    ok = add_file(scratch_arena, &runs, path);
+  }
+  spill_run(scratch_arena, &runs);
+
+  String segment_path = derived_path(index_arena, directory, String(name), ".segment");
+  ok = ok && !runs.failed && merge_runs(scratch_arena, &runs, segment_path, memory_budget);
+  println(INFO "Merged ", runs.run_count, " runs of \"", path, "\" into \"", segment_path, "\".");
+  restore(scratch_arena, saved);
+
+  Mapping* mapping = ok ? map_file(index_arena, segment_path) : nullptr;
+  Segment* segment = mapping != nullptr ? open_segment(index_arena, mapping) : nullptr;
+  if (unlink((char*) segment_path.data) == -1 && errno != ENOENT) {
+    println(WARN "Failed to unlink \"", segment_path, "\": ", get_error(), '.');
+  }
+  if (segment == nullptr && mapping != nullptr) {
+    retire(mapping);
+    release(mapping);
+  }
+  return segment;
+}
+
+static Postings segment_postings(Segment* segment, I64 position) {
+  SegmentEntry* entry    = &segment->entries[position];
+  Postings      postings = {};
+  postings.values        = (I64*) &segment->mapping->text[entry->postings_offset];
+  postings.count         = entry->postings_count;
+  postings.capacity      = entry->postings_count;
+  return postings;
+}
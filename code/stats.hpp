@@ -0,0 +1,173 @@
+// Lock-free counters and HDR-style latency histograms, exposed on /api/stats in
+// the Prometheus text format. Histogram buckets are log-linear: every power of
+// two is split into HISTOGRAM_SUB_BUCKETS linear buckets, so recording is a
+// couple of shifts and an atomic add no matter how large the value is.
+
+#define HISTOGRAM_SUB_BITS    4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS     ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct Histogram {
+  I64 buckets[HISTOGRAM_BUCKETS];
+  I64 count;
+  I64 sum;
+};
+
+enum QueryPhase {
+  PHASE_PARSE,
+  PHASE_LOOKUP,
+  PHASE_INTERSECT,
+  PHASE_TIME_FILTER,
+  PHASE_WRITE,
+  PHASE_SAMPLE,
+  PHASE_COUNT,
+};
+
+static const char* phase_names[PHASE_COUNT] = {
+  "parse",
+  "lookup",
+  "intersect",
+  "time_filter",
+  "write",
+  "sample",
+};
+
+struct Stats {
+  I64       queries;
+  I64       queries_timed_out;
+  I64       queries_disconnected;
+  I64       bloom_negatives;
+  I64       shard_failures;
+  I64       requests;
+  I64       bytes_streamed;
+  I64       files_indexed;
+  I64       exports;
+  I64       lines_exported;
+  Histogram build_latency;
+  Histogram query_latency;
+  Histogram phase_latency[PHASE_COUNT];
+};
+
+static Stats stats;
+
+static I64 now_nanoseconds() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+static void add(I64* counter, I64 value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static I64 bucket_index(I64 value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return value < 0 ? 0 : value;
+  }
+  I64 exponent = 63 - __builtin_clzll(value);
+  I64 shift    = exponent - HISTOGRAM_SUB_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// The largest value that lands in the bucket.
+static I64 bucket_limit(I64 index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) {
+    return index;
+  }
+  I64 shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+  I64 sub   = index % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static void record(Histogram* histogram, I64 value) {
+  add(&histogram->buckets[bucket_index(value)], 1);
+  add(&histogram->count, 1);
+  add(&histogram->sum, value);
+}
+
+static void append(Arena* arena, String text) {
+  String result = allocate_bytes(arena, text.size, 1);
+  memcpy(result.data, text.data, text.size);
+}
+
+static void append(Arena* arena, I64 n) {
+  U8 storage[20] = {};
+  append(arena, to_string(n, storage));
+}
+
+static void append_seconds(Arena* arena, I64 nanoseconds) {
+  char storage[32] = {};
+  snprintf(storage, sizeof(storage), "%.9f", nanoseconds / 1e9);
+  append(arena, storage);
+}
+
+static void append(Arena* arena, auto first, auto second, auto... rest) {
+  append(arena, first);
+  append(arena, second);
+  (append(arena, rest), ...);
+}
+
+// Label values must escape backslashes, qoutes and newlines. Paths built by
+// concatonate_paths carry their null terminator, which is dropped here.
+static void append_label(Arena* arena, String value) {
+  for (I64 i = 0; i < value.size; i++) {
+    U8 c = value[i];
+    if (c == 0) {
+      continue;
+    }
+    if (c == '\\' || c == '"') {
+      append(arena, "\\");
+    }
+    if (c == '\n') {
+      append(arena, "\\n");
+    } else {
+      append(arena, String(&value[i], 1));
+    }
+  }
+}
+
+static void append_metric(Arena* arena, String name, String type, String help) {
+  append(arena, "# HELP ", name, " ", help, "\n");
+  append(arena, "# TYPE ", name, " ", type, "\n");
+}
+
+// Buckets are exported at every power of two nanoseconds from about a
+// microsecond to about a minute, which line up exactly with the boundaries of
+// the underlying log-linear buckets.
+static void append_histogram(Arena* arena, String name, String labels, Histogram* histogram) {
+  I64 cumulative = 0;
+  I64 bucket     = 0;
+  for (I64 le = 1ll << 10; le <= 1ll << 36; le *= 2) {
+    while (bucket < HISTOGRAM_BUCKETS && bucket_limit(bucket) < le) {
+      cumulative += __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+      bucket++;
+    }
+    append(arena, name, "_bucket{", labels, labels.size > 0 ? "," : "", "le=\"");
+    append_seconds(arena, le);
+    append(arena, "\"} ", cumulative, "\n");
+  }
+
+  I64 count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  append(arena, name, "_bucket{", labels, labels.size > 0 ? "," : "", "le=\"+Inf\"} ", count, "\n");
+  append(arena, name, "_sum");
+  if (labels.size > 0) {
+    append(arena, "{", labels, "}");
+  }
+  append(arena, " ");
+  append_seconds(arena, __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED));
+  append(arena, "\n", name, "_count");
+  if (labels.size > 0) {
+    append(arena, "{", labels, "}");
+  }
+  append(arena, " ", count, "\n");
+}
+
+static void append_counter(Arena* arena, String name, String help, I64 value) {
+  append_metric(arena, name, "counter", help);
+  append(arena, name, " ", value, "\n");
+}
+
+static void append_gauge(Arena* arena, String name, String help, I64 value) {
+  append_metric(arena, name, "gauge", help);
+  append(arena, name, " ", value, "\n");
+}
@@ -0,0 +1,214 @@
+// Online template mining after Drain (He et al., ICWS 2017). Most lines are one
+// of a few templates with some parameters filled in, and the words a template
+// always has would otherwise get a posting on every one of its lines. Lines
+// are grouped by their number of tokens and their first token, and join the
+// template in their group they share the most tokens with, as long as that is
+// at least TEMPLATE_SIMILARITY of them. Tokens that differ become parameters.
+//
+// Every template gets a term of its own whose postings are its lines, and only
+// the parameters of a line are indexed as words. When a token of a template
+// becomes a parameter, every line of it so far still has that token, which is
+// remembered as the token and the number of those lines. Queries look words
+// up in both the terms and the templates.
+
+#define TEMPLATE_MAX_TOKENS   64
+#define TEMPLATE_GROUP_SIZE   64
+#define TEMPLATE_SIMILARITY   0.5
+#define TEMPLATE_BUCKET_COUNT 4096
+
+struct RetiredToken {
+  String        word;
+  I64           line_count;
+  RetiredToken* next;
+};
+
+// Parameters are the empty tokens. The id is the number of the term.
+struct Template {
+  String        term;
+  I32           id;
+  String*       tokens;
+  I32           token_count;
+  I64           line_count;
+  RetiredToken* retired;
+  Template*     next;
+};
+
+struct TemplateGroup {
+  I32            token_count;
+  String         first;
+  Template*      templates;
+  I32            template_count;
+  TemplateGroup* next;
+};
+
+// Groups only live as long as the build, templates as long as the index.
+struct TemplateMiner {
+  Arena*          build_arena;
+  Arena*          index_arena;
+  TemplateGroup** buckets;
+  Template**      templates;
+  I64             template_count;
+  I64             template_capacity;
+  String          tokens[TEMPLATE_MAX_TOKENS];
+  I32             token_count;
+  Template*       current;
+  I32             next_token;
+};
+
+// Template ids are unique across indexes, so merged indexes can keep the terms
+// of all of their parts apart.
+static I64 template_ids;
+
+static TemplateMiner* make_miner(Arena* build_arena, Arena* index_arena) {
+  TemplateMiner* miner = allocate<TemplateMiner>(build_arena);
+  miner->build_arena   = build_arena;
+  miner->index_arena   = index_arena;
+  miner->buckets       = allocate_array<TemplateGroup*>(build_arena, TEMPLATE_BUCKET_COUNT);
+  return miner;
+}
+
+static bool has_digit(String word) {
+  for (I64 i = 0; i < word.size; i++) {
+    if (is_digit(word[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Template terms start with a byte that does not show up in text logs, so no
+// query word can look one up by accident.
+static Template* make_template(TemplateMiner* miner, TemplateGroup* group) {
+  Arena*    arena   = miner->index_arena;
+  Template* result  = allocate<Template>(arena);
+  result->tokens      = allocate_array<String>(arena, miner->token_count);
+  result->token_count = miner->token_count;
+  for (I32 i = 0; i < miner->token_count; i++) {
+    String token      = miner->tokens[i];
+    result->tokens[i] = allocate_bytes(arena, token.size, 1);
+    memcpy(result->tokens[i].data, token.data, token.size);
+  }
+
+  char term[32] = {};
+  I32  size     = snprintf(term, sizeof(term), "\x01%lld", __atomic_fetch_add(&template_ids, 1, __ATOMIC_RELAXED));
+  result->term = allocate_bytes(arena, size, 1);
+  memcpy(result->term.data, term, size);
+
+  result->next      = group->templates;
+  group->templates  = result;
+  group->template_count++;
+
+  if (miner->template_count == miner->template_capacity) {
+    miner->template_capacity = miner->template_capacity == 0 ? 64 : 2 * miner->template_capacity;
+    Template** grown         = allocate_array<Template*>(miner->build_arena, miner->template_capacity);
+    if (miner->template_count > 0) {
+      memcpy(grown, miner->templates, sizeof(Template*) * miner->template_count);
+    }
+    miner->templates = grown;
+  }
+  miner->templates[miner->template_count] = result;
+  miner->template_count++;
+  return result;
+}
+
+// Tokens with digits in them are most likely parameters, so they all lead to
+// the same group.
+static TemplateGroup* find_group(TemplateMiner* miner) {
+  String first  = has_digit(miner->tokens[0]) ? String() : miner->tokens[0];
+  U64    hash   = hash_word(first) ^ (miner->token_count * 0x9E3779B97F4A7C15ull);
+  I64    bucket = hash & (TEMPLATE_BUCKET_COUNT - 1);
+
+  TemplateGroup* group = miner->buckets[bucket];
+  while (group != nullptr && (group->token_count != miner->token_count || !(group->first == first))) {
+    group = group->next;
+  }
+  if (group == nullptr) {
+    group                  = allocate<TemplateGroup>(miner->build_arena);
+    group->token_count     = miner->token_count;
+    group->first           = first;
+    group->next            = miner->buckets[bucket];
+    miner->buckets[bucket] = group;
+  }
+  return group;
+}
+
+// Finds the line's template, making or widening one if needed. Lines that are
+// empty, too long or in a full group get none and are indexed word by word.
+static Template* mine_line(TemplateMiner* miner, String line) {
+  miner->current     = nullptr;
+  miner->next_token  = 0;
+  miner->token_count = 0;
+  for (I64 i = 0; i < line.size; i++) {
+    I64 end = find(line, ' ', i);
+    if (end > i) {
+      if (miner->token_count == TEMPLATE_MAX_TOKENS) {
+	return nullptr;
+      }
+      miner->tokens[miner->token_count] = slice(line, i, end);
+      miner->token_count++;
+    }
+    i = end;
+  }
+  if (miner->token_count == 0) {
+    return nullptr;
+  }
+
+  TemplateGroup* group           = find_group(miner);
+  Template*      best            = nullptr;
+  I32            best_same       = -1;
+  I32            best_parameters = -1;
+  for (Template* candidate = group->templates; candidate != nullptr; candidate = candidate->next) {
+    I32 same       = 0;
+    I32 parameters = 0;
+    for (I32 i = 0; i < miner->token_count; i++) {
+      if (candidate->tokens[i].size == 0) {
+	parameters++;
+      } else if (candidate->tokens[i] == miner->tokens[i]) {
+	same++;
+      }
+    }
+    if (same > best_same || (same == best_same && parameters > best_parameters)) {
+      best            = candidate;
+      best_same       = same;
+      best_parameters = parameters;
+    }
+  }
+
+  if (best == nullptr || best_same < TEMPLATE_SIMILARITY * miner->token_count) {
+    if (group->template_count == TEMPLATE_GROUP_SIZE) {
+      return nullptr;
+    }
+    best = make_template(miner, group);
+  } else {
+    for (I32 i = 0; i < miner->token_count; i++) {
+      if (best->tokens[i].size > 0 && !(best->tokens[i] == miner->tokens[i])) {
+	RetiredToken* retired = allocate<RetiredToken>(miner->index_arena);
+	retired->word         = best->tokens[i];
+	retired->line_count   = best->line_count;
+	retired->next         = best->retired;
+	best->retired         = retired;
+	best->tokens[i]       = {};
+      }
+    }
+  }
+  best->line_count++;
+  miner->current = best;
+  return best;
+}
+
+// Whether a word of the line mine_line last saw is covered by its template.
+// Words come in the order of the tokens, so a cursor finds them. Words from
+// between qoutes start inside a token and are never covered.
+static bool is_constant(TemplateMiner* miner, String word) {
+  if (miner == nullptr || miner->current == nullptr) {
+    return false;
+  }
+  while (miner->next_token < miner->token_count && miner->tokens[miner->next_token].data < word.data) {
+    miner->next_token++;
+  }
+  if (miner->next_token == miner->token_count) {
+    return false;
+  }
+  String token = miner->tokens[miner->next_token];
+  return token.data == word.data && token.size == word.size && miner->current->tokens[miner->next_token].size > 0;
+}
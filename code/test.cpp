@@ -1,14 +1,533 @@
+#include <arpa/inet.h>
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 #include "prelude.hpp"
 #include "print.hpp"
 #include "arena.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+#include "mapping.hpp"
+#include "trace.hpp"
+#include "lz4.hpp"
+#include "deflate.hpp"
+#include "chunks.hpp"
+#include "blocks.hpp"
+#include "bloom.hpp"
+#include "dictionary.hpp"
+#include "tokenizer.hpp"
+#include "template.hpp"
+#include "segment.hpp"
+#include "index.hpp"
+#include "compact.hpp"
+#include "top.hpp"
+#include "query.hpp"
+
+// Behavior tests for the codecs, filters and postings the indexer is built
+// from. Every check that fails is reported and the run exits with a failure
+// once all of them have run.
+
+static I64 failures;
+
+static void expect(bool passed, const char* what) {
+  if (!passed) {
+    println(ERROR "Failed: ", what, '.');
+    failures++;
+  }
+}
+
+static String random_bytes(Arena* arena, Random* random, I64 size, I64 alphabet) {
+  String bytes = allocate_bytes(arena, size, 1);
+  for (I64 i = 0; i < size; i++) {
+    bytes[i] = 'a' + next_below(random, alphabet);
+  }
+  return bytes;
+}
+
+// Lines of words w0 to w<vocabulary - 1>, with some words repeated in a line.
+static String random_log(Arena* arena, Random* random, I64 line_count, I64 vocabulary) {
+  String log  = allocate_bytes(arena, line_count * 8 * 8, 1);
+  I64    used = 0;
+  for (I64 i = 0; i < line_count; i++) {
+    I64 word_count = 1 + next_below(random, 7);
+    for (I64 j = 0; j < word_count; j++) {
+      used += snprintf((char*) &log[used], 8, j == 0 ? "w%lld" : " w%lld", next_below(random, vocabulary));
+    }
+    log[used] = '\n';
+    used++;
+  }
+  log.size = used;
+  return log;
+}
+
+static void test_lz4(Arena* arena) {
+  I64    saved  = save(arena);
+  Random random = { 1 };
+
+  String inputs[] = {
+    {},
+    "a",
+    "abcdabcdabcd",
+    random_bytes(arena, &random, 100000, 256),
+    random_bytes(arena, &random, 200000, 3),
+    random_log(arena, &random, 20000, 300),
+    allocate_bytes(arena, 70000, 1),
+  };
+  for (I64 i = 0; i < (I64) length(inputs); i++) {
+    String input      = inputs[i];
+    String compressed = allocate_bytes(arena, lz4_bound(input.size), 1);
+    compressed.size   = lz4_compress(input, compressed.data);
+    expect(compressed.size <= lz4_bound(input.size), "LZ4 output fits in lz4_bound");
+
+    String output = allocate_bytes(arena, input.size, 1);
+    expect(lz4_decompress(compressed, output) == input.size, "LZ4 decompresses to the input size");
+    expect(output == input, "LZ4 round trips its input");
+
+    if (input.size > 0) {
+      expect(lz4_decompress(compressed, prefix(output, input.size - 1)) == -1, "LZ4 rejects output that is too small");
+      expect(lz4_decompress(prefix(compressed, compressed.size - 1), output) != input.size, "LZ4 notices truncated input");
+    }
+  }
+  restore(arena, saved);
+}
+
+// An inflater written from RFC 1951 rather than from deflate.hpp. It only
+// knows the stored and fixed Huffman blocks the encoder emits.
+struct BitReader {
+  String input;
+  I64    position;
+  U32    bits;
+  I32    bit_count;
+  bool   overrun;
+};
+
+static U32 read_bits(BitReader* reader, I32 count) {
+  while (reader->bit_count < count) {
+    if (reader->position == reader->input.size) {
+      reader->overrun = true;
+      return 0;
+    }
+    reader->bits      |= (U32) reader->input[reader->position] << reader->bit_count;
+    reader->bit_count += 8;
+    reader->position++;
+  }
+  U32 value          = reader->bits & ((1u << count) - 1);
+  reader->bits     >>= count;
+  reader->bit_count -= count;
+  return value;
+}
+
+// Huffman codes are packed starting from their most significant bit.
+static U32 read_code(BitReader* reader, I32 count) {
+  U32 code = 0;
+  for (I32 i = 0; i < count; i++) {
+    code = (code << 1) | read_bits(reader, 1);
+  }
+  return code;
+}
+
+static I32 read_fixed_symbol(BitReader* reader) {
+  U32 code = read_code(reader, 7);
+  if (code <= 0x17) {
+    return 256 + code;
+  }
+  code = (code << 1) | read_code(reader, 1);
+  if (code >= 0x30 && code <= 0xBF) {
+    return code - 0x30;
+  }
+  if (code >= 0xC0 && code <= 0xC7) {
+    return 280 + code - 0xC0;
+  }
+  code = (code << 1) | read_code(reader, 1);
+  return 144 + code - 0x190;
+}
+
+// Returns the size of the inflated stream in output, or -1 if it is malformed.
+static I64 inflate(String input, String output) {
+  U32 length_bases  [29] = {};
+  U32 length_extra  [29] = {};
+  U32 distance_bases[30] = {};
+  U32 distance_extra[30] = {};
+  length_bases[0]   = 3;
+  distance_bases[0] = 1;
+  for (I32 i = 0; i < 29; i++) {
+    length_extra[i] = i < 8 || i == 28 ? 0 : (i - 4) / 4;
+    if (i > 0) {
+      length_bases[i] = i == 28 ? 258 : length_bases[i - 1] + (1 << length_extra[i - 1]);
+    }
+  }
+  for (I32 i = 0; i < 30; i++) {
+    distance_extra[i] = i < 4 ? 0 : i / 2 - 1;
+    if (i > 0) {
+      distance_bases[i] = distance_bases[i - 1] + (1 << distance_extra[i - 1]);
+    }
+  }
+
+  BitReader reader = {};
+  reader.input     = input;
+  I64  o           = 0;
+  bool final       = false;
+  while (!final) {
+    final    = read_bits(&reader, 1);
+    U32 type = read_bits(&reader, 2);
+    if (type == 0) {
+      reader.bits      = 0;
+      reader.bit_count = 0;
+      U32 size         = read_bits(&reader, 16);
+      U32 check        = read_bits(&reader, 16);
+      if (reader.overrun || (size ^ 0xFFFF) != check || reader.position + size > input.size || o + size > output.size) {
+	return -1;
+      }
+      memcpy(&output[o], &input[reader.position], size);
+      reader.position += size;
+      o               += size;
+    } else if (type == 1) {
+      while (true) {
+	I32 symbol = read_fixed_symbol(&reader);
+	if (reader.overrun || symbol > 285) {
+	  return -1;
+	}
+	if (symbol == 256) {
+	  break;
+	}
+	if (symbol < 256) {
+	  if (o == output.size) {
+	    return -1;
+	  }
+	  output[o] = symbol;
+	  o++;
+	  continue;
+	}
+
+	I64 match_length = length_bases[symbol - 257] + read_bits(&reader, length_extra[symbol - 257]);
+	U32 code         = read_code(&reader, 5);
+	if (reader.overrun || code >= 30) {
+	  return -1;
+	}
+	I64 distance = distance_bases[code] + read_bits(&reader, distance_extra[code]);
+	if (reader.overrun || distance > o || o + match_length > output.size) {
+	  return -1;
+	}
+	for (I64 k = 0; k < match_length; k++) {
+	  output[o + k] = output[o + k - distance];
+	}
+	o += match_length;
+      }
+    } else {
+      return -1;
+    }
+  }
+  return o;
+}
+
+static U32 bitwise_crc32(String input) {
+  U32 crc = 0xFFFFFFFF;
+  for (I64 i = 0; i < input.size; i++) {
+    crc ^= input[i];
+    for (I32 j = 0; j < 8; j++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+static void test_deflate(Arena* arena) {
+  I64    saved  = save(arena);
+  Random random = { 2 };
+
+  String inputs[] = {
+    {},
+    "a",
+    random_bytes(arena, &random, 70000, 256),
+    random_bytes(arena, &random, 100000, 4),
+    random_log(arena, &random, 20000, 300),
+    allocate_bytes(arena, 70000, 1),
+  };
+  for (I64 i = 0; i < (I64) length(inputs); i++) {
+    String input      = inputs[i];
+    String compressed = gzip_compress(arena, input);
+    U8     header[]   = { 0x1F, 0x8B, 8, 0 };
+    expect(compressed.size >= 18 && memcmp(compressed.data, header, sizeof(header)) == 0, "gzip output starts with a gzip header");
+
+    String output = allocate_bytes(arena, input.size + 1, 1);
+    output.size   = inflate(slice(compressed, 10, compressed.size - 8), output);
+    expect(output == input, "gzip output inflates to its input");
+
+    U32 trailer[2] = {};
+    memcpy(trailer, &compressed[compressed.size - 8], sizeof(trailer));
+    expect(trailer[0] == bitwise_crc32(input), "gzip trailer has the CRC-32 of the input");
+    expect(trailer[1] == (U32) input.size, "gzip trailer has the size of the input");
+  }
+
+  // Streamed like the chunks of a response: compressed blocks, a sync flush
+  // and a stored block, ended by an empty final block.
+  String    log    = inputs[4];
+  String    first  = prefix(log, 30000);
+  String    second = slice(log, 30000, 40000);
+  String    third  = suffix(log, 40000);
+  String    stream = allocate_bytes(arena, 2 * log.size + 64, 1);
+  BitWriter writer = {};
+  writer.output    = stream.data;
+  deflate_block(arena, &writer, first, false);
+  store_block(&writer, {}, false);
+  store_block(&writer, second, false);
+  deflate_block(arena, &writer, third, false);
+  deflate_block(arena, &writer, {}, true);
+  align_to_byte(&writer);
+  stream.size = writer.used;
+
+  String output = allocate_bytes(arena, log.size + 1, 1);
+  output.size   = inflate(stream, output);
+  expect(output == log, "a stream of deflate and stored blocks inflates to its input");
+  expect(gzip_crc32(third, gzip_crc32(second, gzip_crc32(first))) == bitwise_crc32(log), "gzip_crc32 continues a checksum");
+  restore(arena, saved);
+}
+
+static void test_bloom(Arena* arena) {
+  I64 saved      = save(arena);
+  I64 word_count = 20000;
+
+  Bloom* bloom = make_bloom(arena, word_count);
+  for (I64 i = 0; i < word_count; i++) {
+    char word[32] = {};
+    snprintf(word, sizeof(word), "term-%lld", i);
+    add_to_bloom(bloom, word);
+  }
+
+  I64 missing = 0;
+  for (I64 i = 0; i < word_count; i++) {
+    char word[32] = {};
+    snprintf(word, sizeof(word), "term-%lld", i);
+    missing += !bloom_contains(bloom, word);
+  }
+  expect(missing == 0, "the Bloom filter has every word added to it");
+
+  I64 false_positives = 0;
+  for (I64 i = 0; i < word_count; i++) {
+    char word[32] = {};
+    snprintf(word, sizeof(word), "absent-%lld", i);
+    false_positives += bloom_contains(bloom, word);
+  }
+  expect(false_positives < word_count / 20, "the Bloom filter rules out most absent words");
+
+  Bloom* empty = make_bloom(arena, 0);
+  expect(!bloom_contains(empty, "term-0"), "an empty Bloom filter has no words");
+  expect(bloom_contains(nullptr, "term-0"), "a missing Bloom filter might have any word");
+  restore(arena, saved);
+}
+
+static I32 compare_values(const void* a, const void* b) {
+  I64 first  = *(I64*) a;
+  I64 second = *(I64*) b;
+  return first < second ? -1 : first > second;
+}
+
+// Sorted, with repeats like the postings of a word that is twice on a line.
+static Postings random_postings(Arena* arena, Random* random, I64 count, I64 range) {
+  Postings postings = {};
+  for (I64 i = 0; i < count; i++) {
+    append_posting(arena, &postings, next_below(random, range));
+  }
+  qsort(postings.values, postings.count, sizeof(I64), compare_values);
+  return postings;
+}
+
+// The distinct values of a or b, or of a and b.
+static bool matches_naive(Postings result, Postings a, Postings b, bool both, I64 range, U8* seen) {
+  memset(seen, 0, range);
+  for (I64 i = 0; i < a.count; i++) {
+    seen[a.values[i]] |= 1;
+  }
+  for (I64 i = 0; i < b.count; i++) {
+    seen[b.values[i]] |= 2;
+  }
+
+  I64 r = 0;
+  for (I64 value = 0; value < range; value++) {
+    if (both ? seen[value] == 3 : seen[value] != 0) {
+      if (r == result.count || result.values[r] != value) {
+	return false;
+      }
+      r++;
+    }
+  }
+  return r == result.count;
+}
+
+static void test_postings(Arena* arena) {
+  I64    saved  = save(arena);
+  Random random = { 3 };
+
+  Cancel cancel        = {};
+  cancel.connection_fd = -1;
+  cancel.deadline      = INT64_MAX;
+
+  I64 sizes[][3] = {
+    { 0, 0, 10 },
+    { 0, 50, 100 },
+    { 1, 1, 2 },
+    { 100, 100, 150 },
+    { 10, 100000, 200000 },
+    { 100000, 7, 200000 },
+    { 5000, 5000, 1000000 },
+    { 20000, 20000, 30000 },
+  };
+  U8* seen = allocate_array<U8>(arena, 1000000);
+  for (I64 i = 0; i < (I64) length(sizes); i++) {
+    I64      range = sizes[i][2];
+    Postings a     = random_postings(arena, &random, sizes[i][0], range);
+    Postings b     = random_postings(arena, &random, sizes[i][1], range);
+    expect(matches_naive(intersect(arena, a, b, &cancel), a, b, true, range, seen), "intersect gives the values in both lists once");
+    expect(matches_naive(unite(arena, a, b, &cancel), a, b, false, range, seen), "unite gives the values in either list once");
+  }
+
+  Postings lists[5] = {};
+  Postings all      = {};
+  for (I64 i = 0; i < (I64) length(lists); i++) {
+    lists[i] = random_postings(arena, &random, 1000 * (i + 1), 50000);
+    for (I64 j = 0; j < lists[i].count; j++) {
+      append_posting(arena, &all, lists[i].values[j]);
+    }
+  }
+  expect(matches_naive(unite_all(arena, lists, length(lists), &cancel), all, {}, false, 50000, seen), "unite_all gives the values in any list once");
+  expect(cancel.reason == CANCEL_NONE, "set operations are not cancelled without a deadline");
+  restore(arena, saved);
+}
+
+// Every term of index is a word w<n> whose postings are those of expected[n]
+// in each log in turn, and the line of each posting has the word.
+static bool matches_logs(Index* index, Postings** expected, I32 log_count, I64 vocabulary) {
+  I64 words = 0;
+  for (I64 n = 0; n < vocabulary; n++) {
+    bool used = false;
+    for (I32 f = 0; f < log_count; f++) {
+      used = used || expected[f][n].count > 0;
+    }
+    words += used;
+  }
+  if (index->stats.terms != words) {
+    return false;
+  }
+
+  TermIterator terms    = iterate_terms(index);
+  String       word     = {};
+  Postings     postings = {};
+  while (next_term(&terms, &word, &postings)) {
+    if (word.size < 2 || word[0] != 'w') {
+      return false;
+    }
+    I64 n = parse_size(suffix(word, 1));
+    I64 p = 0;
+    for (I32 f = 0; f < log_count; f++) {
+      Postings lines = expected[f][n];
+      for (I64 i = 0; i < lines.count; i++) {
+	I64 location = log_count > 1 ? make_file_location(f, lines.values[i]) : lines.values[i];
+	if (p == postings.count || postings.values[p] != location) {
+	  return false;
+	}
+	p++;
+      }
+    }
+    if (p != postings.count) {
+      return false;
+    }
+
+    String       line       = read_line(index, postings.values[0]);
+    WordIterator line_words = iterate_words(prefix(line, line.size - 1));
+    String       line_word  = {};
+    bool         found      = false;
+    while (!found && next_word(&line_words, &line_word)) {
+      found = line_word == word;
+    }
+    if (!found) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Postings* naive_postings(Arena* arena, String log, I64 vocabulary) {
+  Postings* expected = allocate_array<Postings>(arena, vocabulary);
+  I64       start    = 0;
+  for (I64 i = 0; i < log.size; i++) {
+    if (log[i] == 'w') {
+      I64 n = 0;
+      for (i++; is_digit(log[i]); i++) {
+	n = 10 * n + log[i] - '0';
+      }
+      append_posting(arena, &expected[n], start);
+    }
+    if (log[i] == '\n') {
+      start = i + 1;
+    }
+  }
+  return expected;
+}
+
+static void test_segments(Arena* index_arena, Arena* node_arena, Arena* scratch_arena) {
+  char directory[] = "/tmp/indexer-test-XXXXXX";
+  if (mkdtemp(directory) == nullptr) {
+    expect(false, "a directory for the test logs can be made");
+    return;
+  }
+
+  Random    random      = { 4 };
+  I64       vocabulary  = 500;
+  String    paths[2]    = {};
+  Postings* expected[2] = {};
+  for (I32 f = 0; f < 2; f++) {
+    String log  = random_log(index_arena, &random, f == 0 ? 150000 : 20000, vocabulary);
+    paths[f]    = concatonate_paths(index_arena, directory, f == 0 ? "first.log" : "second.log");
+    expected[f] = naive_postings(index_arena, log, vocabulary);
+    I32 fd      = open((char*) paths[f].data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    expect(write_all(fd, log), "the test logs can be written");
+    assert(close(fd) == 0);
+  }
+
+  Options tree_options            = {};
+  Options segment_options         = {};
+  segment_options.memory_budget   = MIN_MEMORY_BUDGET;
+  segment_options.spill_directory = directory;
+
+  Index* tree   = index_file(index_arena, node_arena, scratch_arena, &tree_options, paths[0]);
+  Index* first  = index_file(index_arena, node_arena, scratch_arena, &segment_options, paths[0]);
+  Index* second = index_file(index_arena, node_arena, scratch_arena, &segment_options, paths[1]);
+  expect(tree != nullptr && first != nullptr && second != nullptr, "the test logs can be indexed");
+  if (tree != nullptr && first != nullptr && second != nullptr) {
+    expect(matches_logs(tree, expected, 1, vocabulary), "an index built in memory has the postings of its log");
+    expect(matches_logs(first, expected, 1, vocabulary), "a segment spilled in runs has the postings of its log");
+    expect(matches_logs(second, &expected[1], 1, vocabulary), "a segment of a second log has the postings of its log");
+
+    Index* inputs[] = { tree, second };
+    Index* merged   = merge_indexes(index_arena, scratch_arena, &segment_options, inputs, length(inputs));
+    expect(merged != nullptr && matches_logs(merged, expected, 2, vocabulary), "a merged segment has the postings of both logs");
+  }
+
+  for (I32 f = 0; f < 2; f++) {
+    unlink((char*) paths[f].data);
+  }
+  expect(rmdir(directory) == 0, "nothing is left in the spill directory");
+}
 
 struct Entry {
   String word;
@@ -30,17 +549,14 @@ struct BTree {
 
 static_assert(sizeof(BTree) == BTREE_SIZE);
 
-I32 main() {
-  atexit(flush);
-  println(INFO "Running tests.");
-
-  Arena arenas[2] = {};
-  for (I64 i = 0; i < length(arenas); i++) {
-    arenas[i] = make_arena(1ll << 32);
-  }
-
+// An early experiment with an on-disk B-tree of the words of a log, kept for
+// reference. It needs the edgar-scraper example log.
+static void run_btree_experiment(Arena* arenas) {
   I32 raw_fd = open("examples/edgar-scraper/edgar-scraper-2024-10-10T00-22-19.198.log", O_RDONLY);
-  assert(raw_fd != -1);
+  if (raw_fd == -1) {
+    println(WARN "Skipped the B-tree experiment, its example log is missing.");
+    return;
+  }
 
   I32 words_fd     = open("build/words", O_RDWR | O_CREAT | O_TRUNC, 0777);
   I64 words_fd_end = 0;
@@ -168,3 +684,33 @@ I32 main() {
     restore(&arenas[0], saved);
   }
 }
+
+I32 main() {
+  atexit(flush);
+  println(INFO "Running tests.");
+
+  Arena arenas[4] = {};
+  for (I64 i = 0; i < 3; i++) {
+    arenas[i] = make_arena(1ll << 36, true);
+  }
+  arenas[3] = make_arena(1ll << 36);
+
+  Arena* index_arena   = &arenas[0];
+  Arena* node_arena    = &arenas[1];
+  Arena* word_arena    = &arenas[2];
+  Arena* scratch_arena = &arenas[3];
+  make_dictionary(word_arena);
+
+  test_lz4(scratch_arena);
+  test_deflate(scratch_arena);
+  test_bloom(scratch_arena);
+  test_postings(scratch_arena);
+  test_segments(index_arena, node_arena, scratch_arena);
+  if (failures > 0) {
+    println(ERROR "Failed ", failures, " checks.");
+    exit(EXIT_FAILURE);
+  }
+  println(INFO "All tests passed.");
+
+  run_btree_experiment(scratch_arena);
+}
@@ -0,0 +1,152 @@
+// Words are indexed exactly as they are in the log unless the tokenizer is
+// set up to derive more terms from them. With split characters every word
+// also gives the pieces between them. With folding every word and piece also
+// gives its folded form, with the case of ASCII and two byte UTF-8 letters
+// folded and, when normalizing numbers, the leading zeros of numbers left
+// off. A folded form that is the same as what it came from is already in the
+// index, so only the others are added, behind FOLDED_PREFIX. A folded query
+// word then costs two lookups, of itself and of itself behind the prefix,
+// however many spellings of it the logs have.
+
+#define FOLDED_PREFIX   '\x02'
+#define MAX_FOLDED_SIZE 256
+
+// Set once from the options, before anything is indexed.
+struct Tokenizer {
+  bool fold_case;
+  bool normalize_numbers;
+  bool splits;
+  bool split[256];
+};
+
+static Tokenizer tokenizer;
+
+static bool folds() {
+  return tokenizer.fold_case || tokenizer.normalize_numbers;
+}
+
+// Latin-1, Greek and Cyrillic capitals are the two byte letters with lower
+// case forms that are two bytes as well.
+static I32 fold_letter(I32 letter) {
+  if (letter < 0x80) {
+    return to_lower(letter);
+  }
+  if ((0xC0 <= letter && letter <= 0xDE && letter != 0xD7) || (0x391 <= letter && letter <= 0x3A9) || (0x410 <= letter && letter <= 0x42F)) {
+    return letter + 0x20;
+  }
+  if (0x400 <= letter && letter <= 0x40F) {
+    return letter + 0x50;
+  }
+  return letter;
+}
+
+// The folded form of word behind FOLDED_PREFIX, in buffer. Words too long for
+// it have none.
+static String fold_word(U8* buffer, String word) {
+  if (word.size + 1 > MAX_FOLDED_SIZE) {
+    return {};
+  }
+
+  I64 start = 0;
+  if (tokenizer.normalize_numbers) {
+    bool number = word.size > 0;
+    for (I64 i = 0; i < word.size && number; i++) {
+      number = is_digit(word[i]);
+    }
+    while (number && start + 1 < word.size && word[start] == '0') {
+      start++;
+    }
+  }
+
+  buffer[0] = FOLDED_PREFIX;
+  I64 size  = 1;
+  for (I64 i = start; i < word.size; i++) {
+    U8 c = word[i];
+    if (!tokenizer.fold_case) {
+      buffer[size] = c;
+      size++;
+    } else if ((c & 0xE0) == 0xC0 && i + 1 < word.size && (word[i + 1] & 0xC0) == 0x80) {
+      I32 letter       = fold_letter(((c & 0x1F) << 6) | (word[i + 1] & 0x3F));
+      buffer[size]     = 0xC0 | (letter >> 6);
+      buffer[size + 1] = 0x80 | (letter & 0x3F);
+      size            += 2;
+      i++;
+    } else {
+      buffer[size] = to_lower(c);
+      size++;
+    }
+  }
+  return String(buffer, size);
+}
+
+// Yields the word, then its folded form, then every piece followed by its
+// folded form, leaving out the folded forms that change nothing.
+struct TokenIterator {
+  String word;
+  I64    next;
+  bool   split;
+  String unfolded;
+  U8     buffer[MAX_FOLDED_SIZE];
+};
+
+static TokenIterator iterate_tokens(String word) {
+  TokenIterator tokens = {};
+  tokens.word          = word;
+  tokens.next          = -1;
+  for (I64 i = 0; i < word.size && tokenizer.splits && !tokens.split; i++) {
+    tokens.split = tokenizer.split[word[i]];
+  }
+  return tokens;
+}
+
+static bool next_token(TokenIterator* tokens, String* term) {
+  if (tokens->next == -1) {
+    tokens->next     = tokens->split ? 0 : tokens->word.size;
+    tokens->unfolded = tokens->word;
+    *term            = tokens->word;
+    return true;
+  }
+
+  if (tokens->unfolded.size > 0) {
+    String unfolded  = tokens->unfolded;
+    tokens->unfolded = {};
+    if (folds()) {
+      String folded = fold_word(tokens->buffer, unfolded);
+      if (folded.size > 0 && !(suffix(folded, 1) == unfolded)) {
+	*term = folded;
+	return true;
+      }
+    }
+  }
+
+  String word = tokens->word;
+  while (tokens->next < word.size) {
+    I64 start = tokens->next;
+    I64 end   = start;
+    while (end < word.size && !tokenizer.split[word[end]]) {
+      end++;
+    }
+    tokens->next = end + 1;
+    if (end > start) {
+      tokens->unfolded = slice(word, start, end);
+      *term            = tokens->unfolded;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether term is one of the terms word is indexed under.
+static bool has_term(String word, String term) {
+  if (!tokenizer.splits && !folds()) {
+    return word == term;
+  }
+  TokenIterator tokens = iterate_tokens(word);
+  String        token  = {};
+  while (next_token(&tokens, &token)) {
+    if (token == term) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,295 @@
+// Top-k aggregation over the lines a query matches: the values of one field,
+// where group=requestId counts the X in every requestId=X, or with group=* the
+// terms that show up alongside the query. There can be as many distinct values
+// as lines, so they are counted with a SpaceSaving sketch of TOP_COUNTERS_PER_K
+// counters for every value asked for. Once every counter is taken a new value
+// replaces the smallest one and takes over its count as error, so counts only
+// ever overestimate, by at most their error, which is at most total / counters.
+//
+// Counters are found through an open addressing table and kept in a min-heap
+// by count, which makes every update constant time apart from the heap moves.
+
+#define TOP_DEFAULT_K      10
+#define TOP_MAX_K          100
+#define TOP_COUNTERS_PER_K 16
+#define TOP_WORD_SIZE      96
+
+// Longer values are cut to TOP_WORD_SIZE bytes and counted together.
+struct TopCounter {
+  U64 hash;
+  I64 count;
+  I64 error;
+  I32 word_size;
+  I32 heap_position;
+  U8  word[TOP_WORD_SIZE];
+};
+
+struct Top {
+  String      field;
+  String*     exclude;
+  I32         exclude_count;
+  I32         k;
+  TopCounter* counters;
+  I32*        heap;
+  I32*        table;
+  I64         table_mask;
+  I32         capacity;
+  I32         used;
+  I64         total;
+};
+
+// A value with its count as the frames carry it. Gathered values remember the
+// shard they came from.
+struct TopValue {
+  String word;
+  I64    count;
+  I64    error;
+  I32    source;
+};
+
+// An empty field counts co-occurring terms instead.
+static Top* make_top(Arena* arena, String group, I32 k, I32 exclude_count) {
+  Top* top           = allocate<Top>(arena);
+  top->k             = k;
+  top->capacity      = k * TOP_COUNTERS_PER_K;
+  top->counters      = allocate_array<TopCounter>(arena, top->capacity);
+  top->heap          = allocate_array<I32>(arena, top->capacity);
+  top->exclude       = allocate_array<String>(arena, exclude_count);
+  top->exclude_count = exclude_count;
+
+  // At most half full keeps the probes short.
+  I64 table_size = 1;
+  while (table_size < 2 * top->capacity) {
+    table_size *= 2;
+  }
+  top->table      = allocate_array<I32>(arena, table_size);
+  top->table_mask = table_size - 1;
+  memset(top->table, -1, sizeof(I32) * table_size);
+
+  if (group != "*") {
+    top->field = allocate_bytes(arena, group.size + 1, 1);
+    memcpy(top->field.data, group.data, group.size);
+    top->field[group.size] = '=';
+  }
+  return top;
+}
+
+static String counter_word(TopCounter* counter) {
+  return String(counter->word, counter->word_size);
+}
+
+static void swap_heap(Top* top, I32 a, I32 b) {
+  I32 swap     = top->heap[a];
+  top->heap[a] = top->heap[b];
+  top->heap[b] = swap;
+  top->counters[top->heap[a]].heap_position = a;
+  top->counters[top->heap[b]].heap_position = b;
+}
+
+static void sift_up_top(Top* top, I32 i) {
+  while (i > 0) {
+    I32 parent = (i - 1) / 2;
+    if (top->counters[top->heap[parent]].count <= top->counters[top->heap[i]].count) {
+      return;
+    }
+    swap_heap(top, i, parent);
+    i = parent;
+  }
+}
+
+static void sift_down_top(Top* top, I32 i) {
+  while (true) {
+    I32 smallest = i;
+    for (I32 child = 2 * i + 1; child <= 2 * i + 2 && child < top->used; child++) {
+      if (top->counters[top->heap[child]].count < top->counters[top->heap[smallest]].count) {
+	smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    swap_heap(top, i, smallest);
+    i = smallest;
+  }
+}
+
+// The slot holding word, or the empty slot it would go in.
+static I64 find_slot(Top* top, U64 hash, String word) {
+  I64 slot = hash & top->table_mask;
+  while (top->table[slot] != -1) {
+    TopCounter* counter = &top->counters[top->table[slot]];
+    if (counter->hash == hash && counter_word(counter) == word) {
+      break;
+    }
+    slot = (slot + 1) & top->table_mask;
+  }
+  return slot;
+}
+
+// Shifts later entries of the same run back, so lookups never stop early at
+// the hole.
+static void remove_slot(Top* top, I64 slot) {
+  I64 hole = slot;
+  for (I64 next = (slot + 1) & top->table_mask; top->table[next] != -1; next = (next + 1) & top->table_mask) {
+    I64 home = top->counters[top->table[next]].hash & top->table_mask;
+    if (((next - home) & top->table_mask) >= ((next - hole) & top->table_mask)) {
+      top->table[hole] = top->table[next];
+      hole             = next;
+    }
+  }
+  top->table[hole] = -1;
+}
+
+static void add_to_top(Top* top, String word) {
+  word.size = min(word.size, (I64) TOP_WORD_SIZE);
+  top->total++;
+
+  U64 hash = hash_word(word);
+  I64 slot = find_slot(top, hash, word);
+  if (top->table[slot] != -1) {
+    TopCounter* counter = &top->counters[top->table[slot]];
+    counter->count++;
+    sift_down_top(top, counter->heap_position);
+    return;
+  }
+
+  I32 index = 0;
+  I64 count = 0;
+  if (top->used < top->capacity) {
+    index                              = top->used;
+    top->heap[top->used]               = index;
+    top->counters[index].heap_position = top->used;
+    top->used++;
+  } else {
+    index = top->heap[0];
+    count = top->counters[index].count;
+    remove_slot(top, find_slot(top, top->counters[index].hash, counter_word(&top->counters[index])));
+    slot = find_slot(top, hash, word);
+  }
+
+  TopCounter* counter = &top->counters[index];
+  counter->hash       = hash;
+  counter->count      = count + 1;
+  counter->error      = count;
+  counter->word_size  = word.size;
+  memcpy(counter->word, word.data, word.size);
+  top->table[slot]    = index;
+
+  if (count == 0) {
+    sift_up_top(top, counter->heap_position);
+  } else {
+    sift_down_top(top, counter->heap_position);
+  }
+}
+
+// Values are single words or whatever is in the double qoutes after the
+// equals sign.
+static void add_fields_to_top(Top* top, String line) {
+  String field = top->field;
+  for (I64 i = 0; i + field.size < line.size; i++) {
+    if ((i > 0 && line[i - 1] != ' ') || !starts_with(suffix(line, i), field)) {
+      continue;
+    }
+    I64 start = i + field.size;
+    I64 end   = start;
+    if (line[start] == '"') {
+      start++;
+      end = find(line, '"', start);
+    } else {
+      while (end < line.size && line[end] != ' ') {
+	end++;
+      }
+    }
+    if (end > start) {
+      add_to_top(top, slice(line, start, end));
+    }
+    i = end;
+  }
+}
+
+// The time at the start of every line would be its most common term, so
+// only the words after time_end count.
+static void add_line_to_top(Top* top, String line, I64 time_end) {
+  TRACE_ZONE(ZONE_GROUP);
+  if (line.size > 0 && line[line.size - 1] == '\n') {
+    line.size--;
+  }
+  if (top->field.size > 0) {
+    add_fields_to_top(top, line);
+    return;
+  }
+
+  WordIterator words = iterate_words(suffix(line, time_end));
+  String       word  = {};
+  while (next_word(&words, &word)) {
+    bool excluded = false;
+    for (I32 i = 0; i < top->exclude_count && !excluded; i++) {
+      excluded = has_term(word, top->exclude[i]);
+    }
+    if (!excluded) {
+      add_to_top(top, word);
+    }
+  }
+}
+
+// Anything the sketch dropped was counted at most this many times.
+static I64 top_floor(Top* top) {
+  return top->used == top->capacity ? top->counters[top->heap[0]].count : 0;
+}
+
+static I32 compare_top_counts(const void* a, const void* b) {
+  TopValue* left  = (TopValue*) a;
+  TopValue* right = (TopValue*) b;
+  if (left->count != right->count) {
+    return left->count > right->count ? -1 : 1;
+  }
+  return compare(left->word, right->word);
+}
+
+static TopValue* top_values(Arena* arena, Top* top) {
+  TopValue* values = allocate_array<TopValue>(arena, top->used);
+  for (I32 i = 0; i < top->used; i++) {
+    values[i].word  = counter_word(&top->counters[i]);
+    values[i].count = top->counters[i].count;
+    values[i].error = top->counters[i].error;
+  }
+  qsort(values, top->used, sizeof(TopValue), compare_top_counts);
+  return values;
+}
+
+// The values with the largest counts, the number of values counted and the
+// floor, which a coordinator needs to merge the values of its shards.
+static void write_top(Arena* arena, I32 connection_fd, TopValue* values, I32 count, I64 total, I64 floor) {
+  I64 saved = save(arena);
+
+  I64 payload_size = 3 * sizeof(I32);
+  for (I32 i = 0; i < count; i++) {
+    payload_size += 3 * sizeof(I32) + align(values[i].word.size, 4);
+  }
+  String payload = allocate_bytes(arena, payload_size, 4);
+  I32    header[] = { count, (I32) min(total, (I64) INT32_MAX), (I32) min(floor, (I64) INT32_MAX) };
+  memcpy(payload.data, header, sizeof(header));
+  I64 used = sizeof(header);
+  for (I32 i = 0; i < count; i++) {
+    I32 entry[] = {
+      (I32) min(values[i].count, (I64) INT32_MAX),
+      (I32) min(values[i].error, (I64) INT32_MAX),
+      (I32) values[i].word.size,
+    };
+    memcpy(&payload[used], entry, sizeof(entry));
+    memcpy(&payload[used + sizeof(entry)], values[i].word.data, values[i].word.size);
+    used += sizeof(entry) + align(values[i].word.size, 4);
+  }
+
+  I32 top_tag  = 5;
+  I32 top_size = payload.size;
+
+  struct iovec parts[] = {
+    to_iovec(&top_tag),
+    to_iovec(&top_size),
+    to_iovec(payload),
+  };
+  write_frame(connection_fd, parts, length(parts));
+
+  restore(arena, saved);
+}
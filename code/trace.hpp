@@ -0,0 +1,264 @@
+// Scoped timing zones for the hot paths. Building with -DTRACE (TRACE=1 bash
+// build.sh) makes every TRACE_ZONE read the cycle counter on entry and exit and
+// add its call count, cycles and bytes to a per-thread table. Without it every
+// macro expands to nothing, so zones can stay in the code.
+//
+// Cycles are kept both inclusive, everything the zone did, and exclusive, with
+// the time spent in nested zones taken out. Recursive zones like lookup only
+// count their outermost call towards inclusive cycles.
+
+#ifdef TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_EVENT_CAPACITY (1 << 20)
+
+enum TraceZoneId {
+  ZONE_NONE,
+  ZONE_BUILD,
+  ZONE_COMPRESS,
+  ZONE_DECOMPRESS,
+  ZONE_INDEX_LINES,
+  ZONE_INSERT,
+  ZONE_BALANCE,
+  ZONE_QUERY,
+  ZONE_LOOKUP,
+  ZONE_INTERSECT,
+  ZONE_READ_LINE,
+  ZONE_TIME_FILTER,
+  ZONE_WRITE,
+  ZONE_MERGE,
+  ZONE_GROUP,
+  ZONE_INTERN,
+  ZONE_COUNT,
+};
+
+// Zones that run once per word, line or tree level are too fine to be worth a
+// trace event each, they only show up in the aggregated breakdown.
+static struct {
+  const char* name;
+  bool        events;
+} trace_zones[ZONE_COUNT] = {
+  { "none",        false },
+  { "build",       true  },
+  { "compress",    true  },
+  { "decompress",  true  },
+  { "index_lines", true  },
+  { "insert",      false },
+  { "balance",     false },
+  { "query",       true  },
+  { "lookup",      false },
+  { "intersect",   true  },
+  { "read_line",   false },
+  { "time_filter", false },
+  { "write",       true  },
+  { "merge",       true  },
+  { "group",       false },
+  { "intern",      true  },
+};
+
+struct TraceZone {
+  I64 calls;
+  U64 inclusive;
+  U64 exclusive;
+  I64 bytes;
+};
+
+struct TraceEvent {
+  TraceZoneId zone;
+  U64         start;
+  U64         end;
+};
+
+struct TraceTable {
+  TraceZone   zones[ZONE_COUNT];
+  TraceZoneId open;
+  U64         start;
+  I32         thread;
+  TraceEvent* events;
+  I64         event_count;
+  bool        dropped_events;
+};
+
+static thread_local TraceTable trace_table;
+
+static I32 trace_fd      = -1;
+static I32 trace_threads = 0;
+static U64 trace_start;
+static F64 trace_cycles_per_nanosecond;
+
+static U64 read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  U64 cycles = 0;
+  asm volatile("mrs %0, cntvct_el0" : "=r" (cycles));
+  return cycles;
+#else
+  return now_nanoseconds();
+#endif
+}
+
+struct TraceScope {
+  TraceZoneId zone;
+  TraceZoneId parent;
+  U64         start;
+  U64         old_inclusive;
+
+  TraceScope(TraceZoneId zone, I64 bytes) {
+    TraceZone* entry    = &trace_table.zones[zone];
+    this->zone          = zone;
+    this->parent        = trace_table.open;
+    this->old_inclusive = entry->inclusive;
+    entry->calls++;
+    entry->bytes       += bytes;
+    trace_table.open    = zone;
+    this->start         = read_cycles();
+  }
+
+  ~TraceScope() {
+    U64 end     = read_cycles();
+    U64 elapsed = end - start;
+
+    TraceZone* entry = &trace_table.zones[zone];
+    entry->inclusive  = old_inclusive + elapsed;
+    entry->exclusive += elapsed;
+    trace_table.zones[parent].exclusive -= elapsed;
+    trace_table.open  = parent;
+
+    if (trace_fd != -1 && trace_zones[zone].events) {
+      if (trace_table.events == nullptr) {
+	trace_table.events = (TraceEvent*) mmap(NULL, sizeof(TraceEvent) * TRACE_EVENT_CAPACITY, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	assert(trace_table.events != MAP_FAILED);
+      }
+      if (trace_table.event_count < TRACE_EVENT_CAPACITY) {
+	trace_table.events[trace_table.event_count] = { zone, start, end };
+	trace_table.event_count++;
+      } else {
+	trace_table.dropped_events = true;
+      }
+    }
+  }
+};
+
+// Cycle counters do not tick at a documented rate, so it is measured against
+// the monotonic clock the first time it is needed.
+static void calibrate_cycles() {
+  I64 start_nanoseconds = now_nanoseconds();
+  U64 start_cycles      = read_cycles();
+  while (now_nanoseconds() - start_nanoseconds < 10000000) {
+  }
+  U64 cycles      = read_cycles() - start_cycles;
+  I64 nanoseconds = now_nanoseconds() - start_nanoseconds;
+  trace_cycles_per_nanosecond = (F64) cycles / nanoseconds;
+}
+
+static void start_trace(const char* path) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace_fd == -1) {
+    println(ERROR "Failed to open \"", path, "\": ", get_error(), '.');
+    exit(EXIT_FAILURE);
+  }
+  assert(write(trace_fd, "[\n", 2) == 2);
+  if (trace_cycles_per_nanosecond == 0) {
+    calibrate_cycles();
+  }
+  trace_start = read_cycles();
+}
+
+// Events are appended as they are flushed and the closing bracket is never
+// written, which the trace event format allows, so a trace stays loadable in
+// chrome://tracing or Perfetto even if the process is killed.
+static void flush_trace_events() {
+  if (trace_fd == -1 || trace_table.event_count == 0) {
+    return;
+  }
+  if (trace_table.thread == 0) {
+    trace_table.thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+  }
+
+  char buffer[1 << 16];
+  I64  buffered = 0;
+  for (I64 i = 0; i < trace_table.event_count; i++) {
+    TraceEvent* event = &trace_table.events[i];
+    buffered += snprintf(
+      &buffer[buffered], sizeof(buffer) - buffered,
+      "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+      trace_zones[event->zone].name, trace_table.thread,
+      (event->start - trace_start) / trace_cycles_per_nanosecond / 1000,
+      (event->end - event->start) / trace_cycles_per_nanosecond / 1000
+    );
+    if (buffered > (I64) sizeof(buffer) - 256 || i == trace_table.event_count - 1) {
+      if (!write_all(trace_fd, String((U8*) buffer, buffered))) {
+	println(WARN "Failed to write trace events: ", get_error(), '.');
+      }
+      buffered = 0;
+    }
+  }
+
+  if (trace_table.dropped_events) {
+    println(WARN "Dropped trace events past the first ", (I64) TRACE_EVENT_CAPACITY, '.');
+  }
+  trace_table.event_count    = 0;
+  trace_table.dropped_events = false;
+}
+
+// Prints what every zone did since mark was taken with TRACE_MARK.
+static void print_trace(String label, TraceTable* mark) {
+  U64 total = read_cycles() - mark->start;
+
+  char line[256] = {};
+  snprintf(line, sizeof(line), "%.3f", total / trace_cycles_per_nanosecond / 1e6);
+  println(INFO "Trace of ", label, ": ", (I64) total, " cycles, ", String(line), " ms.");
+
+  for (I64 i = ZONE_NONE + 1; i < ZONE_COUNT; i++) {
+    TraceZone* now    = &trace_table.zones[i];
+    TraceZone* before = &mark->zones[i];
+    I64        calls  = now->calls - before->calls;
+    if (calls == 0) {
+      continue;
+    }
+
+    U64 inclusive = now->inclusive - before->inclusive;
+    U64 exclusive = now->exclusive - before->exclusive;
+    I64 bytes     = now->bytes - before->bytes;
+    I64 written   = snprintf(
+      line, sizeof(line), "  %-12s calls=%-9lld exclusive=%-12llu (%5.1f%%) inclusive=%-12llu (%5.1f%%)",
+      trace_zones[i].name, calls, exclusive, 100.0 * exclusive / total, inclusive, 100.0 * inclusive / total
+    );
+    if (bytes > 0 && inclusive > 0) {
+      F64 seconds = inclusive / trace_cycles_per_nanosecond / 1e9;
+      snprintf(&line[written], sizeof(line) - written, " bytes=%lld (%.3f GB/s)", bytes, bytes / seconds / 1e9);
+    }
+    println(INFO "", String(line));
+  }
+  flush_trace_events();
+}
+
+static TraceTable trace_mark() {
+  if (trace_cycles_per_nanosecond == 0) {
+    calibrate_cycles();
+  }
+  TraceTable mark = trace_table;
+  mark.start      = read_cycles();
+  return mark;
+}
+
+#define TRACE_CONCATENATE_(a, b) a##b
+#define TRACE_CONCATENATE(a, b)  TRACE_CONCATENATE_(a, b)
+
+#define TRACE_ZONE(zone)              TraceScope TRACE_CONCATENATE(trace_scope_, __LINE__)(zone, 0)
+#define TRACE_ZONE_BYTES(zone, bytes) TraceScope TRACE_CONCATENATE(trace_scope_, __LINE__)(zone, bytes)
+#define TRACE_MARK(name)              TraceTable name = trace_mark()
+#define TRACE_REPORT(label, mark)     print_trace(label, &mark)
+
+#else
+
+#define TRACE_ZONE(zone)
+#define TRACE_ZONE_BYTES(zone, bytes)
+#define TRACE_MARK(name)
+#define TRACE_REPORT(label, mark)
+
+#endif